@@ -0,0 +1,459 @@
+/*
+ * bench - Microbenchmark and soak test of hidclient's translation and
+ *	   send path, without Bluetooth
+ *
+ *		Synthetic input_event streams are fed to process_event(),
+ *		one host session is connected through socketpairs instead
+ *		of L2CAP, and everything arriving at the host end is decoded
+ *		again. Built with "make bench" from hidcore.c and hidclient.c
+ *		without its main() (see hidclient.h), so it measures exactly
+ *		that code; "make check" runs the soak tests. The "/core"
+ *		scenarios and -c feed a struct hidcore_t of bench's own
+ *		instead, reports going to the loopback sink of hidcore.c:
+ *		the state machine alone, without scheduler and socket.
+ *
+ * Usage:	bench [-e<NUM>] [-s<SECONDS>] [-c] [-b] [-n] [-r<HZ>]
+ *		-e<NUM> feeds NUM events per scenario (default 1000000):
+ *		   typing bursts, 1000 Hz mouse frames and both mixed.
+ *		   Printed are events/s and reports/s of process_event(),
+ *		   send() calls per event and the event->sent latency;
+ *		   then the same through the core alone ("/core")
+ *		-s<SECONDS> instead runs a random key/button/motion stream
+ *		   for that long, checking after each event that the host
+ *		   sees the state sent (no stuck keys, no lost releases,
+ *		   no lost motion). Exits 1 on the first mismatch
+ *		-c runs the soak test on the core alone
+ *		-b runs it with a host that set the boot protocol: 8 bit
+ *		   motion, no wheel, 6 keys
+ *		-n uses NKRO reports, -r<HZ> limits the report rate
+ *		   (as -n/-r of hidclient)
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "hidcore.h"
+#include "hidclient.h"
+
+// What the host end of the socketpair has received
+struct hoststate_t
+{
+    unsigned char	keys[NKRO_BYTES]; // pressed usages
+    char	rollover;	// last keyboard report was ErrorRollOver
+    unsigned char	modify;
+    unsigned char	buttons;
+    long long	dx, dy, wheel; // summed motion
+    unsigned long long	reports;
+};
+
+int		hostctl[2], hostint[2];	// [0] hidclient, [1] host end
+struct hoststate_t	host;
+// The state sent, as the stream generator knows it
+unsigned char	wantkeys[NKRO_BYTES];
+int		wantnkeys	 = 0;
+unsigned char	wantmodify	 = 0;
+unsigned char	wantbuttons	 = 0;
+long long	wantdx = 0, wantdy = 0, wantwheel = 0;
+unsigned long long	events	 = 0;
+long long	feedns		 = 0;	// time spent in process_event()
+// The core alone, see corepath
+struct hidcore_t	core;
+struct hidcore_loopback_t	loopback;
+char		corepath	 = 0;	// feed core instead of process_event()
+char		boot		 = 0;	// host set the boot protocol (-b)
+
+// Keys the generators press: letters and some modifiers
+static const int	letters[] = { KEY_A, KEY_S, KEY_D, KEY_F, KEY_J,
+    KEY_K, KEY_L, KEY_E, KEY_R, KEY_U, KEY_I, KEY_O };
+#define	NLETTERS	( sizeof(letters) / sizeof(letters[0]) )
+static const int	modifiers[] = { KEY_LEFTSHIFT, KEY_RIGHTSHIFT,
+    KEY_RIGHTCTRL, KEY_LEFTMETA };
+#define	NMODIFIERS	( sizeof(modifiers) / sizeof(modifiers[0]) )
+// Control channel messages of the host (HIDP, as hidclient.c defines it)
+#define	HIDP_SET_PROTOCOL_BOOT		0x70
+#define	HIDP_HANDSHAKE_SUCCESSFUL	0x00
+
+static long long now_ns ( void )
+{
+    struct timespec	ts;
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+    return	(long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Decode one report arriving at the host
+static void host_report ( const unsigned char * r, int len )
+{
+    int	k, axes[MOUSE_AXES];
+    ++host.reports;
+    if ( boot && ( len == sizeof(struct hidrep_bootmouse_t) ) )
+    {	// No report IDs, see report_encode()
+        host.buttons = r[1];
+        host.dx += (signed char)r[2];
+        host.dy += (signed char)r[3];
+        return;
+    }
+    if ( boot && ( len == sizeof(struct hidrep_bootkeyb_t) ) )
+    {
+        host.modify = r[1];
+        memset ( host.keys, 0, NKRO_BYTES );
+        host.rollover = ( r[3] == USAGE_ROLLOVER );
+        for ( k = 3; ( k < len ) && ! host.rollover; ++k )
+        {
+            if ( r[k] ) host.keys[r[k] >> 3] |= 1 << ( r[k] & 7 );
+        }
+        return;
+    }
+    if ( ( len == sizeof(struct hidrep_mouse_t) ) && ( r[1] == REPORTID_MOUSE ) )
+    {	// No Resolution Multiplier set: the wheel counts notches
+        hidcore_mouse_get ( r, axes );
+        host.buttons = r[2];
+        host.dx += axes[0];
+        host.dy += axes[1];
+        // The core's reports are not encoded for the host yet
+        host.wheel += corepath ? axes[2] / WHEEL_UNIT : axes[2];
+        return;
+    }
+    if ( r[1] != REPORTID_KEYBD ) return;
+    host.modify = r[2];
+    if ( len == sizeof(struct hidrep_nkro_t) )
+    {
+        memcpy ( host.keys, r + 3, NKRO_BYTES );
+        host.rollover = 0;
+        return;
+    }
+    memset ( host.keys, 0, NKRO_BYTES );
+    host.rollover = ( r[3] == USAGE_ROLLOVER );
+    for ( k = 3; ( k < len ) && ! host.rollover; ++k )
+    {
+        if ( r[k] ) host.keys[r[k] >> 3] |= 1 << ( r[k] & 7 );
+    }
+}
+
+/*
+ *	host_drain - Send what is due (everything with flush set), take in
+ *	everything the host end has got
+ *	Return value: reports still queued
+ */
+static int host_drain ( int flush )
+{
+    unsigned char	buf[64];
+    int	n, queued;
+    if ( corepath )
+    {	// Nothing is queued but in the loopback
+        while ( 0 < ( n = hidcore_loopback_take ( &loopback, buf, NULL ) ) )
+        {
+            host_report ( buf, n );
+        }
+        return	0;
+    }
+    queued = hidclient_pump ( flush );
+    while ( 0 < ( n = recv ( hostint[1], buf, sizeof(buf), MSG_DONTWAIT ) ) )
+    {
+        host_report ( buf, n );
+    }
+    return	queued;
+}
+
+// Everything queued out to the host, not waiting for the -r slots
+static void host_flush ( void )
+{
+    while ( host_drain ( 1 ) > 0 ) {;}
+}
+
+// Feed one event, as if just read from an event device
+static void feed ( int type, int code, int value )
+{
+    struct input_event	ie;
+    long long	t0;
+    int	u;
+    memset ( &ie, 0, sizeof(ie) );
+    ie.type = type;
+    ie.code = code;
+    ie.value = value;
+    if ( type == EV_KEY )
+    {
+        if ( 0 != ( u = hidcore_modmap[code] ) )
+        {
+            wantmodify = value ? ( wantmodify | u ) : ( wantmodify & ~u );
+        }
+        else if ( ( code >= BTN_LEFT ) && ( code <= BTN_MIDDLE ) )
+        {
+            u = 1 << ( code & 0x03 );
+            wantbuttons = value ? ( wantbuttons | u ) : ( wantbuttons & ~u );
+        }
+        else if ( 0 != ( u = hidcore_keymap[code] ) )
+        {
+            if ( value && ! ( wantkeys[u >> 3] & ( 1 << ( u & 7 ) ) ) )
+            {
+                wantkeys[u >> 3] |= 1 << ( u & 7 );
+                ++wantnkeys;
+            }
+            else if ( ! value && ( wantkeys[u >> 3] & ( 1 << ( u & 7 ) ) ) )
+            {
+                wantkeys[u >> 3] &= ~( 1 << ( u & 7 ) );
+                --wantnkeys;
+            }
+        }
+    }
+    if ( type == EV_REL )
+    {
+        if ( code == REL_X ) wantdx += value;
+        if ( code == REL_Y ) wantdy += value;
+        // The boot protocol has no wheel
+        if ( ( code == REL_WHEEL ) && ! boot ) wantwheel += value;
+    }
+    t0 = now_ns ();
+    stampread = stampevent = t0;
+    // As stamped by a device set to CLOCK_MONOTONIC
+    ie.time.tv_sec  = t0 / 1000000000LL;
+    ie.time.tv_usec = t0 % 1000000000LL / 1000;
+    if ( corepath )
+    {
+        hidcore_event ( &core, 0, &ie );
+    } else {
+        process_event ( 0, &ie );
+    }
+    feedns += now_ns () - t0;
+    ++events;
+}
+
+// Key down and up, overlapping with the next one like real typing
+static void gen_typing ( void )
+{
+    static int	last = -1;
+    int	k = rand () % NLETTERS;
+    if ( rand () % 8 == 0 ) feed ( EV_KEY, KEY_LEFTSHIFT, 1 );
+    feed ( EV_KEY, letters[k], 1 );
+    if ( last >= 0 ) feed ( EV_KEY, letters[last], 0 );
+    if ( wantmodify ) feed ( EV_KEY, KEY_LEFTSHIFT, 0 );
+    last = ( last == k ) ? -1 : k;
+}
+
+// One frame of a 1000 Hz mouse
+static void gen_mouse ( void )
+{
+    feed ( EV_REL, REL_X, ( rand () % 21 ) - 10 );
+    feed ( EV_REL, REL_Y, ( rand () % 21 ) - 10 );
+    feed ( EV_SYN, SYN_REPORT, 0 );
+}
+
+static void gen_mixed ( void )
+{
+    if ( rand () % 4 == 0 ) gen_typing (); else gen_mouse ();
+}
+
+// Anything, with more keys held than a slot report takes
+static void gen_random ( void )
+{
+    int	k = rand () % 16;
+    if ( k < 8 )
+    {
+        k = letters[rand () % NLETTERS];
+        feed ( EV_KEY, k, ! ( wantkeys[hidcore_keymap[k] >> 3] & ( 1 << ( hidcore_keymap[k] & 7 ) ) ) );
+    }
+    else if ( k < 10 )
+    {
+        k = modifiers[rand () % NMODIFIERS];
+        feed ( EV_KEY, k, ! ( wantmodify & hidcore_modmap[k] ) );
+    }
+    else if ( k < 11 )
+    {
+        k = BTN_LEFT + rand () % 3;
+        feed ( EV_KEY, k, ! ( wantbuttons & ( 1 << ( k & 0x03 ) ) ) );
+        feed ( EV_SYN, SYN_REPORT, 0 );
+    }
+    else
+    {	// Sometimes more than one report's worth of motion
+        feed ( EV_REL, REL_X, ( rand () % 601 ) - 300 );
+        feed ( EV_REL, REL_Y, ( rand () % 61 ) - 30 );
+        if ( k == 15 ) feed ( EV_REL, REL_WHEEL, ( rand () % 3 ) - 1 );
+        feed ( EV_SYN, SYN_REPORT, 0 );
+    }
+}
+
+// Everything up again
+static void gen_release ( void )
+{
+    int	k;
+    for ( k = 0; k < (int)NLETTERS; ++k ) feed ( EV_KEY, letters[k], 0 );
+    for ( k = 0; k < (int)NMODIFIERS; ++k ) feed ( EV_KEY, modifiers[k], 0 );
+    for ( k = BTN_LEFT; k <= BTN_MIDDLE; ++k ) feed ( EV_KEY, k, 0 );
+    feed ( EV_SYN, SYN_REPORT, 0 );
+}
+
+/*
+ *	host_check - Does the host see the state sent, once all reports are
+ *	out and every mouse frame is complete? Returns 0 if so
+ */
+static int host_check ( void )
+{
+    // Boot reports list 6 keys, also if generated as a bitmap (-n)
+    int	slots = boot ? BOOT_SLOTS : ( nkro ? NKRO_BYTES * 8 : KEYB_SLOTS );
+    if ( ( host.modify != wantmodify ) ||
+         ( ( wantnkeys > slots ) ? ! host.rollover :
+           memcmp ( host.keys, wantkeys, NKRO_BYTES ) ) )
+    {
+        fprintf ( stderr, "Keyboard: host has %02x/%d, sent %02x (%d keys)\n",
+            host.modify, host.rollover, wantmodify, wantnkeys );
+        return	-1;
+    }
+    if ( ( host.buttons != wantbuttons ) || ( host.dx != wantdx ) ||
+         ( host.dy != wantdy ) || ( host.wheel != wantwheel ) )
+    {
+        fprintf ( stderr, "Mouse: host has %x %lld/%lld/%lld, sent %x %lld/%lld/%lld\n",
+            host.buttons, host.dx, host.dy, host.wheel,
+            wantbuttons, wantdx, wantdy, wantwheel );
+        return	-1;
+    }
+    return	0;
+}
+
+// Run generator gen until count events are fed, print the figures
+static void bench ( const char * name, void (*gen)(void), unsigned long long count )
+{
+    unsigned long long	sent = reportssent, got = host.reports;
+    events = 0;
+    feedns = 0;
+    lat_reset ();
+    while ( events < count )
+    {
+        gen ();
+        host_drain ( 0 );
+    }
+    gen_release ();
+    host_flush ();
+    if ( corepath )
+    {	// Nothing sent, no latency measured
+        fprintf ( stdout, "%-12s %10llu %12.0f %12.0f %10s %9s %9s %9s%s\n",
+            name, events, events * 1e9 / feedns,
+            ( host.reports - got ) * 1e9 / feedns, "-", "-", "-", "-",
+            host_check () ? "  STATE MISMATCH" : "" );
+        return;
+    }
+    fprintf ( stdout, "%-12s %10llu %12.0f %12.0f %10.3f %9.2f %9.2f %9.2f%s\n",
+        name, events, events * 1e9 / feedns,
+        ( host.reports - got ) * 1e9 / feedns,
+        (double)( reportssent - sent ) / events,
+        lat_total ( 0.5 ) / 1000.0, lat_total ( 0.99 ) / 1000.0,
+        lat_total ( 1.0 ) / 1000.0,
+        host_check () ? "  STATE MISMATCH" : "" );
+}
+
+int	main ( int argc, char ** argv )
+{
+    unsigned long long	count = 1000000, n = 0;
+    unsigned char	buf[64];
+    int		i, hz, soak = 0;
+    long long	end;
+    for ( i = 1; i < argc; ++i )
+    {
+        if ( 0 == strncmp ( argv[i], "-e", 2 ) )
+        {
+            count = strtoull ( argv[i] + 2, NULL, 10 );
+        }
+        else if ( 0 == strncmp ( argv[i], "-s", 2 ) )
+        {
+            soak = atoi ( argv[i] + 2 );
+        }
+        else if ( 0 == strcmp ( argv[i], "-c" ) )
+        {
+            corepath = 1;
+        }
+        else if ( 0 == strcmp ( argv[i], "-b" ) )
+        {
+            boot = 1;
+        }
+        else if ( 0 == strcmp ( argv[i], "-n" ) )
+        {
+            nkro = 1;
+        }
+        else if ( 0 == strncmp ( argv[i], "-r", 2 ) )
+        {
+            hz = atoi ( argv[i] + 2 );
+            schedinterval = ( hz > 0 ) ? 1000000000LL / hz : 0;
+        }
+        else
+        {
+            fprintf ( stderr, "Usage: bench [-e<events>] [-s<seconds>] [-c] [-b] [-n] [-r<hz>]\n" );
+            return	1;
+        }
+    }
+    if ( boot && ( corepath || ( soak == 0 ) ) )
+    {	// The core knows no protocols, the "/core" figures would not add up
+        fprintf ( stderr, "-b is for the soak test of hidclient (-s, no -c)\n" );
+        return	1;
+    }
+    if ( ( 0 > hidclient_setup () ) ||
+         ( 0 > socketpair ( AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, hostctl ) ) ||
+         ( 0 > socketpair ( AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, hostint ) ) ||
+         ( 0 > hidclient_host ( hostctl[0], hostint[0] ) ) )
+    {
+        fprintf ( stderr, "Failed to set up the loopback host: %s\n",
+            strerror ( errno ) );
+        return	1;
+    }
+    if ( boot )
+    {	// As a BIOS would, right after connecting
+        buf[0] = HIDP_SET_PROTOCOL_BOOT;
+        if ( ( 1 != send ( hostctl[1], buf, 1, 0 ) ) ||
+             ( 0 > hidclient_pump ( 0 ) ) ||
+             ( 1 != recv ( hostctl[1], buf, sizeof(buf), 0 ) ) ||
+             ( buf[0] != HIDP_HANDSHAKE_SUCCESSFUL ) )
+        {
+            fprintf ( stderr, "Host failed to set the boot protocol\n" );
+            return	1;
+        }
+    }
+    hidcore_loopback_init ( &loopback );
+    hidcore_init ( &core, hidcore_loopback_sink, &loopback );
+    core.nkro = nkro;
+    srand ( 1 );
+    if ( soak == 0 )
+    {
+        fprintf ( stdout, "scenario         events     events/s    reports/s  sends/ev"
+            "   p50[us]   p99[us]   max[us]\n" );
+        corepath = 0;
+        bench ( "typing", gen_typing, count );
+        bench ( "mouse", gen_mouse, count );
+        bench ( "mixed", gen_mixed, count );
+        corepath = 1;
+        bench ( "typing/core", gen_typing, count );
+        bench ( "mouse/core", gen_mouse, count );
+        bench ( "mixed/core", gen_mixed, count );
+        return	0;
+    }
+    end = now_ns () + soak * 1000000000LL;
+    while ( now_ns () < end )
+    {
+        for ( i = 0; i < 10000; ++i )
+        {
+            gen_random ();
+            // With -r, reports are due later; check once all are out
+            if ( ( 0 == host_drain ( 0 ) ) && host_check () )
+            {
+                fprintf ( stderr, "Soak test failed after %llu events\n", events );
+                return	1;
+            }
+            if ( ++n % 1000 == 0 )
+            {
+                gen_release ();
+                host_flush ();
+                if ( host_check () || host.buttons || host.modify || wantnkeys )
+                {
+                    fprintf ( stderr, "Stuck keys after %llu events\n", events );
+                    return	1;
+                }
+            }
+        }
+    }
+    if ( loopback.lost )
+    {
+        fprintf ( stderr, "Loopback lost %llu reports\n", loopback.lost );
+        return	1;
+    }
+    fprintf ( stdout, "Soak test passed: %llu events, %llu reports\n",
+        events, host.reports );
+    return	0;
+}
@@ -56,15 +56,80 @@
  *
  * Usage:	hidclient [-h|-?|--help] [-s|--skipsdp]
  * 		Start hidclient. -h will display usage information.
+ *		-b<NUM> reads at most NUM input_events per device and wakeup
+ *		-k<FILENAME> overrides the keycode translation table with
+ *		   "<evdev keycode> <HID usage>" lines read from FILENAME
+ *		-r<HZ> limits the report rate (e.g. to the link's sniff
+ *		   interval), merging mouse reports while they wait
+ *		-L<MS> is the longest a report may wait for its slot
+ *		-a<MS> drops the motion of mouse reports still waiting MS
+ *		   after their input event (by the kernel's timestamp), so
+ *		   a stalled link does not replay old pointer movement
+ *		-n sends keyboard reports as a bitmap of pressed keys
+ *		   (n-key rollover) instead of a list of KEYB_SLOTS keys
+ *		-B sends input to all connected hosts (see MAXSESSIONS)
+ *		   instead of only the one selected by LCtrl+LAlt+<NUM>
+ *		-R<FILENAME> remembers the last hosts in FILENAME and
+ *		   connects to them on startup and after link loss
+ *		-t[<CPU>] reads input in a separate SCHED_FIFO thread,
+ *		   optionally pinned to CPU (see "Input thread")
+ *		-u<FILENAME> accepts batches of finished HID reports from
+ *		   other programs on a SOCK_SEQPACKET unix socket (see
+ *		   "Report injection" below)
  *		-e<NUM> asks hidclient to ONLY use Input device #NUM
  *		-f<FILENAME> will not read event devices, but create a
  *		   fifo on <FILENAME> and read input_event data blocks
- *		   from there
+ *		   from there (mouse data is sent on EV_SYN/SYN_REPORT,
+ *		   just like with the kernel's event devices)
+ *		-F<FILENAME> is like -f, but reads frames of timestamped
+ *		   events or finished reports (see "Framed fifo input")
+ *		--record <FILENAME> logs all input sent, with timestamps
+ *		--replay <FILENAME> sends such a log with its original
+ *		   timing instead of live input, --speed <X> times as fast
+ *		SIGUSR1 prints latency percentiles, the report rate and
+ *		   the state of each host's link
+ *		-d traces input events, reads and reports to stderr, from
+ *		   a background thread (see "Debug trace")
  *		-l will list input devices available
- *		-x will try to remove the "grabbed" input devices from
- *		   the local X11 server, if possible
+ *		-x grabs the input devices exclusively (EVIOCGRAB), so
+ *		   that neither X11 nor the console gets their input
+ *		-g<FILENAME> routes devices by name, vendor/product or
+ *		   capabilities to a fixed host, some report IDs only, or
+ *		   leaves them local (see "Device routing"); give it
+ *		   before -l to see the rule each device gets
  * 		-s will disable SDP registration (which only makes sense
  * 		when debugging as most counterparts require SDP to work)
+ *		   Without -s, the record is registered as a BlueZ profile
+ *		   in the background, and BlueZ hands over the control
+ *		   channels it accepts (Profile1.NewConnection)
+ * Control:	Hosts' requests on the control channel are answered
+ *		(GET/SET_REPORT, GET/SET_PROTOCOL, GET/SET_IDLE, SUSPEND,
+ *		virtual cable unplug), and the keyboard LED state of the
+ *		host getting input is shown on local keyboards. Hosts
+ *		asking for boot protocol (BIOS, bootloaders) get boot
+ *		keyboard/mouse reports
+ * Pointers:	Mouse reports carry 16 bit motion and a vertical and
+ *		horizontal wheel with WHEEL_UNIT steps per notch, which
+ *		the host gets in notches unless it sets the wheels'
+ *		Resolution Multiplier (REL_WHEEL_HI_RES, REL_HWHEEL_HI_RES
+ *		are used where the device has them). Touch screens and pen
+ *		tablets are sent as absolute pointer (REPORTID_ABS): its
+ *		ABS_X/ABS_Y range maps to the whole screen of the host
+ * Media keys:	Volume, playback, brightness, browser keys... are sent
+ *		as consumer control (REPORTID_CONSUMER), power/sleep/wake
+ *		as system control (REPORTID_SYSTEM) reports, not as keys
+ * Stuck keys:	Every key held remembers the device it came from. When a
+ *		device goes away, its keys are released; when the kernel
+ *		dropped some of its events (SYN_DROPPED), or a key seems
+ *		held for HELDAGE, the device's real key state (EVIOCGKEY)
+ *		is taken over. A link stalled for LINKSTALL sends the
+ *		current state first, not the history queued meanwhile
+ * Link:	The ACL link to each host gets a flush timeout (LINKFLUSH)
+ *		for mouse reports carrying only motion; keys, buttons and
+ *		control messages are never flushed. RSSI, TX power and link
+ *		quality are sampled over HCI (needs CAP_NET_RAW): a poor
+ *		link gets fewer reports and no sniff mode while it lasts
+ *		(see "Link manager")
  * Tip:		Use "openvt" along with hidclient so that keystrokes and
  * 		mouse events captured will have no negative impact on the
  * 		local machine (except Ctrl+Alt+[Fn/Entf/Pause]).
@@ -95,6 +160,7 @@
  *		Boston, MA  02110-1301  USA
  */
 //***************** Include files
+#define	_GNU_SOURCE	// CPU affinity of the input thread (-t)
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -102,198 +168,566 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <stropts.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include <fnmatch.h>
 #include <linux/input.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/l2cap.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
 #include <gio/gio.h>
+#include <gio/gunixfdlist.h>
+#include "hidcore.h"
+#include "hidclient.h"
 
 //***************** Static definitions
 // Where to find event devices (that must be readable by current user)
 // "%d" to be filled in, opening several devices, see below
-#define	EVDEVNAME	"/dev/input/event%d"
+#define	EVDEVDIR	"/dev/input"
+#define	EVDEVNAME	EVDEVDIR "/event%d"
 
 // Maximally, read MAXEVDEVS event devices simultaneously
 #define	MAXEVDEVS 64
+#if	MAXEVDEVS > HIDCORE_SLOTS
+#error	"Every event device needs a slot of the core"
+#endif
+
+// Maximally, read MAXEVBATCH input_events per device with one read()
+#define	MAXEVBATCH 64
+
+// Maximally, MAXROUTES rules in a -g routing file (see "Device routing")
+#define	MAXROUTES 16
+#define	ROUTE_ACTIVE	-1	// route_t.host: the host(s) selected by hotkey
+#define	ROUTE_LOCAL	-2	// dito: device is not used, stays local
 
 #define PROFiLE_DBUS_PATH "/bluez/yaptb/btkb_profile"
+#define ADAPTER_DBUS_PATH "/org/bluez/hci0"
 #define UUID    "00001124-0000-1000-8000-00805f9b34fb"
 
+// Maximally, handle MAXEPOLLEVS ready file descriptors per epoll_wait()
+#define	MAXEPOLLEVS 16
+
+// Every fd registered with the epoll reactor carries a tag (type, index)
+#define	EVTAG(type,idx)	( ( (type) << 16 ) | ( (idx) & 0xffff ) )
+#define	EVTAG_TYPE(tag)	( (tag) >> 16 )
+#define	EVTAG_INDEX(tag)	( (tag) & 0xffff )
+#define	EVTAG_EVDEV	1	// event device / fifo, index into eventdevs
+#define	EVTAG_LISTENCTL	2	// listening control socket (PSM 17)
+#define	EVTAG_LISTENINT	3	// listening interrupt socket (PSM 19)
+#define	EVTAG_CTL	4	// connected control socket, index into sessions
+#define	EVTAG_INT	5	// connected interrupt socket, dito
+#define	EVTAG_SCHED	6	// timerfd of a session's report scheduler
+#define	EVTAG_DIALCTL	7	// outgoing control channel, index into hosts
+#define	EVTAG_DIALINT	8	// outgoing interrupt channel, dito
+#define	EVTAG_DIALTMR	9	// reconnect backoff timerfd, dito
+#define	EVTAG_HOTPLUG	10	// inotify watch on EVDEVDIR
+#define	EVTAG_INJLISTEN	11	// listening injection socket (-u)
+#define	EVTAG_INJECT	12	// injection client, index into injectors
+#define	EVTAG_REPLAY	13	// timerfd releasing the next replayed events
+#define	EVTAG_PIPE	14	// input thread has put something into pipering
+#define	EVTAG_INPUTCMD	15	// command for the input thread (input_enable)
+#define	EVTAG_DBUS	16	// D-Bus thread has news, see dbus_result()
+#define	EVTAG_WATCHDOG	17	// timerfd checking for stuck keys, see input_watchdog()
+#define	EVTAG_HCI	18	// raw HCI socket of the link manager
+#define	EVTAG_LINK	19	// timerfd sampling the links, see link_timer()
+#define	EVTAG_PIPEROOM	20	// radio thread has made room in pipering
+
+// Maximally, hold MAXOUTQ reports back in the report scheduler
+#define	MAXOUTQ 64
+
+// Stuck keys: keys held for HELDAGE ns are checked against the device
+// every WATCHDOG seconds; an interrupt channel blocked for LINKSTALL ns
+// gets its queue collapsed into the current state
+#define	WATCHDOG	1
+#define	HELDAGE		2000000000LL
+#define	LINKSTALL	500000000LL
+
+// Link manager: adapter, incoming L2CAP MTU, flush timeout (ms) of
+// motion reports, seconds between samples. A link whose RSSI (dB off
+// the golden receive power range) falls to LINKPOOR gets LINKPOORRATE
+// reports per second at most and no sniff mode, until it is LINKGOOD
+#define	LINKHCIDEV	0	// hci0, as ADAPTER_DBUS_PATH
+#define	LINKIMTU	64
+#define	LINKFLUSH	20
+#define	LINKPERIOD	2
+#define	LINKPOOR	-12
+#define	LINKGOOD	-8
+#define	LINKPOORRATE	125
+
+// Framed fifo protocol, see struct fifohdr_t
+#define	FIFOMAGIC	0x46444948	// "HIDF" on little endian machines
+#define	FIFO_EVENTS	1	// payload: struct fifoevent_t[]
+#define	FIFO_REPORTS	2	// payload: records as on the -u socket
+
+// Input log (--record/--replay): a struct evloghdr_t, then count
+// struct fifoevent_t, grown EVLOGCHUNK events at a time
+#define	EVLOGMAGIC	0x4c444948	// "HIDL" on little endian machines
+#define	EVLOGCHUNK	4096
+
+// Latency statistics: stages of a report's way, histogram sizes
+#define	LAT_READ	0	// kernel event timestamp => read()
+#define	LAT_BUILD	1	// read() => report built
+#define	LAT_SEND	2	// report built => send() completed
+#define	LAT_TOTAL	3	// kernel event timestamp => send() completed
+#define	LAT_STAGES	4
+#define	STAMPWINDOW	10000000000LL // event timestamps older (ns) are bogus
+#define	LATMAXORDER	40	// values up to 2^40 ns (~18 minutes)
+#define	LATBUCKETS	( ( LATMAXORDER - 1 ) * 8 )
+
+// Input thread => radio thread handoff (-t), entries (power of two)
+#define	PIPERING	1024
+#define	PIPERESERVE	64	// entries reports leave to the others, see pipe_put
+#define	PIPE_REPORT	1	// hid_submit_to() data, arg: its host
+#define	PIPE_FLUSH	2	// hid_flush()
+#define	PIPE_SWITCH	3	// session_switch() arg
+#define	PIPE_BROADCAST	4	// session_broadcast()
+#define	PIPE_RESULT	5	// input_result() arg
+
+// D-Bus thread => main loop messages (struct dbusmsg_t)
+#define	DBUS_REGISTERED	1	// RegisterProfile succeeded
+#define	DBUS_FAILED	2	// dito, failed
+#define	DBUS_RELEASED	3	// BlueZ dropped our profile (Release)
+#define	DBUS_NEWCONN	4	// NewConnection: control channel fd
+#define	DBUS_DISCONNECT	5	// RequestDisconnection of host bdaddr
+
+// Debug trace (-d): records per ring (power of two), rings (threads)
+#define	TRACERING	4096
+#define	TRACETHREADS	4
+#define	TR_EVENT	1	// input_event processed
+#define	TR_READ		2	// read() from an input device/fifo
+#define	TR_REPORT	3	// report sent to a host
+
+// Maximally, accept reports from MAXINJECT clients of the -u socket
+#define	MAXINJECT 8
+
+// HIDP message types (high nibble of the first byte) and parameters
+#define	HIDP_HANDSHAKE		0x0
+#define	HIDP_HID_CONTROL	0x1
+#define	HIDP_GET_REPORT		0x4
+#define	HIDP_SET_REPORT		0x5
+#define	HIDP_GET_PROTOCOL	0x6
+#define	HIDP_SET_PROTOCOL	0x7
+#define	HIDP_GET_IDLE		0x8
+#define	HIDP_SET_IDLE		0x9
+#define	HIDP_DATA		0xa
+#define	HIDP_HS_SUCCESSFUL	0x0	// HANDSHAKE result codes
+#define	HIDP_HS_INVALID_REPORT_ID 0x2
+#define	HIDP_HS_UNSUPPORTED	0x3
+#define	HIDP_HS_INVALID_PARAMETER 0x4
+#define	HIDP_CTRL_SUSPEND	0x3	// HID_CONTROL operations
+#define	HIDP_CTRL_EXIT_SUSPEND	0x4
+#define	HIDP_CTRL_UNPLUG	0x5	// virtual cable unplug
+#define	HIDP_REP_INPUT		0x1	// report types (GET/SET_REPORT, DATA)
+#define	HIDP_REP_OUTPUT		0x2
+#define	HIDP_REP_FEATURE	0x3
+
+// Maximally, remember MAXHOSTS hosts to reconnect to (-R)
+#define	MAXHOSTS 4
+
+// Reconnect backoff starts at RECONNECT_MIN ms, doubling up to _MAX ms
+#define	RECONNECT_MIN	100
+#define	RECONNECT_MAX	60000
+
+// Maximally, serve MAXSESSIONS hosts at the same time
+// (the LCtrl+LAlt+<1..MAXSESSIONS> hotkeys select one of them)
+#define	MAXSESSIONS 4
+
 // Bluetooth "ports" (PSMs) for HID usage, standardized to be 17 and 19 resp.
 // In theory you could use different ports, but several implementations seem
 // to ignore the port info in the SDP records and always use 17 and 19. YMMV.
 #define	PSMHIDCTL	17
 #define	PSMHIDINT	19
 
-// These numbers must also be used in the HID descriptor binary file
-#define	REPORTID_MOUSE	1
-#define	REPORTID_KEYBD	2
-
 //***************** Function prototypes
+struct outsched_t;
 int  dosdpregistration(void);
 void sdpunregister();
+int  dbus_start(char sdp);
+int  dbus_result(void);
+void dbus_stop(void);
+int  adapter_set(const char *prop, int value);
+static int sc_adopt(int fd, bdaddr_t *bdaddr);
+static int session_accept_ctl(int fd, bdaddr_t *bdaddr);
 int  btbind(int sockfd, unsigned short port);
-int  initevents(unsigned int,int);
+int  btlisten(unsigned short port, int tag);
+int  initevents(void);
+int  evdev_add(int);
+void evdev_remove(int);
+void hotplug_event(void);
+void evdev_resync(int,int);
+void input_watchdog(void);
 void closeevents(void);
 int  initfifo(char *);
+int  loadkeymap(char *);
+int  loadroutes(char *);
+void routes_init(void);
+static void hid_sink(void*,const void*,int,long long);
+static long long now_ns(void);
 void closefifo(void);
+void link_sockopts(int,unsigned short,int);
+int  link_init(void);
+void link_stop(void);
+void link_open(int);
+void link_event(void);
+void link_timer(void);
+static void link_flushable(struct outsched_t*,int);
+static void link_flushto(int,int);
 void cleanup_stdin(void);
-int  add_filedescriptors(fd_set*);
-int  parse_events(fd_set*,int);
+int  evt_add(int,unsigned int,unsigned int);
+int  evt_addto(int,int,unsigned int,unsigned int);
+int  evt_mod(int,unsigned int,unsigned int);
+void evt_del(int);
+void evt_input(int);
+void flush_events(void);
+int  parse_events(int);
+int  process_event(int,struct input_event*);
+int  report_encode(struct outsched_t*,const unsigned char*,int,unsigned char*);
+int  sched_open(struct outsched_t*,int,int);
+void sched_close(struct outsched_t*);
+int  sched_submit(struct outsched_t*,const void*,int);
+int  sched_run(struct outsched_t*);
+int  sched_flush(struct outsched_t*);
+int  sched_writable(struct outsched_t*);
+void hid_submit(const void*,int);
+void hid_submit_to(int,const void*,int);
+void hid_flush(void);
+void session_close(int);
+void session_switch(int);
+int  hosts_load(void);
+void host_dial(int);
+void host_connected(bdaddr_t*);
+void host_lost(bdaddr_t*);
+void host_hold(bdaddr_t*);
+int  inject_init(void);
+void inject_accept(void);
+void inject_read(int);
+void inject_close(void);
+int  hid_records(const unsigned char*,int);
+int  hid_busy(void);
+int  parse_frames(void);
+int  fifo_drain(void);
+int  rec_open(const char*);
+void rec_event(const struct input_event*);
+void rec_close(void);
+int  replay_open(const char*);
+void replay_kick(void);
+int  replay_run(void);
+void replay_close(void);
+void lat_read(void);
+void lat_event(struct timeval*,int);
+void lat_dump(void);
+void trace_attach(void);
+void trace_event(int,const struct input_event*);
+void trace_read(int,int);
+void trace_report(int,const void*,int);
+int  trace_start(void);
+void trace_stop(void);
+void session_broadcast(void);
+void session_control(int);
+void session_data(int);
+void input_leds(int);
+void input_result(int);
+void input_enable(int);
+int  input_resume(void);
+int  pipe_put(int,int,const void*,int);
+void pipe_drain(void);
+int  input_setup(void);
+int  input_start(void);
+void input_stop(void);
 void showhelp(void);
 void onsignal(int);
 
 //***************** Data structures
-// Mouse HID report, as sent over the wire:
-struct hidrep_mouse_t
-{
-    unsigned char	btcode;	// Fixed value for "Data Frame": 0xA1
-    unsigned char	rep_id; // Will be set to REPORTID_MOUSE for "mouse"
-    unsigned char	button;	// bits 0..2 for left,right,middle, others 0
-    signed   char	axis_x; // relative movement in pixels, left/right
-    signed   char	axis_y; // dito, up/down
-    signed   char	axis_wheel; // Used for the scroll wheel (?)
+// One report waiting in the scheduler for its send slot:
+struct outrep_t
+{
+    long long	queued;	// CLOCK_MONOTONIC ns when it was generated
+    long long	origin;	// dito, of the input event causing it, 0 = unknown
+    unsigned char	len;
+    unsigned char	data[MAXREPORT]; // as generated, 0xA1 first
+};
+// Report scheduler between report generation and interrupt socket:
+struct outsched_t
+{
+    int		sockdesc; // interrupt channel, <0 if not connected
+    int		timerfd; // fires when the next report is due
+    unsigned int	inttag;	// reactor tag of the interrupt socket
+    long long	interval; // minimum ns between two reports, 0 = none
+    long long	latency; // maximum ns a report may be held back
+    long long	lastsend; // CLOCK_MONOTONIC ns of the last send()
+    char	blocked; // set while the socket does not take more data
+    long long	blockedsince; // CLOCK_MONOTONIC ns it got blocked
+    char	flushing; // link has a flush timeout: 1, given up: -1, see link_flushable()
+    char	flushable; // BT_FLUSHABLE of sockdesc right now
+    char	boot;	// host chose boot protocol: send boot reports
+    unsigned char	buttons; // of the latest mouse report submitted
+    unsigned char	sentbuttons; // dito, sent
+    int		owed[MOUSE_AXES]; // motion a collapse had no room for, see sched_owed
+    unsigned char	wheelres; // host's Resolution Multipliers (MULT_*)
+    int		wheelrest[2]; // wheel/pan below one notch, see report_encode
+    int		head;	// oldest entry in q
+    int		count;	// number of entries in q
+    struct outrep_t	q[MAXOUTQ];
+};
+
+// What the link manager knows about a host's ACL link:
+struct link_t
+{
+    int		handle;	// HCI connection handle, <0 = unknown
+    int		policy;	// link policy as found, <0 = not read (yet)
+    int		rssi;	// dB off the golden receive power range
+    int		txpower; // dBm
+    int		quality; // 0..255, by the controller's own measure
+    int		imtu, omtu; // MTUs of the interrupt channel
+    char	poor;	// RSSI reached LINKPOOR, not LINKGOOD again since
+    unsigned int	poorcount; // times it became poor
+    unsigned long long	samples; // RSSI readings taken
+};
+
+// One host (session): control and interrupt channel plus its reports
+struct session_t
+{
+    int		sctl;	// control channel, <0 = slot unused
+    int		sint;	// interrupt channel, <0 = not (yet) connected
+    bdaddr_t	bdaddr;	// the host
+    char	dead;	// sending failed, to be closed by session_reap()
+    char	suspended; // host sent HID_CONTROL SUSPEND: send nothing
+    char	protocol; // 1 = report protocol, 0 = boot protocol
+    unsigned char	idle;	// SET_IDLE rate, kept for GET_IDLE only
+    unsigned char	leds;	// keyboard LED output report of the host
+    unsigned char	lastkeyb[MAXREPORT]; // for GET_REPORT
+    unsigned char	lastkeyblen;
+    unsigned char	lastbuttons; // dito, mouse
+    unsigned char	lastabs[sizeof(struct hidrep_abs_t)]; // absolute pointer
+    unsigned char	lastcons[sizeof(struct hidrep_consumer_t)]; // dito, consumer
+    unsigned char	lastsys[sizeof(struct hidrep_system_t)]; // system control
+    struct outsched_t	sched;
+    struct link_t	link;
+};
+
+// A remembered host we (re)connect to on our own:
+struct host_t
+{
+    bdaddr_t	bdaddr;
+    int		ctlfd;	// control channel being connected, or -1
+    int		intfd;	// interrupt channel being connected, or -1
+    int		timerfd; // backoff until the next attempt
+    int		backoff; // ms to wait after the next failure
+    char	hold;	// dropped by PAUSE: leave it to the host
+};
+
+// Framed fifo protocol (-F): every frame starts with this header,
+// followed by len bytes of payload (host byte order throughout)
+struct fifohdr_t
+{
+    uint32_t	magic;	// FIFOMAGIC, to resync after garbage
+    uint16_t	type;	// FIFO_EVENTS or FIFO_REPORTS
+    uint16_t	len;	// payload bytes following
+} __attribute((packed));
+// FIFO_EVENTS payload: an array of these, independent of the
+// writer's word size (unlike struct input_event)
+struct fifoevent_t
+{
+    uint64_t	usec;	// timestamp of the event
+    uint16_t	type;
+    uint16_t	code;
+    int32_t	value;
 } __attribute((packed));
-// Keyboard HID report, as sent over the wire:
-struct hidrep_keyb_t
+
+struct evloghdr_t
 {
-    unsigned char	btcode; // Fixed value for "Data Frame": 0xA1
-    unsigned char	rep_id; // Will be set to REPORTID_KEYBD for "keyboard"
-    unsigned char	modify; // Modifier keys (shift, alt, the like)
-    unsigned char	key[8]; // Currently pressed keys, max 8 at once
+    uint32_t	magic;	// EVLOGMAGIC
+    uint32_t	count;	// events following, always up to date
 } __attribute((packed));
 
+// Latency histogram of one stage (see lat_record)
+struct lathist_t
+{
+    unsigned long long	n;	// values counted
+    unsigned long long	max;	// largest value, ns
+    unsigned int	b[LATBUCKETS];
+};
+
+// One debug trace record, decoded by the trace writer thread
+struct tracerec_t
+{
+    long long	ns;	// now_ns() when traced
+    unsigned char	kind;	// TR_*
+    unsigned char	slot;	// event device/fifo slot, or host session
+    unsigned char	len;	// bytes used in data
+    unsigned short	type, code;
+    int		value;	// TR_READ: bytes read
+    unsigned char	data[MAXREPORT]; // TR_REPORT: the report
+};
+// Single producer (the thread owning it), single consumer ring
+struct tracering_t
+{
+    unsigned int	head;	// next record to write, producer only
+    unsigned int	tail;	// next record to decode, consumer only
+    unsigned int	lost;	// records dropped because the ring was full
+    struct tracerec_t	rec[TRACERING];
+};
+
+// What the input thread hands to the radio thread (see PIPE_*)
+struct pipemsg_t
+{
+    long long	origin;	// stampevent of a report
+    int		kind;
+    int		arg;
+    unsigned char	len;
+    unsigned char	data[MAXREPORT];
+};
+// Single producer (input thread), single consumer (radio thread) ring
+struct pipering_t
+{
+    unsigned int	head;	// next entry to write, producer only
+    unsigned int	tail;	// next entry to read, consumer only
+    struct pipemsg_t	msg[PIPERING];
+};
+// Reports for one host that found the ring full, folded into the state
+// they lead to until there is room again (see pipe_fold)
+struct pipepend_t
+{
+    int		folded;	// reports folded in, 0 = nothing pending
+    long long	origin;	// stampevent of the first of them
+    unsigned char	len[REPORTID_SYSTEM+1]; // of the latest per report ID
+    unsigned char	data[REPORTID_SYSTEM+1][MAXREPORT];
+    int		motion[MOUSE_AXES]; // mouse motion summed up
+};
+
+// A rule of the -g routing file: the devices it matches, where their
+// input goes, and the core keeping their key/button state apart
+struct route_t
+{
+    char	name[128]; // fnmatch() pattern for EVIOCGNAME, "" = any
+    int		vendor;	// EVIOCGID vendor, -1 = any
+    int		product; // dito, product
+    unsigned long	caps; // EV_* bits the device must have
+    int		host;	// session index, or ROUTE_ACTIVE/ROUTE_LOCAL
+    char	grab;	// EVIOCGRAB: 1 = always, 0 = never, -1 = with -x
+    unsigned int	reports; // (1 << REPORTID_*) of the reports passed
+    int		line;	// in the routing file
+    struct hidcore_t	*core;
+};
+
+// What the D-Bus thread tells the main loop (see DBUS_*)
+struct dbusmsg_t
+{
+    int		kind;
+    int		fd;	// DBUS_NEWCONN
+    bdaddr_t	bdaddr;	// DBUS_NEWCONN, DBUS_DISCONNECT: the host
+};
+
 //***************** Global variables
 char		prepareshutdown	 = 0;	// Set if shutdown was requested
 int		eventdevs[MAXEVDEVS];	// file descriptors
-int		x11handles[MAXEVDEVS];
-char		mousebuttons	 = 0;	// storage for button status
-char		modifierkeys	 = 0;	// and for shift/ctrl/alt... status
-char		pressedkey[8]	 = { 0, 0, 0, 0,  0, 0, 0, 0 };
+int		evdevnode[MAXEVDEVS];	// N of /dev/input/eventN per slot
+char		evdevleds[MAXEVDEVS];	// slot has LEDs, opened read/write
+char		evdevclock[MAXEVDEVS];	// slot stamps events CLOCK_MONOTONIC
+unsigned char	ledstate	 = 0;	// LEDs shown on local keyboards
+unsigned long long	evdevmask = 0;	// -e: only use these eventN, 0 = all
+char		evdevgrab	 = 0;	// -x: grab devices exclusively
+int		hotplugfd	 = -1;	// inotify, to see devices come and go
+int		watchdogfd	 = -1;	// timerfd, see input_watchdog()
+int		hcisock		 = -1;	// raw HCI socket of the link manager
+int		linktimer	 = -1;	// timerfd, see link_timer()
+char		hcinoflush	 = 0;	// adapter sends non-flushable packets: 1, not: -1
+unsigned long long	stuckkeys = 0;	// keys released or pressed by a resync
+struct hidcore_t	hidcore;	// translates the input read, see hidcore.h
+struct route_t	routes[MAXROUTES];	// -g: routing rules, first match wins
+int		nroutes		 = 0;
+struct hidcore_t	routecore[MAXROUTES];	// the core of each rule
+struct route_t	defroute	 = { .vendor = -1, .product = -1,
+    .host = ROUTE_ACTIVE, .grab = -1, .reports = ~0u, .core = &hidcore };
+struct route_t	*evdevroute[MAXEVDEVS] = { [0 ... MAXEVDEVS-1] = &defroute };
+char		nkro		 = 0;	// -n: bitmap keyboard reports
 int     debugevents      = 0;	// bitmask for debugging event data
+int		epollfd		 = -1;	// the event reactor
+long long	schedinterval	 = 0;	// -r: ns between reports, 0 = no limit
+long long	schedlatency	 = 4000000; // -L: 4 ms latency bound
+long long	mouseage	 = 0;	// -a: ns until mouse motion is stale
+unsigned long long	stalemoves = 0;	// mouse reports whose motion was dropped
+struct session_t	sessions[MAXSESSIONS]; // connected/connecting hosts
+int		activesession	 = -1;	// host receiving input, -1 = none
+char		broadcast	 = 0;	// send input to all hosts at once
+char		*hostfile	 = NULL; // -R: file of hosts to reconnect to
+struct host_t	hosts[MAXHOSTS]; // most recently connected first
+int		nhosts		 = 0;
+int		evbatch	 = MAXEVBATCH; // input_events per read()
+char		*injectpath	 = NULL; // -u: unix socket taking raw reports
+int		injectfd	 = -1;
+int		injectors[MAXINJECT];	// connected injection clients
+char		fifoframed	 = 0;	// -F: fifo speaks the framed protocol
+unsigned char	fifobuf[sizeof(struct fifohdr_t)+65535]; // reassembly
+int		fifofill	 = 0;	// bytes waiting in fifobuf
+char		inputheld	 = 0;	// input paused until the link drains
+int		recfd		 = -1;	// --record: input log being written
+struct evloghdr_t	*recmap	 = NULL; // mapping of it
+unsigned int	reccap		 = 0;	// events fitting into the mapping
+struct evloghdr_t	*replaymap = NULL; // --replay: input log being read
+size_t		replaysize	 = 0;
+unsigned int	replaypos	 = 0;	// next event to replay
+int		replaytimer	 = -1;
+long long	replaybase	 = 0;	// now_ns() of the first event, 0 = paused
+uint64_t	replayat	 = 0;	// usec event replaypos is past the first
+double		replayspeed	 = 1.0;	// --speed: >1 is fast forward
+struct lathist_t	lathist[LAT_STAGES]; // see "Latency statistics"
+__thread long long	stampread  = 0;	// now_ns() of the last input read
+__thread long long	stampreal  = 0;	// dito, CLOCK_REALTIME
+__thread long long	stampevent = 0;	// now_ns() of the current event, 0 = unknown
+long long	statsbase	 = 0;	// now_ns() at startup
+unsigned long long	reportssent = 0;
+char		statsdump	 = 0;	// SIGUSR1 received
+struct tracering_t	tracerings[TRACETHREADS]; // see "Debug trace"
+int		ntracerings	 = 0;
+__thread struct tracering_t	*mytrace = NULL; // ring of this thread
+pthread_t	tracethread;
+char		tracestop	 = 0;
+char		threaded	 = 0;	// -t: input thread and radio thread
+int		inputcpu	 = -1;	// -t<cpu>: pin the input thread
+int		inputepoll	 = -1;	// reactor of input, = epollfd unless -t
+char		inputon		 = 0;	// input is being read (host connected)
+__thread char	oninput		 = 0;	// set in the input thread only
+pthread_t	inputthread;
+int		inputcmd[2]	 = { -1, -1 }; // pipe radio => input thread
+int		pipewake	 = -1;	// eventfd input => radio thread
+int		piperoom	 = -1;	// eventfd radio => input thread, see pipe_wait
+int		pipewant	 = 0;	// input thread waits for piperoom
+int		pipepending	 = 0;	// hosts with pipepend[] state, input thread only
+unsigned long long	pipefolded = 0;	// reports folded into pipepend[]
+unsigned long long	pipelost = 0;	// other messages dropped on a full ring
+GMainContext	*dbusctx	 = NULL; // context of the D-Bus thread
+GMainLoop	*dbusloop	 = NULL; // running in it, until dbus_stop()
+pthread_t	dbusthread;
+int		dbuspipe[2]	 = { -1, -1 }; // D-Bus thread => main loop
+char		dbussdp		 = 0;	// D-Bus thread registers the record
+guint		profileid	 = 0;	// our exported Profile1 object
+int		sdpstate	 = 0;	// RegisterProfile: 0 = pending,
+					// 1 = done, -1 = failed
+struct pipering_t	pipering;
+struct pipepend_t	pipepend[MAXSESSIONS+1]; // by host + 1 (ROUTE_ACTIVE: 0)
 
-//********************** SDP report XML
-const char *sdp_record = 
-"<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n"
-"\n"
-"<record>\n"
-"    <attribute id=\"0x0001\">    <!-- SDP_ATTR_SVCLASS_ID_LIST -->\n"
-"        <sequence>\n"
-"            <uuid value=\"0x1124\" />\n"
-"        </sequence>\n"
-"    </attribute>\n"
-"    <attribute id=\"0x0004\"> <!-- SDP_ATTR_PROTO_DESC_LIST    -->\n"
-"        <sequence>\n"
-"            <sequence>\n"
-"                <uuid value=\"0x0100\" />\n"
-"                <uint16 value=\"0x0011\" />\n"
-"            </sequence>\n"
-"            <sequence>\n"
-"                <uuid value=\"0x0011\" />\n"
-"            </sequence>\n"
-"        </sequence>\n"
-"    </attribute>\n"
-"    <attribute id=\"0x0005\">  <!-- SDP_ATTR_BROWSE_GRP_LIST -->\n"
-"        <sequence>\n"
-"            <uuid value=\"0x1002\" />\n"
-"        </sequence>\n"
-"    </attribute>\n"
-"    <attribute id=\"0x0006\">  <!-- SDP_ATTR_LANG_BASE_ATTR_ID_LIST        -->\n"
-"        <sequence>\n"
-"            <uint16 value=\"0x656e\" />    <!-- Natural Language Code = English -->\n"
-"            <uint16 value=\"0x006a\" />     <!-- Character Encoding = UTF-8 -->\n"
-"            <uint16 value=\"0x0100\" />    <!-- String Base = 0x0100 -->\n"
-"        </sequence>\n"
-"    </attribute>\n"
-"    <attribute id=\"0x0009\">    <!-- SDP_ATTR_PFILE_DESC_LIST -->\n"
-"        <sequence>\n"
-"            <sequence>\n"
-"                <uuid value=\"0x1124\" />    <!-- Human Interface Device -->\n"
-"                <uint16 value=\"0x0100\" />     <!-- L2CAP -->\n"
-"            </sequence>\n"
-"        </sequence>\n"
-"    </attribute>\n"
-"    <attribute id=\"0x000d\">  <!-- Additional Protocol Descriptor Lists -->\n"
-"        <sequence>\n"
-"            <sequence>\n"
-"                <sequence>\n"
-"                    <uuid value=\"0x0100\" />\n"
-"                    <uint16 value=\"0x0013\" />\n"
-"                </sequence>\n"
-"                <sequence>\n"
-"                    <uuid value=\"0x0011\" />\n"
-"                </sequence>\n"
-"            </sequence>\n"
-"        </sequence>\n"
-"    </attribute>\n"
-"    <attribute id=\"0x0100\">    <!-- service name  -->\n"
-"        <text value=\"Raspberry Pi Virtual Keyboard\" />\n"
-"    </attribute>\n"
-"    <attribute id=\"0x0101\">    <!-- service description -->\n"
-"        <text value=\"USB > BT Keyboard\" />\n"
-"    </attribute>\n"
-"    <attribute id=\"0x0102\">    <!-- service provider -->\n"
-"        <text value=\"Raspberry Pi\" />\n"
-"    </attribute>\n"
-"    <attribute id=\"0x0200\"> <!-- SDP_ATTR_HID_DEVICE_RELEASE_NUMBER -->\n"
-"        <uint16 value=\"0x0100\" />\n"
-"    </attribute>\n"
-"    <attribute id=\"0x0201\"> <!-- HID Parser Version = 1.11         -->\n"
-"        <uint16 value=\"0x0111\" />\n"
-"    </attribute>\n"
-"    <attribute id=\"0x0202\">    <!-- HID Subclass = Not Boot Mouse -->\n"
-"        <uint8 value=\"0x40\" />\n"
-"    </attribute>\n"
-"    <attribute id=\"0x0203\"> <!-- HID Country Code = ??         -->\n"
-"        <uint8 value=\"0x00\" />\n"
-"    </attribute>\n"
-"    <attribute id=\"0x0204\">    <!-- HID Virtual Cable = False            -->\n"
-"        <boolean value=\"false\" />\n"
-"    </attribute>\n"
-"    <attribute id=\"0x0205\"> <!-- HID Reconnect Initiate = False -->\n"
-"        <boolean value=\"false\" />\n"
-"    </attribute>\n"
-"    <attribute id=\"0x0206\">    <!-- HID Descriptor List -->\n"
-"        <sequence>\n"
-"            <sequence>\n"
-"                <uint8 value=\"0x22\" />  <!-- Class Descriptor Type = Report -->\n"
-"                <text encoding=\"hex\" value=\"05010902A10185010901A1000509190129031500250175019503810275059501810105010930093109381581257F750895038106C0C005010906A1018502A100050719E029E71500250175019508810295087508150025650507190029658100C0C0\"/>\n"
-"            </sequence>\n"
-"        </sequence>\n"
-"    </attribute>\n"
-"    <attribute id=\"0x0207\">    <!--HID LANGID Base List        -->\n"
-"        <sequence>    <!-- HID LANGID Base -->\n"
-"            <sequence>\n"
-"                <uint16 value=\"0x0409\" />    <!-- Natural Language Code = English (United States) -->\n"
-"                <uint16 value=\"0x0100\" />    <!-- String Base = 0x0100 -->\n"
-"            </sequence>\n"
-"        </sequence>\n"
-"    </attribute>\n"
-"    <attribute id=\"0x020b\">    <!-- SDP_ATTR_HID_PROFILE_VERSION        -->\n"
-"        <uint16 value=\"0x0100\" />\n"
-"    </attribute>\n"
-"    <attribute id=\"0x020c\">    <!--SDP_ATTR_HID_SUPERVISION_TIMEOUT    -->\n"
-"        <uint16 value=\"0x0c80\" />\n"
-"    </attribute>\n"
-"    <attribute id=\"0x020d\">    <!-- SDP_ATTR_HID_NORMALLY_CONNECTABLE -->\n"
-"        <boolean value=\"true\" />\n"
-"    </attribute>\n"
-"    <attribute id=\"0x020e\">    <!--SDP_ATTR_HID_BOOT_DEVICE-->\n"
-"        <boolean value=\"false\" />\n"
-"    </attribute>\n"
-"    <attribute id=\"0x020f\">\n"
-"        <uint16 value=\"0x0640\" />\n"
-"    </attribute>\n"
-"    <attribute id=\"0x0210\">\n"
-"        <uint16 value=\"0x0320\" />\n"
-"    </attribute>\n"
-"</record>";
+//********************** SDP record
+// Generated from the report descriptor in hidcore.h by sdpgen (see
+// Makefile): sdp_records[nkro][reconnect]
+#include "sdprecord.h"
 
 GVariant *build_register_profile_params(const char *object_path, const char *uuid, const char *service_record)
 {
@@ -306,46 +740,343 @@ GVariant *build_register_profile_params(const char *object_path, const char *uui
     g_variant_builder_add (builder, "{sv}", "Role", g_variant_new_string ("server"));
     g_variant_builder_add (builder, "{sv}", "RequireAuthentication", g_variant_new_boolean(0));
     g_variant_builder_add (builder, "{sv}", "RequireAuthorization", g_variant_new_boolean(0));
+    // BlueZ listens on the control PSM and calls NewConnection for us
+    g_variant_builder_add (builder, "{sv}", "PSM", g_variant_new_uint16(PSMHIDCTL));
     g_variant_builder_close (builder);
     value = g_variant_builder_end (builder);
     g_variant_builder_unref (builder);
     return value;
 }
 
+//********************** D-Bus thread
+// Calls to BlueZ are made from a thread of their own, running a GLib
+// main loop, so no D-Bus round trip ever holds up the main loop. The
+// thread also serves our org.bluez.Profile1 object: BlueZ listens on
+// PSMHIDCTL for us and hands over each control channel it accepts.
+// Everything the main loop has to know is a struct dbusmsg_t written
+// to dbuspipe, flagged EVTAG_DBUS, see dbus_result().
+
+static const gchar	profile_xml[] =
+"<node>"
+"  <interface name='org.bluez.Profile1'>"
+"    <method name='Release' />"
+"    <method name='NewConnection'>"
+"      <arg type='o' name='device' direction='in' />"
+"      <arg type='h' name='fd' direction='in' />"
+"      <arg type='a{sv}' name='fd_properties' direction='in' />"
+"    </method>"
+"    <method name='RequestDisconnection'>"
+"      <arg type='o' name='device' direction='in' />"
+"    </method>"
+"  </interface>"
+"</node>";
+
+// Hand a message to the main loop (in the D-Bus thread)
+// Return value: 0 = OK, <0 = dbuspipe full or broken (errno)
+static int	dbus_post ( int kind, int fd, const char * device )
+{
+    struct dbusmsg_t	m;
+    const char	*p;
+    char	addr[18];
+    int		k;
+    memset ( &m, 0, sizeof(m) );
+    m.kind = kind;
+    m.fd = fd;
+    // Device object paths end in dev_XX_XX_XX_XX_XX_XX
+    if ( ( NULL != device ) && ( NULL != ( p = strstr ( device, "dev_" ) ) ) &&
+         ( strlen ( p + 4 ) == 17 ) )
+    {
+        for ( k = 0; k < 17; ++k )
+        {
+            addr[k] = ( p[4+k] == '_' ) ? ':' : p[4+k];
+        }
+        addr[17] = 0;
+        str2ba ( addr, &m.bdaddr );
+    }
+    if ( (ssize_t)sizeof(m) != write ( dbuspipe[1], &m, sizeof(m) ) ) return -1;
+    return	0;
+}
+
+// Method calls on PROFiLE_DBUS_PATH, from BlueZ (in the D-Bus thread)
+static void	profile_call ( GDBusConnection * connection, const gchar * sender,
+		const gchar * path, const gchar * iface, const gchar * method,
+		GVariant * params, GDBusMethodInvocation * call, gpointer data )
+{
+    GError *err = NULL;
+    GVariant *props;
+    GUnixFDList *fds;
+    const gchar *device = NULL;
+    gint	idx, fd;
+    int		e;
+    if ( 0 == strcmp ( method, "NewConnection" ) )
+    {
+        g_variant_get ( params, "(&oh@a{sv})", &device, &idx, &props );
+        g_variant_unref ( props );
+        fds = g_dbus_message_get_unix_fd_list (
+            g_dbus_method_invocation_get_message ( call ) );
+        fd = ( NULL == fds ) ? -1 : g_unix_fd_list_get ( fds, idx, &err );
+        if ( 0 > fd )
+        {
+            fprintf ( stderr, "NewConnection without a socket from %s\n",
+                device );
+            g_clear_error ( &err );
+            g_dbus_method_invocation_return_error ( call, G_DBUS_ERROR,
+                G_DBUS_ERROR_INVALID_ARGS, "No file descriptor" );
+            return;
+        }
+        if ( dbus_post ( DBUS_NEWCONN, fd, device ) )
+        {	// The main loop would never learn of the socket
+            e = errno;
+            fprintf ( stderr, "Dropping connection from %s: %s\n",
+                device, strerror ( e ) );
+            close ( fd );
+            g_dbus_method_invocation_return_error ( call, G_DBUS_ERROR,
+                G_DBUS_ERROR_FAILED, "Connection not taken: %s",
+                strerror ( e ) );
+            return;
+        }
+    }
+    else if ( 0 == strcmp ( method, "RequestDisconnection" ) )
+    {
+        g_variant_get ( params, "(&o)", &device );
+        dbus_post ( DBUS_DISCONNECT, -1, device );
+    }
+    else if ( 0 == strcmp ( method, "Release" ) )
+    {
+        dbus_post ( DBUS_RELEASED, -1, NULL );
+    }
+    g_dbus_method_invocation_return_value ( call, NULL );
+}
+
+static const GDBusInterfaceVTable	profile_vtable = { profile_call, NULL, NULL, { NULL } };
+
+// Result of RegisterProfile (in the D-Bus thread)
+static void	sdp_registered ( GObject * source, GAsyncResult * res, gpointer data )
+{
+    GError *err = NULL;
+    GVariant *ret;
+    ret = g_dbus_connection_call_finish ( G_DBUS_CONNECTION(source), res, &err );
+    if (err != NULL) {
+        fprintf (stderr, "Unable to call RegisterProfile: %s\n", err->message);
+        g_error_free ( err );
+        dbus_post ( DBUS_FAILED, -1, NULL );
+        return;
+    }
+    g_variant_unref ( ret );
+    dbus_post ( DBUS_REGISTERED, -1, NULL );
+}
+
 /*
  * dosdpregistration -	Care for the proper SDP record sent to the "sdpd"
- *			so that other BT devices can discover the HID service
- * Parameters: none; Return value: 0 = OK, >0 = failure
+ *			so that other BT devices can discover the HID service:
+ *			export the profile object, then register it. Runs in
+ *			the D-Bus thread and returns before BlueZ answers,
+ *			sdp_registered() gets that.
+ * Parameters: none; Return value: 0 = OK, <0 = failure
  */
 int	dosdpregistration ( void )
+{
+    GDBusConnection *connection;
+    GDBusNodeInfo *node;
+    GError *err = NULL;
+    connection = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, &err);
+    if (err != NULL) {
+        fprintf (stderr, "Call g_bus_get_sync failed: %s\n", err->message);
+        g_error_free ( err );
+        return -1;
+    }
+    node = g_dbus_node_info_new_for_xml ( profile_xml, &err );
+    if ( NULL != node )
+    {
+        profileid = g_dbus_connection_register_object ( connection,
+            PROFiLE_DBUS_PATH, node->interfaces[0], &profile_vtable,
+            NULL, NULL, &err );
+        g_dbus_node_info_unref ( node );
+    }
+    if (err != NULL) {
+        fprintf (stderr, "Unable to export %s: %s\n", PROFiLE_DBUS_PATH,
+            err->message);
+        g_error_free ( err );
+        return -1;
+    }
+    // The record was built by sdpgen; with -R, hosts are told that
+    // we reconnect to them, not vice versa
+    g_dbus_connection_call (connection,
+                            "org.bluez",
+                            "/org/bluez",
+                            "org.bluez.ProfileManager1",
+                            "RegisterProfile",
+                            build_register_profile_params(PROFiLE_DBUS_PATH, UUID,
+                                sdp_records[nkro != 0][hostfile != NULL]),
+                            NULL,
+                            G_DBUS_CALL_FLAGS_NONE,
+                            -1,
+                            NULL,
+                            sdp_registered,
+                            NULL);
+    return 0;
+}
+
+// Main of the D-Bus thread: adapter setup and registration, then
+// serve dbusctx until dbus_stop()
+void *	dbus_main ( void * arg )
+{
+    GDBusConnection *connection;
+    sigset_t	all;
+    // Signals are for the main loop (epoll_pwait) to see
+    sigfillset ( &all );
+    pthread_sigmask ( SIG_BLOCK, &all, NULL );
+    g_main_context_push_thread_default ( dbusctx );
+    // Same as "hciconfig hci0 up piscan", without running it
+    if ( adapter_set ( "Powered", 1 ) || adapter_set ( "Discoverable", 1 ) )
+    {
+        fprintf ( stderr, "Failed to enable the Bluetooth adapter\n" );
+    }
+    if ( dbussdp && dosdpregistration () )
+    {
+        dbus_post ( DBUS_FAILED, -1, NULL );
+    }
+    g_main_loop_run ( dbusloop );
+    if ( 0 != profileid )
+    {
+        connection = g_bus_get_sync ( G_BUS_TYPE_SYSTEM, NULL, NULL );
+        if ( NULL != connection )
+        {
+            g_dbus_connection_unregister_object ( connection, profileid );
+        }
+        profileid = 0;
+    }
+    g_main_context_pop_thread_default ( dbusctx );
+    return	NULL;
+}
+
+// Runs in the D-Bus thread, so the loop is surely running when it quits
+static gboolean	dbus_quit ( gpointer data )
+{
+    g_main_loop_quit ( dbusloop );
+    return	FALSE;
+}
+
+/*
+ *	dbus_start - Start the D-Bus thread, registering the SDP record
+ *	if sdp is set. Return value: 0 = OK, <0 = failure
+ */
+int	dbus_start ( char sdp )
+{
+    if ( pipe2 ( dbuspipe, O_NONBLOCK | O_CLOEXEC ) ||
+         evt_add ( dbuspipe[0], EVTAG(EVTAG_DBUS,0), EPOLLIN ) )
+    {
+        fprintf ( stderr, "Failed to set up D-Bus thread pipe\n" );
+        return	-1;
+    }
+    dbussdp = sdp;
+    dbusctx = g_main_context_new ();
+    dbusloop = g_main_loop_new ( dbusctx, FALSE );
+    if ( 0 != pthread_create ( &dbusthread, NULL, dbus_main, NULL ) )
+    {
+        fprintf ( stderr, "Failed to start D-Bus thread\n" );
+        g_main_loop_unref ( dbusloop );
+        g_main_context_unref ( dbusctx );
+        dbusloop = NULL;
+        return	-1;
+    }
+    return	0;
+}
+
+/*
+ *	dbus_result - EVTAG_DBUS: handle what the D-Bus thread has sent
+ *	Return value: 0 = OK, <0 = the SDP record could not be registered
+ */
+int	dbus_result ( void )
+{
+    struct dbusmsg_t	m;
+    int		s, r = 0;
+    while ( sizeof(m) == read ( dbuspipe[0], &m, sizeof(m) ) )
+    {
+        switch ( m.kind )
+        {
+          case	DBUS_REGISTERED:
+            fprintf ( stdout, "HID keyboard/mouse service registered\n" );
+            sdpstate = 1;
+            break;
+          case	DBUS_FAILED:
+            sdpstate = -1;
+            r = -1;
+            break;
+          case	DBUS_RELEASED:
+            fprintf ( stderr, "BlueZ released the HID profile\n" );
+            sdpstate = 0;
+            break;
+          case	DBUS_NEWCONN:
+            // A control channel BlueZ accepted on PSMHIDCTL for us
+            if ( 0 == sc_adopt ( m.fd, &m.bdaddr ) )
+            {
+                session_accept_ctl ( m.fd, &m.bdaddr );
+            }
+            break;
+          case	DBUS_DISCONNECT:
+            for ( s = 0; s < MAXSESSIONS; ++s )
+            {
+                if ( ( sessions[s].sctl >= 0 ) &&
+                     ( 0 == bacmp ( &sessions[s].bdaddr, &m.bdaddr ) ) )
+                {
+                    sessions[s].dead = 1;
+                }
+            }
+            break;
+        }
+    }
+    return	r;
+}
+
+// Stop the D-Bus thread, after sdpunregister()
+void	dbus_stop ( void )
+{
+    if ( NULL == dbusloop ) return;
+    g_main_context_invoke ( dbusctx, dbus_quit, NULL );
+    pthread_join ( dbusthread, NULL );
+    g_main_loop_unref ( dbusloop );
+    g_main_context_unref ( dbusctx );
+    dbusloop = NULL;
+    close ( dbuspipe[0] );
+    close ( dbuspipe[1] );
+}
+
+/*
+ *	adapter_set - Set boolean property prop of the Bluetooth adapter
+ *	(org.bluez.Adapter1 on ADAPTER_DBUS_PATH) through D-Bus
+ *	Return value: 0 = OK, <0 = failure
+ */
+int	adapter_set ( const char *prop, int value )
 {
     GDBusConnection *connection;
     GError *err = NULL;
+    GVariant *ret;
     connection = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, &err);
     if (err != NULL) {
         fprintf (stderr, "Call g_bus_get_sync failed: %s\n", err->message);
+        g_error_free ( err );
         return -1;
     }
-    g_dbus_connection_call_sync (connection,
+    ret = g_dbus_connection_call_sync (connection,
                                 "org.bluez",
-                                "/org/bluez",
-                                "org.bluez.ProfileManager1",
-                                "RegisterProfile",
-                                // g_variant_new("(os)",
-                                //     "/bluez/yaptb/btkb_profile",
-                                //     "00001124-0000-1000-8000-00805f9b34fb"
-                                // ),
-                                build_register_profile_params(PROFiLE_DBUS_PATH, UUID, sdp_record),
+                                ADAPTER_DBUS_PATH,
+                                "org.freedesktop.DBus.Properties",
+                                "Set",
+                                g_variant_new("(ssv)", "org.bluez.Adapter1",
+                                    prop, g_variant_new_boolean(value)),
                                 NULL,
                                 G_DBUS_CALL_FLAGS_NONE,
                                 -1,
                                 NULL,
                                 &err);
+    g_object_unref ( connection );
     if (err != NULL) {
-        fprintf (stderr, "Unable to call RegisterProfile: %s\n", err->message);
+        fprintf (stderr, "Unable to set adapter %s: %s\n", prop, err->message);
+        g_error_free ( err );
         return -1;
     }
-    fprintf ( stdout, "HID keyboard/mouse service registered\n" );
+    g_variant_unref ( ret );
     return 0;
 }
 
@@ -394,6 +1125,40 @@ int	btbind ( int sockfd, unsigned short port ) {
     return	i;
 }
 
+/*
+ *	btlisten - Listen for L2CAP channels on PSM port, registered with
+ *	the reactor as EVTAG(tag,0). Return value: the socket, or -2/-3/-4
+ *	if it could not be created/bound/set listening
+ */
+int	btlisten ( unsigned short port, int tag )
+{
+    int	fd, reuse = 1;
+    fd = socket ( AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP );
+    if ( 0 > fd )
+    {
+        fprintf ( stderr, "Failed to generate bluetooth socket\n" );
+        return	-2;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse)) < 0)
+        perror("setsockopt(SO_REUSEADDR) failed");
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (const char*)&reuse, sizeof(reuse)) < 0) 
+        perror("setsockopt(SO_REUSEPORT) failed");
+    if ( btbind ( fd, port ) )
+    {
+        close ( fd );
+        return	-3;
+    }
+    // Inherited by the channels accepted
+    link_sockopts ( fd, port, 0 );
+    if ( listen ( fd, MAXSESSIONS ) || evt_add ( fd, EVTAG(tag,0), EPOLLIN ) )
+    {
+        fprintf ( stderr, "Failed to listen on PSM %d\n", port );
+        close ( fd );
+        return	-4;
+    }
+    return	fd;
+}
+
 
 /*
  *	initfifo(filename) - creates (if necessary) and opens fifo
@@ -402,6 +1167,7 @@ int	btbind ( int sockfd, unsigned short port ) {
  */
 int	initfifo ( char *filename )
 {
+    int	i;
     struct stat ss;
     if ( NULL == filename ) return 0;
     if ( 0 == stat ( filename, &ss ) )
@@ -418,7 +1184,13 @@ int	initfifo ( char *filename )
             return 0;
         }
     }
-    eventdevs[0] = open ( filename, O_RDONLY | O_NONBLOCK );
+    for ( i = 0; i < MAXEVDEVS; ++i )
+    {
+        eventdevs[i] = -1;
+    }
+    // Opened read/write, so the fifo never reports EOF (which would keep
+    // the reactor spinning) while no writer is attached
+    eventdevs[0] = open ( filename, O_RDWR | O_NONBLOCK );
     if ( 0 > eventdevs[0] )
     {
         fprintf ( stderr, "Failed to open fifo [%s] for reading.\n", filename );
@@ -428,205 +1200,703 @@ int	initfifo ( char *filename )
 }
 
 /*
- * 	initevents () - opens all required event files
- * 	or only the ones specified by evdevmask, if evdevmask != 0
- *	try to disable in X11 if mutex11 is set to 1
- * 	returns number of successfully opened event file nodes, or <1 for error
+ *	loadkeymap(filename) - overrides entries of hidcore_keymap/modmap from a
+ *	layout file. Each line holds an evdev keycode and the HID usage it
+ *	shall be sent as (decimal or 0x-hex), '#' starts a comment.
+ *	Usage 0 disables a key, usages 0xe0..0xe7 make it a modifier. A key
+ *	listed is a keyboard key, no longer consumer or system control.
+ *	Returns number of entries read, or <0 for error
  */
-int	initevents ( unsigned int evdevmask, int mutex11 )
+int	loadkeymap ( char *filename )
 {
-    int	i, j, k;
-    char	buf[sizeof(EVDEVNAME)+8];
-    char	*xinlist = NULL;
     FILE	*pf;
+    char	line[256];
     char	*p, *q;
-    if ( mutex11 )
+    long	code, usage;
+    int	n = 0, lineno = 0;
+    if ( NULL == ( pf = fopen ( filename, "r" ) ) )
     {
-        if ( NULL == ( xinlist = malloc ( 4096 ) ) )
-        {
-            printf ( "Memory alloc error\n" );
-            return 0;
+        fprintf ( stderr, "Failed to open layout file [%s]: %s\n",
+            filename, strerror ( errno ) );
+        return	-1;
+    }
+    while ( NULL != fgets ( line, sizeof(line), pf ) )
+    {
+        ++lineno;
+        if ( NULL != ( p = strchr ( line, '#' ) ) ) *p = 0;
+        code = strtol ( line, &p, 0 );
+        if ( p == line )
+        {	// Nothing but whitespace?
+            while ( ( *p == ' ' ) || ( *p == '\t' ) ) ++p;
+            if ( ( *p == 0 ) || ( *p == '\n' ) || ( *p == '\r' ) ) continue;
         }
-        bzero ( xinlist, 4096 );
-        if ( NULL != ( pf = popen ("xinput --list --short", "r" ) ) )
+        usage = strtol ( p, &q, 0 );
+        if ( ( p == line ) || ( q == p ) || ( code < 0 ) ||
+             ( code > KEY_MAX ) || ( usage < 0 ) || ( usage > 0xff ) )
         {
-            if ( 1 > fread ( xinlist, 1, 3800, pf ) )
-            {
-                printf ( "\tx11-mutable information not available.\n" );
-                free ( xinlist );
-                xinlist = NULL;
-            }
+            fprintf ( stderr, "%s:%d: invalid layout entry\n",
+                filename, lineno );
+            fclose ( pf );
+            return	-1;
         }
-        fclose ( pf );
-    }
-    for ( i = 0; i < MAXEVDEVS; ++i )
-    {
-        eventdevs[i] = -1;
-        x11handles[i] = -1;
-    }
-    for ( i = j = 0; j < MAXEVDEVS; ++j )
-    {
-        if ( ( evdevmask != 0 ) && ( ( evdevmask & ( 1 << j ) ) == 0 ) ) { continue; }
-        sprintf ( buf, EVDEVNAME, j );
-        eventdevs[i] = open ( buf, O_RDONLY );
-        if ( 0 <= eventdevs[i] )
+        hidcore_consumermap[code] = 0;
+        hidcore_sysmap[code] = 0;
+        if ( ( usage >= 0xe0 ) && ( usage <= 0xe7 ) )
         {
-            fprintf ( stdout, "Opened %s as event device [counter %d]\n", buf, i );
-            if ( ( mutex11 > 0 ) && ( xinlist != NULL ) )
-            {
-                k = -1;
-                xinlist[3801] = 0;
-                if ( ioctl(eventdevs[i], EVIOCGNAME(256),xinlist+3801) >= 0 )
-                {
-                    p = xinlist;
-                    xinlist[4056] = 0;
-                    if ( strlen(xinlist+3801) < 4 ) // min lenght for name
-                        p = xinlist + 4056;
-                    while ( (*p != 0) &&
-                        ( NULL != ( p = strstr ( p, xinlist+3801 ) ) ) )
-                    {
-                        q = p + strlen(xinlist+3801);
-                        while ( *q == ' ' ) ++q;
-                        if ( strncmp ( q, "\tid=", 4 ) == 0 )
-                        {
-                            k = atoi ( q + 4 );
-                            p = xinlist + 4056;
-                        } else {
-                            p = q;
-                        }
-                    }
-                }
-                if ( k >= 0 ) {
-                    sprintf ( xinlist+3801, "xinput set-int-prop %d \"Device "\
-                        "Enabled\" 8 0", k );
-                    if ( system ( xinlist + 3801 ) )
-                    {
-                        fprintf ( stderr, "Failed to x11-mute.\n" );
-                    }
-                    x11handles[i] = k;
-                }
-            }
-            ++i;
+            hidcore_modmap[code] = 1 << ( usage - 0xe0 );
+            hidcore_keymap[code] = 0;
+        } else {
+            hidcore_modmap[code] = 0;
+            hidcore_keymap[code] = usage;
         }
+        ++n;
     }
-    if ( xinlist != NULL ) { free ( xinlist ); }
-    return	i;
+    fclose ( pf );
+    return	n;
 }
 
-void	closeevents ( void )
+//***************** Device routing
+// With -g<file>, each event device is matched against rules when it is
+// opened: one per line, match terms and actions, '#' starts a comment,
+// e.g.
+//	name="*Consumer Control"	local
+//	vendor=0x046d product=0xc52b	host=2 grab
+//	has=abs				reports=abs,mouse
+// Match terms (all must match): name=<pattern> (fnmatch, may be "quoted"),
+// vendor=<id>, product=<id>, has=<key,rel,abs,led>. Actions: host=<n>
+// sends to host n only instead of the one selected by LCtrl+LAlt+<n>,
+// local leaves the device alone, grab/nograb override -x, reports=
+// <keyboard,mouse,abs,consumer,system> passes only those. The first rule
+// matching decides, devices no rule matches get defroute. Every rule has
+// a core of its own, so routed devices share no key state with others;
+// process_event() picks it from evdevroute[] by slot.
+
+// Next blank separated word of *p into word (quotes taken off), "" at the end
+static void route_word ( char ** p, char * word, int size )
 {
-    int	i;
-    char	buf[256];
-    for ( i = 0; i < MAXEVDEVS; ++i )
+    char	*s = *p;
+    int	n = 0, quoted = 0;
+    while ( ( *s == ' ' ) || ( *s == '\t' ) || ( *s == '\n' ) || ( *s == '\r' ) ) ++s;
+    for ( ; *s && ( quoted || ( ( *s != ' ' ) && ( *s != '\t' ) &&
+          ( *s != '\n' ) && ( *s != '\r' ) ) ); ++s )
     {
-        if ( eventdevs[i] >= 0 )
+        if ( *s == '"' )
         {
-            close ( eventdevs[i] );
-            if ( x11handles[i] >= 0 )
-            {
-                sprintf ( buf, "xinput set-int-prop %d \"Device "\
-                "Enabled\" 8 1", x11handles[i] );
-                if ( system ( buf ) )
-                {
-                    fprintf ( stderr, "Failed to x11-unmute device %d.\n", i );
-                }
-            }
+            quoted = ! quoted;
+        }
+        else if ( n < size - 1 )
+        {
+            word[n++] = *s;
         }
     }
-    return;
+    word[n] = 0;
+    *p = s;
 }
 
-void	closefifo ( void )
+// Bits for the comma separated names in list (names[k] => bits[k]),
+// or 0 if one is unknown
+static unsigned long route_list ( char * list, const char * const * names,
+    const unsigned long * bits )
 {
-    if ( eventdevs[0] >= 0 )
-        close(eventdevs[0]);
-    return;
+    unsigned long	r = 0;
+    char	*w;
+    int	k;
+    for ( w = strtok ( list, "," ); NULL != w; w = strtok ( NULL, "," ) )
+    {
+        for ( k = 0; ( NULL != names[k] ) && strcmp ( w, names[k] ); ++k ) {;}
+        if ( NULL == names[k] ) return 0;
+        r |= bits[k];
+    }
+    return	r;
 }
 
-void	cleanup_stdin ( void )
+/*
+ *	loadroutes(filename) - Read the routing rules (see above)
+ *	Returns number of rules read, or <0 for error
+ */
+int	loadroutes ( char *filename )
 {
-    // Cleans everything but the characters after the last ENTER keypress.
-    // This is necessary BECAUSE while reading all keyboard input from the
-    // event devices, those key presses will still stay in the stdin queue.
-    // We do not want to have a backlog of hundreds of characters, possibly
-    // commands and so on.
-    fd_set fds;
-    struct timeval tv;
-    FD_ZERO ( &fds );
-    FD_SET ( 0, &fds );
-    tv.tv_sec  = 0;
-    tv.tv_usec = 0;
-    char buf[8];
-    while ( 0 < select ( 1, &fds, NULL, NULL, &tv ) )
+    static const char * const	capnames[] = { "key", "rel", "abs", "led", NULL };
+    static const unsigned long	capbits[] = { 1UL << EV_KEY, 1UL << EV_REL,
+        1UL << EV_ABS, 1UL << EV_LED };
+    static const char * const	repnames[] = { "keyboard", "mouse", "abs",
+        "consumer", "system", NULL };
+    static const unsigned long	repbits[] = { 1 << REPORTID_KEYBD,
+        1 << REPORTID_MOUSE, 1 << REPORTID_ABS, 1 << REPORTID_CONSUMER,
+        1 << REPORTID_SYSTEM };
+    FILE	*pf;
+    char	line[512], word[256];
+    char	*p, *v, *q;
+    struct route_t	*rt;
+    int	lineno = 0, ok;
+    if ( NULL == ( pf = fopen ( filename, "r" ) ) )
     {
-        while ( read ( 0, buf, 8 ) ) {;}
-        FD_ZERO ( &fds );
-        FD_SET ( 0, &fds );
-        tv.tv_sec  = 0;
-        tv.tv_usec = 1;
+        fprintf ( stderr, "Failed to open routing file [%s]: %s\n",
+            filename, strerror ( errno ) );
+        return	-1;
     }
-    close ( 0 );
-    return;
+    while ( NULL != fgets ( line, sizeof(line), pf ) )
+    {
+        ++lineno;
+        if ( NULL != ( p = strchr ( line, '#' ) ) ) *p = 0;
+        p = line;
+        route_word ( &p, word, sizeof(word) );
+        if ( word[0] == 0 ) continue;
+        if ( nroutes == MAXROUTES )
+        {
+            fprintf ( stderr, "%s:%d: more than %d rules\n", filename,
+                lineno, MAXROUTES );
+            fclose ( pf );
+            return	-1;
+        }
+        rt = &routes[nroutes];
+        memset ( rt, 0, sizeof(*rt) );
+        rt->vendor = rt->product = -1;
+        rt->host = ROUTE_ACTIVE;
+        rt->grab = -1;
+        rt->reports = ~0u;
+        rt->line = lineno;
+        rt->core = &routecore[nroutes];
+        for ( ok = 1; ok && word[0]; route_word ( &p, word, sizeof(word) ) )
+        {
+            if ( NULL != ( v = strchr ( word, '=' ) ) ) *v++ = 0;
+            if ( ( NULL == v ) && ! strcmp ( word, "local" ) )
+                rt->host = ROUTE_LOCAL;
+            else if ( ( NULL == v ) && ! strcmp ( word, "grab" ) )
+                rt->grab = 1;
+            else if ( ( NULL == v ) && ! strcmp ( word, "nograb" ) )
+                rt->grab = 0;
+            else if ( NULL == v )
+                ok = 0;
+            else if ( ! strcmp ( word, "name" ) && ( strlen ( v ) < sizeof(rt->name) ) )
+                strcpy ( rt->name, v );
+            else if ( ! strcmp ( word, "vendor" ) )
+                ok = ( ( rt->vendor = strtol ( v, &q, 0 ) ) >= 0 ) && ! *q;
+            else if ( ! strcmp ( word, "product" ) )
+                ok = ( ( rt->product = strtol ( v, &q, 0 ) ) >= 0 ) && ! *q;
+            else if ( ! strcmp ( word, "has" ) )
+                ok = ( 0 != ( rt->caps = route_list ( v, capnames, capbits ) ) );
+            else if ( ! strcmp ( word, "reports" ) )
+                ok = ( 0 != ( rt->reports = route_list ( v, repnames, repbits ) ) );
+            else if ( ! strcmp ( word, "host" ) )
+                ok = ( ( rt->host = strtol ( v, &q, 0 ) - 1 ) >= 0 ) &&
+                    ( rt->host < MAXSESSIONS ) && ! *q;
+            else
+                ok = 0;
+        }
+        if ( ! ok )
+        {
+            fprintf ( stderr, "%s:%d: invalid routing rule\n",
+                filename, lineno );
+            fclose ( pf );
+            return	-1;
+        }
+        ++nroutes;
+    }
+    fclose ( pf );
+    return	nroutes;
 }
 
-int	add_filedescriptors ( fd_set * fdsp )
+// Set up the cores of all routes, before input is read
+void	routes_init ( void )
 {
-    // Simply add all open eventdev fds to the fd_set for select.
-    int	i, j;
-    FD_ZERO ( fdsp );
-    j = -1;
-    for ( i = 0; i < MAXEVDEVS; ++i )
+    struct route_t	*rt;
+    int	k;
+    for ( k = -1; k < nroutes; ++k )
     {
-        if ( eventdevs[i] >= 0 )
-        {
-            FD_SET ( eventdevs[i], fdsp );
-            if ( eventdevs[i] > j )
-            {
-                j = eventdevs[i];
-            }
-        }
+        rt = ( k < 0 ) ? &defroute : &routes[k];
+        hidcore_init ( rt->core, hid_sink, rt );
+        rt->core->nkro = nkro;
+        rt->core->hosts = MAXSESSIONS;
     }
-    return	j;
 }
 
 /*
- *	list_input_devices - Show a human-readable list of all input devices
- *	the current user has permissions to read from.
- *	Add info wether this probably can be "muted" in X11 if requested
+ *	route_match - The route of the event device open on fd (carrying
+ *	EV_* evbits): the first rule matching it, else defroute
  */
-int	list_input_devices ()
+static struct route_t * route_match ( int fd, unsigned long evbits )
 {
-    int	i, fd;
-    char	buf[sizeof(EVDEVNAME)+8];
-    struct input_id device_info;
-    char	namebuf[256];
-    char	*xinlist;
-    FILE	*pf;
-    char	*p, *q;
-    char	x11 = 0;
-    if ( NULL == ( xinlist = malloc ( 4096 ) ) )
+    struct input_id	id;
+    char	name[256];
+    struct route_t	*rt;
+    int	k;
+    if ( nroutes == 0 ) return &defroute;
+    memset ( &id, 0, sizeof(id) );
+    name[0] = 0;
+    ioctl ( fd, EVIOCGID, &id );
+    if ( 0 > ioctl ( fd, EVIOCGNAME(sizeof(name)-1), name ) ) name[0] = 0;
+    name[sizeof(name)-1] = 0;
+    for ( k = 0; k < nroutes; ++k )
     {
-        printf ( "Memory alloc error\n" );
-        return	1;
+        rt = &routes[k];
+        if ( ( rt->name[0] && fnmatch ( rt->name, name, 0 ) ) ||
+             ( ( rt->vendor >= 0 ) && ( rt->vendor != id.vendor ) ) ||
+             ( ( rt->product >= 0 ) && ( rt->product != id.product ) ) ||
+             ( rt->caps & ~evbits ) ) continue;
+        return	rt;
     }
-    bzero ( xinlist, 4096 );
-    if ( NULL != ( pf = popen ("xinput --list --name-only", "r" ) ) )
+    return	&defroute;
+}
+
+// Show ledstate (HID LED bit order = LED_NUML.. order) on slot i
+static void evdev_leds ( int i )
+{
+    struct input_event	ev[6];
+    int	k;
+    memset ( ev, 0, sizeof(ev) );
+    for ( k = 0; k < 5; ++k )
+    {
+        ev[k].type = EV_LED;
+        ev[k].code = LED_NUML + k;
+        ev[k].value = ( ledstate >> k ) & 1;
+    }
+    ev[5].type = EV_SYN;
+    ev[5].code = SYN_REPORT;
+    if ( 0 > write ( eventdevs[i], ev, sizeof(ev) ) )
+    {	// Not fatal, it just keeps its old LED state
+        evdevleds[i] = 0;
+    }
+}
+
+// Bit b of an EVIOCGBIT/EVIOCGPROP byte array
+#define	EVBIT(a,b)	( (a)[(b) >> 3] & ( 1 << ( (b) & 7 ) ) )
+
+/*
+ *	evdev_abs - Make event device slot i (fd) an absolute pointer if it
+ *	is a touch screen or pen tablet: ABS_X/ABS_Y and BTN_TOUCH, plus a
+ *	direct input device or a pen. Touchpads are left out, they move the
+ *	pointer relative to where it is.
+ *	Returns 1 if it is one
+ */
+static int evdev_abs ( int i, int fd, unsigned long evbits )
+{
+    unsigned char	absbits[ABS_MAX/8+1], keybits[KEY_MAX/8+1];
+    unsigned char	props[INPUT_PROP_MAX/8+1];
+    struct input_absinfo	ax, ay;
+    memset ( absbits, 0, sizeof(absbits) );
+    memset ( keybits, 0, sizeof(keybits) );
+    memset ( props, 0, sizeof(props) );
+    hidcore_abs_setup ( evdevroute[i]->core, i, 0, 0, 0, 0 );
+    if ( ( 0 == ( evbits & ( 1UL << EV_ABS ) ) ) ||
+         ( 0 > ioctl ( fd, EVIOCGBIT(EV_ABS,sizeof(absbits)), absbits ) ) ||
+         ( 0 > ioctl ( fd, EVIOCGBIT(EV_KEY,sizeof(keybits)), keybits ) ) ||
+         ! EVBIT ( absbits, ABS_X ) || ! EVBIT ( absbits, ABS_Y ) ||
+         ! EVBIT ( keybits, BTN_TOUCH ) )
+    {
+        return	0;
+    }
+    ioctl ( fd, EVIOCGPROP(sizeof(props)), props ); // none on old kernels
+    if ( ! EVBIT ( props, INPUT_PROP_DIRECT ) && ! EVBIT ( keybits, BTN_TOOL_PEN ) )
+    {
+        return	0;
+    }
+    if ( ( 0 > ioctl ( fd, EVIOCGABS(ABS_X), &ax ) ) ||
+         ( 0 > ioctl ( fd, EVIOCGABS(ABS_Y), &ay ) ) ||
+         ( ax.maximum <= ax.minimum ) || ( ay.maximum <= ay.minimum ) )
+    {
+        return	0;
+    }
+    hidcore_abs_setup ( evdevroute[i]->core, i, ax.minimum, ax.maximum,
+        ay.minimum, ay.maximum );
+    return	1;
+}
+
+/*
+ *	evdev_add - Open /dev/input/event<num> if it is wanted (evdevmask)
+ *	and can deliver keys or relative motion, and add it to the reactor
+ *	(reading only while a host is connected).
+ *	Returns slot number or <0 if the device is not used
+ */
+int	evdev_add ( int num )
+{
+    int	i, fd, clk, pointer;
+    struct route_t	*rt;
+    char	buf[sizeof(EVDEVNAME)+8];
+    unsigned long	evbits = 0;
+    if ( ( evdevmask != 0 ) && ( ( num >= 64 ) ||
+         ( ( evdevmask & ( 1ULL << num ) ) == 0 ) ) ) { return -1; }
+    for ( i = 0; i < MAXEVDEVS; ++i )
+    {	// udev may report a node twice (created, then chmod'ed)
+        if ( ( eventdevs[i] >= 0 ) && ( evdevnode[i] == num ) ) return -1;
+    }
+    for ( i = 0; ( i < MAXEVDEVS ) && ( eventdevs[i] >= 0 ); ++i ) {;}
+    if ( i == MAXEVDEVS ) return -1;
+    sprintf ( buf, EVDEVNAME, num );
+    // Writable if possible, for mirroring the host's LEDs
+    if ( ( 0 > ( fd = open ( buf, O_RDWR | O_NONBLOCK | O_CLOEXEC ) ) ) &&
+         ( 0 > ( fd = open ( buf, O_RDONLY | O_NONBLOCK | O_CLOEXEC ) ) ) )
+    {
+        return	-1; // Probably not accessible (yet)
+    }
+    if ( ( 0 > ioctl ( fd, EVIOCGBIT(0,sizeof(evbits)), &evbits ) ) ||
+         ( 0 == ( evbits & ( ( 1UL << EV_KEY ) | ( 1UL << EV_REL ) ) ) ) )
+    {	// Neither keys nor mouse (e.g. a joystick or accelerometer)
+        close ( fd );
+        return	-1;
+    }
+    if ( ROUTE_LOCAL == ( rt = route_match ( fd, evbits ) )->host )
+    {	// A routing rule keeps it for the local machine
+        close ( fd );
+        return	-1;
+    }
+    // Event timestamps on the clock of now_ns(), not the wall clock
+    // NTP keeps adjusting
+    clk = CLOCK_MONOTONIC;
+    evdevclock[i] = ( 0 == ioctl ( fd, EVIOCSCLOCKID, &clk ) );
+    if ( ( ( rt->grab < 0 ) ? evdevgrab : rt->grab ) &&
+         ( 0 > ioctl ( fd, EVIOCGRAB, 1 ) ) )
+    {
+        fprintf ( stderr, "Failed to grab %s: %s\n", buf,
+            strerror ( errno ) );
+    }
+    if ( evt_addto ( inputepoll, fd, EVTAG(EVTAG_EVDEV,i),
+        inputon ? EPOLLIN : 0 ) )
+    {
+        close ( fd );
+        return	-1;
+    }
+    eventdevs[i] = fd;
+    evdevnode[i] = num;
+    evdevroute[i] = rt;
+    evdevleds[i] = ( 0 != ( evbits & ( 1UL << EV_LED ) ) ) &&
+        ( O_RDWR == ( fcntl ( fd, F_GETFL ) & O_ACCMODE ) );
+    if ( evdevleds[i] ) evdev_leds ( i );
+    hidcore_slot_reset ( evdevroute[i]->core, i );
+    pointer = evdev_abs ( i, fd, evbits );
+    fprintf ( stdout, "Opened %s as %s [counter %d]", buf,
+        pointer ? "absolute pointer" : "event device", i );
+    if ( rt != &defroute ) fprintf ( stdout, ", rule at line %d", rt->line );
+    fprintf ( stdout, "\n" );
+    return	i;
+}
+
+/*
+ *	evdev_remove - Event device slot i is gone, stop polling it
+ */
+void	evdev_remove ( int i )
+{
+    int	n;
+    if ( eventdevs[i] < 0 ) return;
+    // Whatever it holds would stay pressed on the host
+    n = hidcore_slot_release ( evdevroute[i]->core, i, now_ns () );
+    if ( n > 0 )
+    {
+        __atomic_fetch_add ( &stuckkeys, n, __ATOMIC_RELAXED );
+        fprintf ( stdout, "Released %d keys of event device [counter %d]\n",
+            n, i );
+    }
+    epoll_ctl ( inputepoll, EPOLL_CTL_DEL, eventdevs[i], NULL );
+    evdevleds[i] = 0;
+    close ( eventdevs[i] );
+    eventdevs[i] = -1;
+    fprintf ( stdout, "Closed event device [counter %d]\n", i );
+}
+
+/*
+ *	evdev_resync - Take over the key state of event device slot i
+ *	(EVIOCGKEY) after its events got lost, sending what changed. If it
+ *	has no key state to ask for, all its keys are released when release
+ *	is set, else left alone
+ */
+void	evdev_resync ( int i, int release )
+{
+    unsigned char	keys[(KEY_MAX+1+7)/8];
+    int	n;
+    if ( eventdevs[i] < 0 ) return;
+    memset ( keys, 0, sizeof(keys) );
+    if ( ( 0 > ioctl ( eventdevs[i], EVIOCGKEY(sizeof(keys)), keys ) ) &&
+         ( ! release ) )
+    {
+        return;
+    }
+    n = hidcore_slot_sync ( evdevroute[i]->core, i, keys, now_ns () );
+    if ( n > 0 )
+    {
+        __atomic_fetch_add ( &stuckkeys, n, __ATOMIC_RELAXED );
+        fprintf ( stderr, "Event device [counter %d] out of sync, "
+            "%d keys corrected\n", i, n );
+    }
+}
+
+/*
+ *	input_watchdog - Timer expired (every WATCHDOG seconds): a device
+ *	holding a key for HELDAGE or longer may have lost its release, so
+ *	its key state is compared with the device's own
+ */
+void	input_watchdog ( void )
+{
+    uint64_t	expirations;
+    long long	now = now_ns (), held;
+    int	i;
+    if ( 0 > read ( watchdogfd, &expirations, sizeof(expirations) ) ) {;}
+    if ( ! inputon ) return;
+    for ( i = 0; i < MAXEVDEVS; ++i )
     {
-        if ( 1 > fread ( xinlist, 1, 4095, pf ) )
+        if ( eventdevs[i] < 0 ) continue;
+        held = hidcore_slot_held ( evdevroute[i]->core, i );
+        // A stamp ahead of now is off the clock: check it as well
+        if ( held && ( ( now - held >= HELDAGE ) || ( held > now ) ) )
         {
-            printf ( "\tx11-mutable information not available.\n" );
+            evdev_resync ( i, 0 );
         }
-        fclose ( pf );
     }
-    printf ( "List of available input devices:\n");
-    printf ( "num\tVendor/Product, Name, -x compatible (x/-)\n" );
+}
+
+/*
+ *	hotplug_event - EVDEVDIR changed: (try to) use new event devices,
+ *	drop removed ones
+ */
+void	hotplug_event ( void )
+{
+    char	buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event	*ie;
+    int	i, j, n, num;
+    while ( 0 < ( n = read ( hotplugfd, buf, sizeof(buf) ) ) )
+    {
+        for ( i = 0; i < n; i += sizeof(struct inotify_event) + ie->len )
+        {
+            ie = (struct inotify_event *)( buf + i );
+            if ( ( ie->len == 0 ) ||
+                 ( 1 != sscanf ( ie->name, "event%d", &num ) ) ) continue;
+            if ( ie->mask & IN_DELETE )
+            {
+                for ( j = 0; j < MAXEVDEVS; ++j )
+                {
+                    if ( ( eventdevs[j] >= 0 ) && ( evdevnode[j] == num ) )
+                        evdev_remove ( j );
+                }
+            } else {
+                evdev_add ( num );
+            }
+        }
+    }
+}
+
+/*
+ * 	initevents () - opens all event devices present
+ * 	or only the ones specified by evdevmask, if evdevmask != 0,
+ *	and watches EVDEVDIR for devices plugged in/out later on
+ *	(evdevgrab: see evdev_add)
+ * 	returns number of successfully opened event file nodes, or <0 for error
+ */
+int	initevents ( void )
+{
+    int	i, num;
+    DIR	*dir;
+    struct dirent	*de;
+    struct itimerspec	its;
+    for ( i = 0; i < MAXEVDEVS; ++i )
+    {
+        eventdevs[i] = -1;
+    }
+    memset ( &its, 0, sizeof(its) );
+    its.it_value.tv_sec = its.it_interval.tv_sec = WATCHDOG;
+    watchdogfd = timerfd_create ( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+    if ( ( 0 > watchdogfd ) ||
+         evt_addto ( inputepoll, watchdogfd, EVTAG(EVTAG_WATCHDOG,0), EPOLLIN ) ||
+         ( 0 > timerfd_settime ( watchdogfd, 0, &its, NULL ) ) )
+    {
+        fprintf ( stderr, "Failed to set up the key watchdog: %s\n",
+            strerror ( errno ) );
+        return	-1;
+    }
+    // Watch first, so that no device can slip through
+    hotplugfd = inotify_init1 ( IN_NONBLOCK | IN_CLOEXEC );
+    if ( ( 0 > hotplugfd ) ||
+         ( 0 > inotify_add_watch ( hotplugfd, EVDEVDIR,
+           IN_CREATE | IN_ATTRIB | IN_DELETE ) ) ||
+         evt_addto ( inputepoll, hotplugfd, EVTAG(EVTAG_HOTPLUG,0), EPOLLIN ) )
+    {
+        fprintf ( stderr, "Failed to watch %s: %s\n", EVDEVDIR,
+            strerror ( errno ) );
+        return	-1;
+    }
+    if ( NULL == ( dir = opendir ( EVDEVDIR ) ) )
+    {
+        return	-1;
+    }
+    for ( i = 0; NULL != ( de = readdir ( dir ) ); )
+    {
+        if ( ( 1 == sscanf ( de->d_name, "event%d", &num ) ) &&
+             ( 0 <= evdev_add ( num ) ) ) ++i;
+    }
+    closedir ( dir );
+    return	i;
+}
+
+void	closeevents ( void )
+{
+    int	i;
+    if ( hotplugfd >= 0 ) close ( hotplugfd );
+    if ( watchdogfd >= 0 ) close ( watchdogfd );
+    for ( i = 0; i < MAXEVDEVS; ++i )
+    {
+        if ( eventdevs[i] >= 0 )
+        {
+            // Closing also releases an EVIOCGRAB
+            close ( eventdevs[i] );
+        }
+    }
+    return;
+}
+
+void	closefifo ( void )
+{
+    if ( eventdevs[0] >= 0 )
+        close(eventdevs[0]);
+    return;
+}
+
+void	cleanup_stdin ( void )
+{
+    // Cleans everything but the characters after the last ENTER keypress.
+    // This is necessary BECAUSE while reading all keyboard input from the
+    // event devices, those key presses will still stay in the stdin queue.
+    // We do not want to have a backlog of hundreds of characters, possibly
+    // commands and so on.
+    fd_set fds;
+    struct timeval tv;
+    FD_ZERO ( &fds );
+    FD_SET ( 0, &fds );
+    tv.tv_sec  = 0;
+    tv.tv_usec = 0;
+    char buf[8];
+    while ( 0 < select ( 1, &fds, NULL, NULL, &tv ) )
+    {
+        while ( read ( 0, buf, 8 ) ) {;}
+        FD_ZERO ( &fds );
+        FD_SET ( 0, &fds );
+        tv.tv_sec  = 0;
+        tv.tv_usec = 1;
+    }
+    close ( 0 );
+    return;
+}
+
+/*
+ *	evt_add - Register fd with the epoll reactor, tagged with
+ *	EVTAG(type,index) so the main loop knows what became ready
+ *	Return value <0 means failure
+ */
+int	evt_add ( int fd, unsigned int tag, unsigned int events )
+{
+    return	evt_addto ( epollfd, fd, tag, events );
+}
+
+// Dito, but with reactor ep (epollfd or inputepoll)
+int	evt_addto ( int ep, int fd, unsigned int tag, unsigned int events )
+{
+    struct epoll_event	ev;
+    memset ( &ev, 0, sizeof(ev) );
+    ev.events = events;
+    ev.data.u32 = tag;
+    if ( 0 > epoll_ctl ( ep, EPOLL_CTL_ADD, fd, &ev ) )
+    {
+        fprintf ( stderr, "Failed to add fd %d to epoll: %s\n",
+            fd, strerror ( errno ) );
+        return	-1;
+    }
+    return	0;
+}
+
+// Change the events fd (registered with tag) is watched for
+int	evt_mod ( int fd, unsigned int tag, unsigned int events )
+{
+    struct epoll_event	ev;
+    memset ( &ev, 0, sizeof(ev) );
+    ev.events = events;
+    ev.data.u32 = tag;
+    return	epoll_ctl ( epollfd, EPOLL_CTL_MOD, fd, &ev );
+}
+
+void	evt_del ( int fd )
+{
+    // Closing an fd removes it as well, this is for the ones kept open
+    epoll_ctl ( epollfd, EPOLL_CTL_DEL, fd, NULL );
+}
+
+/*
+ *	evt_input - Enable or disable readiness reports for all event
+ *	devices. While no host is connected input is not read at all, so
+ *	an idle hidclient does not wake up for local keystrokes.
+ */
+void	evt_input ( int enable )
+{
+    int	i;
+    struct epoll_event	ev;
+    for ( i = 0; i < MAXEVDEVS; ++i )
+    {
+        if ( eventdevs[i] < 0 ) continue;
+        memset ( &ev, 0, sizeof(ev) );
+        ev.events = enable ? EPOLLIN : 0;
+        ev.data.u32 = EVTAG(EVTAG_EVDEV,i);
+        epoll_ctl ( inputepoll, EPOLL_CTL_MOD, eventdevs[i], &ev );
+    }
+}
+
+/*
+ *	flush_events - Discard whatever input queued up while idle, all
+ *	event devices (and the fifo) are opened non-blocking
+ */
+void	flush_events ( void )
+{
+    int	i;
+    struct input_event	inevents[MAXEVBATCH];
     for ( i = 0; i < MAXEVDEVS; ++i )
     {
+        if ( eventdevs[i] < 0 ) continue;
+        while ( 0 < read ( eventdevs[i], inevents, sizeof(inevents) ) ) {;}
+    }
+}
+
+/*
+ *	list_input_devices - Show a human-readable list of all input devices
+ *	the current user has permissions to read from.
+ *	Add info wether this can be grabbed exclusively (-x), i.e. nobody
+ *	else holds a grab on it right now
+ */
+static int	cmp_int ( const void * a, const void * b )
+{
+    return	( *(const int *)a > *(const int *)b ) -
+        ( *(const int *)a < *(const int *)b );
+}
+
+int	list_input_devices ()
+{
+    int	i, n, fd, num;
+    int	nums[4*MAXEVDEVS];
+    DIR	*dir;
+    struct dirent	*de;
+    char	buf[sizeof(EVDEVNAME)+8];
+    struct input_id device_info;
+    char	namebuf[256];
+    char	grab = 0;
+    printf ( "List of available input devices:\n");
+    unsigned long	evbits;
+    struct route_t	*rt;
+    printf ( "num\tVendor/Product, Name, -x compatible (+/-)%s\n",
+        nroutes ? ", routing rule" : "" );
+    // Same scan as initevents(), node numbers need not be contiguous
+    if ( NULL == ( dir = opendir ( EVDEVDIR ) ) )
+    {
+        fprintf ( stderr, "Failed to read %s: %s\n", EVDEVDIR,
+            strerror ( errno ) );
+        return	-1;
+    }
+    for ( n = 0; ( n < 4*MAXEVDEVS ) && ( NULL != ( de = readdir ( dir ) ) ); )
+    {
+        if ( 1 == sscanf ( de->d_name, "event%d", &num ) ) nums[n++] = num;
+    }
+    closedir ( dir );
+    qsort ( nums, n, sizeof(nums[0]), cmp_int );
+    for ( num = 0; num < n; ++num )
+    {
+        i = nums[num];
         sprintf ( buf, EVDEVNAME, i );
         fd = open ( buf, O_RDONLY );
         if ( fd < 0 )
         {
-            if ( errno == ENOENT ) { i = MAXEVDEVS ; break; }
             if ( errno == EACCES )
             {
                 printf ( "%2d:\t[permission denied]\n", i );
@@ -642,435 +1912,2930 @@ int	list_input_devices ()
             close(fd); continue;
         }
         namebuf[sizeof(namebuf)-4] = 0;
-        x11 = 0;
-        p = xinlist;
-        while ( ( p != NULL ) && ( *p != 0 ) )
-        {
-            if ( NULL == ( q = strchr ( p, 0x0a ) ) ) { break; }
-            *q = 0;
-            if ( strcmp ( p, namebuf + 2 ) == 0 ) { x11 = 1; }
-            *q = 0x0a;
-            while ( (*q > 0) && (*q <= 0x20 ) ) { ++q; }
-            p = q;
-        }
+        grab = ( 0 == ioctl ( fd, EVIOCGRAB, 1 ) );
         printf("%2d\t[%04hx:%04hx.%04hx] '%s' (%s)", i,
             device_info.vendor, device_info.product,
-            device_info.version, namebuf + 2, x11 ? "+" : "-");
+            device_info.version, namebuf + 2, grab ? "+" : "-");
+        evbits = 0;
+        ioctl ( fd, EVIOCGBIT(0,sizeof(evbits)), &evbits );
+        if ( nroutes && ( &defroute != ( rt = route_match ( fd, evbits ) ) ) )
+        {
+            printf ( ", line %d%s", rt->line,
+                ( rt->host == ROUTE_LOCAL ) ? " (local)" : "" );
+        }
+        else if ( nroutes )
+        {
+            printf ( ", none" );
+        }
         printf("\n");
         close ( fd );
     }
-    free ( xinlist );
     return	0;
 }
 
-/*	parse_events - At least one filedescriptor can now be read
+/*	parse_events - Event device slot i can now be read
  *	So retrieve data and parse it, eventually sending out a hid report!
- *	Return value <0 means connection broke and shall be disconnected
+ *	The device is drained with a single read() of up to evbatch
+ *	events, which are then processed in order.
+ *	Return value <0: see process_event
+ */
+int	parse_events ( int i )
+{
+    int	j, k, n;
+    struct input_event	inevents[MAXEVBATCH];
+    if ( 0 > eventdevs[i] ) { return 0; }
+    j = read ( eventdevs[i], inevents, evbatch * sizeof(struct input_event) );
+    if ( j == 0 )
+    {
+        trace_read ( i, 0 );
+        return	0;
+    }
+    if ( -1 == j )
+    {
+        if ( ( errno == EAGAIN ) || ( errno == EINTR ) )
+        {
+            return	0;
+        }
+        if ( debugevents & 0x1 )
+        {
+            fprintf(stderr,"%d|%d(%s) (expected %d bytes). ",eventdevs[i],errno,strerror(errno), (int)sizeof(struct input_event));
+        }
+        // Device is gone (unplugged?) - stop polling it
+        fprintf ( stderr, "Event device [counter %d] failed: %s\n",
+            i, strerror ( errno ) );
+        evdev_remove ( i );
+        return	0;
+    }
+    // exactly 24 on 64bit, (16 on 32bit): sizeof(struct input_event)
+    // Only complete events are used, a trailing fragment is dropped
+    n = j / sizeof(struct input_event);
+    trace_read ( i, j );
+    lat_read ();
+    for ( k = 0; k < n; ++k )
+    {
+        lat_event ( &inevents[k].time, evdevclock[i] );
+        if ( 0 > ( j = process_event ( i, &inevents[k] ) ) )
+        {
+            return	j;
+        }
+    }
+    return	0;
+}
+
+// The core's sink: reports go to the host(s) of the route ctx, see
+// hid_submit_to. Their age counts from stamp, unless it is no recent
+// CLOCK_MONOTONIC time (replayed events, fifo writers without a clock)
+static void hid_sink ( void * ctx, const void * report, int len,
+    long long stamp )
+{
+    struct route_t	*rt = ctx;
+    if ( ! ( rt->reports & ( 1u << ((const unsigned char *)report)[1] ) ) )
+    {	// Not passed by its routing rule
+        return;
+    }
+    stampevent = ( ( stamp <= stampread ) &&
+        ( stamp > stampread - STAMPWINDOW ) ) ? stamp : 0;
+    hid_submit_to ( rt->host, report, len );
+}
+
+/*	process_event - Translate one input_event read from event device
+ *	slot i (see hidcore_event) by the core of its route, eventually
+ *	sending out a hid report!
+ *	Return value -1 means PAUSE: the current host shall be disconnected,
+ *	-99 means the program shall terminate
+ */
+int	process_event ( int i, struct input_event * inevent )
+{
+    int	j;
+    if ( NULL != recmap ) rec_event ( inevent );
+    trace_event ( i, inevent );
+    switch ( j = hidcore_event ( evdevroute[i]->core, i, inevent ) )
+    {
+      case	HIDCORE_NONE:
+        break;
+      case	HIDCORE_PAUSE:
+      case	HIDCORE_QUIT:
+        // Make sure the release is out before main() closes
+        // the connection
+        hid_flush ();
+        return	( j == HIDCORE_QUIT ) ? -99 : -1;
+      case	HIDCORE_BROADCAST:
+        session_broadcast ();
+        break;
+      case	HIDCORE_RESYNC:
+        evdev_resync ( i, 1 );
+        break;
+      default:
+        session_switch ( j - HIDCORE_SELECT(0) );
+        break;
+    }
+    return	0;
+}
+
+//***************** Latency statistics
+// Always on: every report's way from the kernel's event timestamp to
+// the completed send() is measured in stages and counted in log-linear
+// histograms (8 buckets per power of two, i.e. within 12.5%). SIGUSR1
+// prints percentiles and the report rate to stderr.
+
+static long long now_ns ( void )
+{
+    struct timespec	ts;
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+    return	(long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Histogram bucket of ns: exact below 8, then 8 per binary order
+static int lat_bucket ( unsigned long long ns )
+{
+    int	msb;
+    if ( ns < 8 ) return (int)ns;
+    msb = 63 - __builtin_clzll ( ns );
+    if ( msb > LATMAXORDER ) return LATBUCKETS - 1;
+    return	( msb - 2 ) * 8 + (int)( ( ns >> ( msb - 3 ) ) & 7 );
+}
+
+// Lowest ns counted in bucket b
+static unsigned long long lat_bucketbase ( int b )
+{
+    if ( b < 8 ) return b;
+    return	(unsigned long long)( 8 | ( b & 7 ) ) << ( b / 8 - 1 );
+}
+
+static void lat_record ( int stage, long long ns )
+{
+    struct lathist_t	*h = &lathist[stage];
+    unsigned long long	max;
+    if ( ns < 0 ) return; // clock went backwards
+    // Injected reports are built on the radio thread with -t
+    __atomic_fetch_add ( &h->b[lat_bucket ( ns )], 1, __ATOMIC_RELAXED );
+    __atomic_fetch_add ( &h->n, 1, __ATOMIC_RELAXED );
+    max = __atomic_load_n ( &h->max, __ATOMIC_RELAXED );
+    while ( (unsigned long long)ns > max &&
+        ! __atomic_compare_exchange_n ( &h->max, &max, ns, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+        ;
+}
+
+/*
+ *	lat_read - Input has just been read (or generated): remember when,
+ *	for the reports it results in. Events without a kernel timestamp
+ *	(replayed, injected) do not count towards LAT_READ/LAT_TOTAL.
+ */
+void	lat_read ( void )
+{
+    struct timespec	ts;
+    stampread = now_ns ();
+    clock_gettime ( CLOCK_REALTIME, &ts );
+    stampreal = (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    stampevent = 0;
+}
+
+/*
+ *	lat_event - Next input event to be processed has kernel timestamp
+ *	tv: CLOCK_MONOTONIC if monotonic is set (see evdevclock), else
+ *	CLOCK_REALTIME. A CLOCK_REALTIME tv is rewritten to CLOCK_MONOTONIC,
+ *	which is what the core passes on with the reports (see hid_sink)
+ */
+void	lat_event ( struct timeval * tv, int monotonic )
+{
+    long long	d;
+    d = ( monotonic ? stampread : stampreal ) -
+        ( (long long)tv->tv_sec * 1000000000LL + tv->tv_usec * 1000LL );
+    if ( ( d < 0 ) || ( d > STAMPWINDOW ) )
+    {	// Not from the event clock
+        stampevent = 0;
+        return;
+    }
+    lat_record ( LAT_READ, d );
+    stampevent = stampread - d;
+    if ( ! monotonic )
+    {
+        tv->tv_sec  = stampevent / 1000000000LL;
+        tv->tv_usec = stampevent % 1000000000LL / 1000;
+    }
+}
+
+// p-th (0..1) percentile of histogram h in ns
+static unsigned long long lat_percentile ( struct lathist_t * h, double p )
+{
+    unsigned long long	sum = 0, want = (unsigned long long)( p * h->n );
+    int	b;
+    for ( b = 0; b < LATBUCKETS; ++b )
+    {
+        sum += h->b[b];
+        if ( sum > want ) return lat_bucketbase ( b );
+    }
+    return	h->max;
+}
+
+/*
+ *	lat_dump - Print latency percentiles per stage and the report rate
+ *	since the last dump
+ */
+void	lat_dump ( void )
+{
+    static const char	*stagename[LAT_STAGES] =
+        { "event->read", "read->built", "built->sent", "event->sent" };
+    static long long	lastdump = 0;
+    static unsigned long long	lastsent = 0;
+    long long	now = now_ns ();
+    struct link_t	*lk;
+    int	i;
+    fprintf ( stderr, "Latency [us]      count       p50       p99      p999       max\n" );
+    for ( i = 0; i < LAT_STAGES; ++i )
+    {
+        fprintf ( stderr, "%-12s %10llu %9.1f %9.1f %9.1f %9.1f\n",
+            stagename[i], lathist[i].n,
+            lat_percentile ( &lathist[i], 0.5 ) / 1000.0,
+            lat_percentile ( &lathist[i], 0.99 ) / 1000.0,
+            lat_percentile ( &lathist[i], 0.999 ) / 1000.0,
+            lathist[i].max / 1000.0 );
+    }
+    if ( lastdump == 0 ) lastdump = statsbase;
+    fprintf ( stderr, "Reports sent: %llu, %.1f/s since last dump\n",
+        reportssent, ( reportssent - lastsent ) * 1e9 /
+        ( now - lastdump > 0 ? now - lastdump : 1 ) );
+    if ( mouseage )
+    {
+        fprintf ( stderr, "Stale mouse reports (-a): %llu\n", stalemoves );
+    }
+    for ( i = 0; i < MAXSESSIONS; ++i )
+    {
+        lk = &sessions[i].link;
+        if ( ( sessions[i].sint < 0 ) || ( lk->samples == 0 ) ) continue;
+        fprintf ( stderr, "Link to host %d: RSSI %d dB, TX power %d dBm, "
+            "quality %d/255, MTU %d/%d, flush %s, now %s, poor %u times\n", i + 1,
+            lk->rssi, lk->txpower, lk->quality, lk->imtu, lk->omtu,
+            ( sessions[i].sched.flushing > 0 ) ? "on" :
+            sessions[i].sched.flushing ? "failed" : "off",
+            lk->poor ? "poor" : "good", lk->poorcount );
+    }
+    if ( stuckkeys )
+    {
+        fprintf ( stderr, "Stuck keys corrected: %llu\n",
+            __atomic_load_n ( &stuckkeys, __ATOMIC_RELAXED ) );
+    }
+    if ( pipefolded || pipelost )
+    {
+        fprintf ( stderr, "Input thread ring full: %llu reports folded, "
+            "%llu messages lost\n",
+            __atomic_load_n ( &pipefolded, __ATOMIC_RELAXED ),
+            __atomic_load_n ( &pipelost, __ATOMIC_RELAXED ) );
+    }
+    lastdump = now;
+    lastsent = reportssent;
+}
+
+//***************** Debug trace
+// With -d, the hot path does not print: it copies a binary record into
+// the ring of its thread (no locks, no system calls, a dropped record
+// if the ring is full), and a background thread decodes the rings to
+// stderr. So debugging does not slow down what is being debugged.
+// debugevents bits: 0x1 input events, 0x4 reads, 0x8 sent reports.
+
+// Give the calling thread a trace ring, before it traces anything
+void	trace_attach ( void )
+{
+    if ( ntracerings < TRACETHREADS )
+    {
+        mytrace = &tracerings[ntracerings];
+        __atomic_store_n ( &ntracerings, ntracerings + 1, __ATOMIC_RELEASE );
+    }
+}
+
+// Next free record of this thread's ring, NULL if none
+static struct tracerec_t * trace_next ( void )
+{
+    struct tracering_t	*tr = mytrace;
+    if ( NULL == tr ) return NULL;
+    if ( tr->head - __atomic_load_n ( &tr->tail, __ATOMIC_ACQUIRE ) >= TRACERING )
+    {
+        ++tr->lost;
+        return	NULL;
+    }
+    return	&tr->rec[tr->head % TRACERING];
+}
+
+// Publish the record from trace_next()
+static void trace_commit ( struct tracerec_t * r, int kind, int slot )
+{
+    r->ns = now_ns ();
+    r->kind = kind;
+    r->slot = slot;
+    __atomic_store_n ( &mytrace->head, mytrace->head + 1, __ATOMIC_RELEASE );
+}
+
+void	trace_event ( int slot, const struct input_event * ie )
+{
+    struct tracerec_t	*r;
+    if ( ! ( debugevents & 0x1 ) || ( NULL == ( r = trace_next () ) ) ) return;
+    r->type  = ie->type;
+    r->code  = ie->code;
+    r->value = ie->value;
+    trace_commit ( r, TR_EVENT, slot );
+}
+
+void	trace_read ( int slot, int bytes )
+{
+    struct tracerec_t	*r;
+    if ( ! ( debugevents & 0x4 ) || ( NULL == ( r = trace_next () ) ) ) return;
+    r->value = bytes;
+    trace_commit ( r, TR_READ, slot );
+}
+
+void	trace_report ( int session, const void * data, int len )
+{
+    struct tracerec_t	*r;
+    if ( ! ( debugevents & 0x8 ) || ( NULL == ( r = trace_next () ) ) ) return;
+    if ( len > (int)sizeof(r->data) ) len = sizeof(r->data);
+    memcpy ( r->data, data, len );
+    r->len = len;
+    trace_commit ( r, TR_REPORT, session );
+}
+
+// Print one record
+static void trace_decode ( struct tracerec_t * r )
+{
+    int	k;
+    fprintf ( stderr, "%lld.%06lld ", r->ns / 1000000000LL,
+        ( r->ns % 1000000000LL ) / 1000 );
+    switch ( r->kind )
+    {
+      case	TR_EVENT:
+        fprintf ( stderr, "dev %d EVENT{%04X %04X %08X}\n", r->slot,
+            r->type, r->code, r->value );
+        break;
+      case	TR_READ:
+        fprintf ( stderr, "dev %d read(%d)\n", r->slot, r->value );
+        break;
+      case	TR_REPORT:
+        fprintf ( stderr, "host %d report", r->slot + 1 );
+        for ( k = 0; k < r->len; ++k )
+        {
+            fprintf ( stderr, " %02x", r->data[k] );
+        }
+        fprintf ( stderr, "\n" );
+        break;
+    }
+}
+
+// Decode everything traced so far, returns number of records
+static int trace_drain ( void )
+{
+    struct tracering_t	*tr;
+    unsigned int	head, lost;
+    int	i, n = 0;
+    for ( i = 0; i < __atomic_load_n ( &ntracerings, __ATOMIC_ACQUIRE ); ++i )
+    {
+        tr = &tracerings[i];
+        head = __atomic_load_n ( &tr->head, __ATOMIC_ACQUIRE );
+        for ( ; tr->tail != head; ++n )
+        {
+            trace_decode ( &tr->rec[tr->tail % TRACERING] );
+            __atomic_store_n ( &tr->tail, tr->tail + 1, __ATOMIC_RELEASE );
+        }
+        if ( 0 != ( lost = __atomic_exchange_n ( &tr->lost, 0, __ATOMIC_RELAXED ) ) )
+        {
+            fprintf ( stderr, "[%u trace records lost]\n", lost );
+        }
+    }
+    return	n;
+}
+
+static void * trace_writer ( void * arg )
+{
+    struct timespec	ts = { 0, 1000000 }; // 1 ms
+    while ( ! __atomic_load_n ( &tracestop, __ATOMIC_ACQUIRE ) )
+    {
+        if ( 0 == trace_drain () ) nanosleep ( &ts, NULL );
+    }
+    trace_drain ();
+    return	NULL;
+}
+
+/*
+ *	trace_start - Start the trace writer thread if debugging is on.
+ *	Call with all signals blocked that the main thread waits for.
+ *	Return value: 0 = OK, <0 = failure
+ */
+int	trace_start ( void )
+{
+    if ( 0 == debugevents ) return 0;
+    trace_attach ();
+    if ( 0 != pthread_create ( &tracethread, NULL, trace_writer, NULL ) )
+    {
+        fprintf ( stderr, "Failed to start trace writer\n" );
+        return	-1;
+    }
+    return	0;
+}
+
+void	trace_stop ( void )
+{
+    if ( 0 == debugevents ) return;
+    __atomic_store_n ( &tracestop, 1, __ATOMIC_RELEASE );
+    pthread_join ( tracethread, NULL );
+}
+
+//***************** Report scheduler
+// Every report goes through sched_submit(). Unless a maximum report
+// rate is set (-r), reports go out immediately. Otherwise they wait for
+// their slot; superseded mouse reports are merged meanwhile, keyboard
+// reports are always kept. No report is held back longer than the
+// latency bound (-L), then everything pending is flushed.
+// The interrupt socket is non-blocking: if the link cannot take more,
+// reports stay queued until EPOLLOUT. Should the queue fill up, it is
+// collapsed into the current state (see sched_collapse).
+
+// Arm the scheduler timer for CLOCK_MONOTONIC ns "due", or disarm (0)
+static void sched_arm ( struct outsched_t * sc, long long due )
+{
+    struct itimerspec	its;
+    memset ( &its, 0, sizeof(its) );
+    its.it_value.tv_sec  = due / 1000000000LL;
+    its.it_value.tv_nsec = due % 1000000000LL;
+    timerfd_settime ( sc->timerfd, TFD_TIMER_ABSTIME, &its, NULL );
+}
+
+/*
+ *	report_encode - Turn report data/len, as generated and queued, into
+ *	what the host of sc negotiated: boot protocol reports (keyboard and
+ *	mouse only), bitmap keyboard reports with -n, wheels in
+ *	notches unless it set their Resolution Multiplier, else unchanged.
+ *	Returns the length in out, 0 if there is nothing to send
+ */
+int	report_encode ( struct outsched_t * sc, const unsigned char * data, int len,
+    unsigned char * out )
+{
+    int	boot = sc->boot;
+    int	axes[MOUSE_AXES];
+    const struct hidrep_keyb_t	*kb = (const void *)data;
+    const struct hidrep_nkro_t	*in = (const void *)data;
+    struct hidrep_nkro_t	*nk = (void *)out;
+    struct hidrep_bootkeyb_t	*bk = (void *)out;
+    struct hidrep_bootmouse_t	*bm = (void *)out;
+    int	k, j = 0;
+    if ( boot && ( data[1] == REPORTID_KEYBD ) && ( len == sizeof(*in) ) )
+    {	// Boot protocol host, but bitmap generated (-n): list the keys
+        bk->btcode = 0xA1;
+        bk->modify = in->modify;
+        bk->reserved = 0;
+        memset ( bk->key, 0, BOOT_SLOTS );
+        for ( k = USAGE_ROLLOVER + 1; k < NKRO_BYTES * 8; ++k )
+        {
+            if ( ! ( in->bits[k >> 3] & ( 1 << ( k & 7 ) ) ) ) continue;
+            if ( j == BOOT_SLOTS )
+            {
+                memset ( bk->key, USAGE_ROLLOVER, BOOT_SLOTS );
+                break;
+            }
+            bk->key[j++] = k;
+        }
+        return	sizeof(*bk);
+    }
+    if ( ( data[1] == REPORTID_KEYBD ) && ( len == sizeof(*kb) ) )
+    {
+        if ( boot )
+        {
+            bk->btcode = 0xA1;
+            bk->modify = kb->modify;
+            bk->reserved = 0;
+            if ( kb->key[BOOT_SLOTS] )
+            {	// More keys than fit: report the phantom state
+                memset ( bk->key, USAGE_ROLLOVER, BOOT_SLOTS );
+            } else {
+                memcpy ( bk->key, kb->key, BOOT_SLOTS );
+            }
+            return	sizeof(*bk);
+        }
+        if ( nkro )
+        {
+            memset ( nk, 0, sizeof(*nk) );
+            nk->btcode = 0xA1;
+            nk->rep_id = REPORTID_KEYBD;
+            nk->modify = kb->modify;
+            for ( k = 0; k < KEYB_SLOTS; ++k )
+            {
+                if ( kb->key[k] > USAGE_ROLLOVER )
+                    nk->bits[kb->key[k] >> 3] |= 1 << ( kb->key[k] & 7 );
+            }
+            return	sizeof(*nk);
+        }
+    }
+    if ( ( data[1] == REPORTID_MOUSE ) && ( len == sizeof(struct hidrep_mouse_t) ) )
+    {
+        hidcore_mouse_get ( data, axes );
+        if ( boot )
+        {	// 8 bit motion, no wheel (see sched_mouse_put)
+            bm->btcode = 0xA1;
+            bm->button = data[2];
+            bm->axis_x = axes[0] > 127 ? 127 : ( axes[0] < -127 ? -127 : axes[0] );
+            bm->axis_y = axes[1] > 127 ? 127 : ( axes[1] < -127 ? -127 : axes[1] );
+            return	sizeof(*bm);
+        }
+        for ( k = 0; k < 2; ++k )
+        {	// Multiplier 1: whole notches, the rest is kept for later
+            if ( sc->wheelres & ( k ? MULT_PAN : MULT_WHEEL ) ) continue;
+            sc->wheelrest[k] += axes[2+k];
+            axes[2+k] = sc->wheelrest[k] / WHEEL_UNIT;
+            sc->wheelrest[k] -= axes[2+k] * WHEEL_UNIT;
+        }
+        memcpy ( out, data, 3 );
+        hidcore_mouse_put ( out, axes );
+        return	len;
+    }
+    if ( boot && ( data[1] != REPORTID_KEYBD ) ) return 0;
+    memcpy ( out, data, len );
+    return	len;
+}
+
+/*
+ *	sched_send - Hand one report to the interrupt socket
+ *	Return value: 0 = sent, 1 = link congested (report not sent, wait
+ *	for EPOLLOUT), <0 = connection broke
+ */
+static int sched_send ( struct outsched_t * sc, const void * data, int len,
+    long long queued, long long origin )
+{
+    unsigned char	wire[MAXREPORT];
+    int	wheelrest[2];
+    memcpy ( wheelrest, sc->wheelrest, sizeof(wheelrest) );
+    if ( 0 == ( len = report_encode ( sc, data, len, wire ) ) ) return 0;
+    if ( sc->flushing > 0 )
+    {	// Only motion may be lost, the next report makes up for it
+        link_flushable ( sc, ( ((const unsigned char *)data)[1] ==
+            REPORTID_MOUSE ) && ( ((const unsigned char *)data)[2] ==
+            sc->sentbuttons ) );
+    }
+    if ( 0 < send ( sc->sockdesc, wire, len, MSG_NOSIGNAL ) )
+    {
+        sc->lastsend = now_ns ();
+        if ( ((const unsigned char *)data)[1] == REPORTID_MOUSE )
+        {
+            sc->sentbuttons = ((const unsigned char *)data)[2];
+        }
+        lat_record ( LAT_SEND, sc->lastsend - queued );
+        if ( origin ) lat_record ( LAT_TOTAL, sc->lastsend - origin );
+        ++reportssent;
+        trace_report ( EVTAG_INDEX(sc->inttag), wire, len );
+        return	0;
+    }
+    // Encoded again when it is retried
+    memcpy ( sc->wheelrest, wheelrest, sizeof(wheelrest) );
+    if ( ( errno == EAGAIN ) || ( errno == EWOULDBLOCK ) ||
+         ( errno == ENOBUFS ) || ( errno == EINTR ) )
+    {
+        if ( ! sc->blocked ) sc->blockedsince = now_ns ();
+        sc->blocked = 1;
+        evt_mod ( sc->sockdesc, sc->inttag,
+            EPOLLIN | EPOLLRDHUP | EPOLLOUT );
+        return	1;
+    }
+    return	-1;
+}
+
+// hidcore_mouse_put() for the host of sc: boot protocol takes 8 bit
+// motion and no wheels
+static int sched_mouse_put ( struct outsched_t * sc, unsigned char * data,
+    int * rest )
+{
+    int	k, keep[2];
+    if ( ! sc->boot ) return hidcore_mouse_put ( data, rest );
+    rest[2] = rest[3] = 0;
+    for ( k = 0; k < 2; ++k )
+    {
+        keep[k] = rest[k];
+        if ( rest[k] > 127 )  rest[k] = 127;
+        if ( rest[k] < -127 ) rest[k] = -127;
+        keep[k] -= rest[k];
+    }
+    hidcore_mouse_put ( data, rest );
+    rest[0] = keep[0];
+    rest[1] = keep[1];
+    return	( keep[0] || keep[1] );
+}
+
+/*
+ *	sched_collapse - The queue is full because the link does not keep
+ *	up: replace its content by the state it leads to, i.e. the latest
+ *	report of each other report ID (keyboard, absolute pointer) and the
+ *	summed mouse motion with the latest buttons
+ */
+static void sched_collapse ( struct outsched_t * sc )
+{
+    struct outrep_t	other[MAXOUTQ], mouse, *r;
+    int	k, n, nother = 0, rest[MOUSE_AXES], axes[MOUSE_AXES];
+    mouse.len = 0;
+    memset ( rest, 0, sizeof(rest) );
+    for ( k = 0; k < sc->count; ++k )
+    {
+        r = &sc->q[(sc->head + k) % MAXOUTQ];
+        if ( r->data[1] == REPORTID_MOUSE )
+        {
+            if ( mouse.len == 0 ) mouse = *r;
+            hidcore_mouse_get ( r->data, axes );
+            for ( n = 0; n < MOUSE_AXES; ++n )
+            {
+                rest[n] += axes[n];
+            }
+            mouse.data[2] = r->data[2];
+            continue;
+        }
+        for ( n = 0; ( n < nother ) && ( other[n].data[1] != r->data[1] ); ++n ) {;}
+        if ( n == nother )
+        {
+            other[n].queued = r->queued;
+            other[n].origin = r->origin;
+            ++nother;
+        }
+        memcpy ( other[n].data, r->data, r->len );
+        other[n].len = r->len;
+    }
+    sc->head = sc->count = 0;
+    for ( n = 0; n < nother; ++n )
+    {
+        sc->q[sc->count++] = other[n];
+    }
+    while ( mouse.len > 0 )
+    {
+        // Motion beyond one report's range needs some more of them
+        k = sched_mouse_put ( sc, mouse.data, rest );
+        sc->q[sc->count++] = mouse;
+        if ( ( 0 == k ) || ( sc->count >= MAXOUTQ / 2 ) )
+        {
+            break;
+        }
+    }
+    for ( n = 0; n < MOUSE_AXES; ++n )
+    {	// Whatever did not fit is sent once the queue drains
+        sc->owed[n] += rest[n];
+    }
+    if ( debugevents & 0x2 )
+        fprintf ( stderr, "Link congested, report queue collapsed\n" );
+}
+
+// Queue the motion owed by sched_collapse(), as far as there is room
+static void sched_owed ( struct outsched_t * sc )
+{
+    struct outrep_t	*r;
+    while ( ( sc->owed[0] | sc->owed[1] | sc->owed[2] | sc->owed[3] ) &&
+            ( sc->count < MAXOUTQ / 2 ) )
+    {
+        r = &sc->q[(sc->head + sc->count++) % MAXOUTQ];
+        r->queued = now_ns ();
+        r->origin = 0;
+        r->len = sizeof(struct hidrep_mouse_t);
+        r->data[0] = 0xA1;
+        r->data[1] = REPORTID_MOUSE;
+        r->data[2] = sc->buttons; // not to press released ones again
+        sched_mouse_put ( sc, r->data, sc->owed );
+    }
+}
+
+/*
+ *	sched_stale - With -a, a mouse report whose input event is older
+ *	than mouseage by now has its motion dropped: the host would only
+ *	see the pointer jump late. Button changes are still sent.
+ *	Returns 1 if nothing of r is left to send
+ */
+static int sched_stale ( struct outsched_t * sc, struct outrep_t * r,
+    long long now )
+{
+    int	k, moved = 0;
+    if ( ( 0 == mouseage ) || ( r->data[1] != REPORTID_MOUSE ) ||
+         ( 0 == r->origin ) || ( now - r->origin < mouseage ) )
+    {
+        return	0;
+    }
+    for ( k = 3; k < r->len; ++k )
+    {
+        moved |= r->data[k];
+        r->data[k] = 0;
+    }
+    if ( moved ) ++stalemoves;
+    return	( r->data[2] == sc->sentbuttons );
+}
+
+/*
+ *	sched_open - Start scheduling reports to interrupt socket sockdesc
+ *	of session number idx. Return value <0 means failure
+ */
+int	sched_open ( struct outsched_t * sc, int sockdesc, int idx )
+{
+    sc->timerfd = timerfd_create ( CLOCK_MONOTONIC,
+        TFD_NONBLOCK | TFD_CLOEXEC );
+    if ( ( 0 > sc->timerfd ) ||
+         evt_add ( sc->timerfd, EVTAG(EVTAG_SCHED,idx), EPOLLIN ) )
+    {
+        fprintf ( stderr, "Failed to set up report timer: %s\n",
+            strerror ( errno ) );
+        if ( sc->timerfd >= 0 ) close ( sc->timerfd );
+        sc->timerfd = -1;
+        return	-1;
+    }
+    sc->sockdesc = sockdesc;
+    sc->inttag = EVTAG(EVTAG_INT,idx);
+    sc->interval = schedinterval;
+    sc->latency = schedlatency;
+    sc->head = sc->count = 0;
+    sc->lastsend = 0;
+    sc->blocked = 0;
+    sc->flushing = sc->flushable = 0;
+    sc->boot = 0;
+    sc->buttons = sc->sentbuttons = 0;
+    memset ( sc->owed, 0, sizeof(sc->owed) );
+    memset ( sc->wheelrest, 0, sizeof(sc->wheelrest) );
+    return	0;
+}
+
+// Forget pending reports, the connection is gone
+void	sched_close ( struct outsched_t * sc )
+{
+    sc->sockdesc = -1;
+    sc->head = sc->count = 0;
+    sc->blocked = 0;
+    memset ( sc->owed, 0, sizeof(sc->owed) );
+    if ( sc->timerfd >= 0 ) close ( sc->timerfd );
+    sc->timerfd = -1;
+}
+
+/*
+ *	sched_submit - Send or queue one report (btcode, rep_id, payload)
+ *	Return value <0 means connection broke and shall be disconnected
+ */
+int	sched_submit ( struct outsched_t * sc, const void * data, int len )
+{
+    struct outrep_t	*r;
+    const signed char	*m = data;
+    unsigned char	clip[MAXREPORT];
+    int	j, k, sum[MOUSE_AXES], add[MOUSE_AXES];
+    long long	now = now_ns ();
+    if ( sc->sockdesc < 0 ) return -1;
+    if ( m[1] == REPORTID_MOUSE ) sc->buttons = m[2];
+    if ( sc->boot && ( m[1] == REPORTID_MOUSE ) &&
+         ( len == sizeof(struct hidrep_mouse_t) ) )
+    {	// 8 bit boot motion: what does not fit follows as owed motion
+        memcpy ( clip, data, len );
+        hidcore_mouse_get ( clip, add );
+        if ( sched_mouse_put ( sc, clip, add ) )
+        {
+            sc->owed[0] += add[0];
+            sc->owed[1] += add[1];
+            m = data = clip;
+        }
+    }
+    if ( ( sc->count == 0 ) && ( ! sc->blocked ) &&
+         ( ( sc->interval == 0 ) ||
+           ( now >= sc->lastsend + sc->interval ) ) )
+    {
+        if ( 0 >= ( j = sched_send ( sc, data, len, now, stampevent ) ) )
+        {
+            if ( ( j == 0 ) && ( sc->owed[0] | sc->owed[1] ) )
+            {	// Queue the rest, sent as the interval permits
+                return	sched_run ( sc );
+            }
+            return	j;
+        }
+        // Link congested - queue it after all
+    }
+    if ( sc->count > 0 )
+    {
+        // A mouse report supersedes a queued one with the same buttons,
+        // as long as the summed motion still fits
+        r = &sc->q[(sc->head + sc->count - 1) % MAXOUTQ];
+        if ( ( m[1] == REPORTID_MOUSE ) && ( r->data[1] == REPORTID_MOUSE )
+             && ( r->len == len ) && ( r->data[2] == m[2] ) )
+        {
+            hidcore_mouse_get ( r->data, sum );
+            hidcore_mouse_get ( m, add );
+            for ( k = 0; k < MOUSE_AXES; ++k )
+            {
+                sum[k] += add[k];
+                if ( abs ( sum[k] ) > ( sc->boot ? 127 : MOUSE_MAX ) ) break;
+            }
+            if ( k == MOUSE_AXES )
+            {
+                hidcore_mouse_put ( r->data, sum );
+                // With -a, fresh motion keeps the merged report fresh
+                if ( mouseage ) r->origin = stampevent;
+                return	0;
+            }
+        }
+        // An absolute position simply replaces the queued one
+        if ( ( m[1] == REPORTID_ABS ) && ( r->data[1] == REPORTID_ABS )
+             && ( r->len == len ) && ( r->data[2] == m[2] ) )
+        {
+            memcpy ( r->data, data, len );
+            r->origin = stampevent;
+            return	0;
+        }
+    }
+    if ( sc->count == MAXOUTQ )
+    {	// Back-pressure: keep the state, not the history
+        sched_collapse ( sc );
+    }
+    r = &sc->q[(sc->head + sc->count) % MAXOUTQ];
+    r->queued = now;
+    r->origin = stampevent;
+    r->len = len;
+    memcpy ( r->data, data, len );
+    if ( ( ++sc->count == 1 ) && ( ! sc->blocked ) )
+    {
+        return	sched_run ( sc );
+    }
+    return	0;
+}
+
+/*
+ *	sched_run - Send whatever is due now, and rearm the timer for the
+ *	rest. Called on timer expiry. Return value <0: connection broke
+ */
+int	sched_run ( struct outsched_t * sc )
+{
+    struct outrep_t	*r;
+    long long	now = now_ns ();
+    long long	due;
+    uint64_t	expirations;
+    int	j;
+    if ( 0 > read ( sc->timerfd, &expirations, sizeof(expirations) ) )
+    {
+        ; // Not expired, called directly - fine
+    }
+    sched_owed ( sc );
+    while ( ( sc->count > 0 ) && ( ! sc->blocked ) )
+    {
+        r = &sc->q[sc->head];
+        if ( now >= r->queued + sc->latency )
+        {	// Latency bound reached: flush everything pending
+            return	sched_flush ( sc );
+        }
+        if ( now < sc->lastsend + sc->interval ) break;
+        if ( sched_stale ( sc, r, now ) )
+        {
+            j = 0;
+        }
+        else if ( 0 > ( j = sched_send ( sc, r->data, r->len, r->queued, r->origin ) ) ) return -1;
+        if ( j > 0 ) break;
+        sc->head = ( sc->head + 1 ) % MAXOUTQ;
+        --sc->count;
+        now = sc->lastsend;
+        sched_owed ( sc );
+    }
+    if ( ( sc->count > 0 ) && ( ! sc->blocked ) )
+    {
+        due = sc->lastsend + sc->interval;
+        if ( due > sc->q[sc->head].queued + sc->latency )
+        {
+            due = sc->q[sc->head].queued + sc->latency;
+        }
+        sched_arm ( sc, due );
+    }
+    else
+    {	// Nothing pending, or waiting for EPOLLOUT
+        sched_arm ( sc, 0 );
+    }
+    return	0;
+}
+
+/*
+ *	sched_flush - Send all pending reports right now, as far as the
+ *	link takes them. Return value <0 means connection broke
+ */
+int	sched_flush ( struct outsched_t * sc )
+{
+    struct outrep_t	*r;
+    long long	now = now_ns ();
+    int	j;
+    sched_owed ( sc );
+    while ( ( sc->count > 0 ) && ( ! sc->blocked ) )
+    {
+        r = &sc->q[sc->head];
+        if ( sched_stale ( sc, r, now ) )
+        {
+            j = 0;
+        }
+        else if ( 0 > ( j = sched_send ( sc, r->data, r->len, r->queued, r->origin ) ) ) return -1;
+        if ( j > 0 ) break;
+        sc->head = ( sc->head + 1 ) % MAXOUTQ;
+        --sc->count;
+        sched_owed ( sc );
+    }
+    sched_arm ( sc, 0 );
+    return	0;
+}
+
+/*
+ *	sched_writable - The interrupt socket reported EPOLLOUT: the link
+ *	takes reports again. Return value <0 means connection broke
+ */
+int	sched_writable ( struct outsched_t * sc )
+{
+    if ( ( sc->count > 1 ) && ( now_ns () - sc->blockedsince >= LINKSTALL ) )
+    {	// What was typed meanwhile has been auto-repeated by the host
+        // already: releases go first, rather than after the history
+        sched_collapse ( sc );
+    }
+    sc->blocked = 0;
+    evt_mod ( sc->sockdesc, sc->inttag, EPOLLIN | EPOLLRDHUP );
+    return	sched_run ( sc );
+}
+
+#ifndef HIDCLIENT_NO_MAIN	// only main() accepts connections
+/*
+ *	sc_accept - Accept a connection on listening socket sock, which
+ *	the reactor reported readable. Return value: new socket or -1,
+ *	the remote address is stored to bdaddr
+ */
+static int sc_accept(int sock, bdaddr_t *bdaddr)
+{
+    int client;
+
+    client = accept(sock, NULL, NULL);
+    if ( client < 0 )
+    {
+        return -1;
+    }
+    return ( sc_adopt ( client, bdaddr ) ) ? -1 : client;
+}
+#endif // HIDCLIENT_NO_MAIN
+
+/*
+ *	sc_adopt - Prepare an incoming L2CAP channel fd, accepted by us
+ *	or by BlueZ (DBUS_NEWCONN). Stores the remote address to bdaddr
+ *	Return value: 0 = OK, <0 = failure, fd has been closed
+ */
+static int sc_adopt(int fd, bdaddr_t *bdaddr)
+{
+    struct sockaddr_l2	l2a;
+    socklen_t alen=sizeof(l2a);
+    char badr[40];
+
+    memset ( &l2a, 0, sizeof(l2a) );
+    if ( 0 > getpeername ( fd, (struct sockaddr *)&l2a, &alen ) )
+    {
+        fprintf ( stderr, "Incoming connection without peer: %s\n",
+            strerror ( errno ) );
+        close ( fd );
+        return -1;
+    }
+    // Reports are queued by the scheduler, never block on the link
+    fcntl ( fd, F_SETFL, fcntl ( fd, F_GETFL ) | O_NONBLOCK );
+    link_sockopts ( fd, btohs ( l2a.l2_psm ), 1 );
+    bacpy ( bdaddr, &l2a.l2_bdaddr );
+    ba2str ( &l2a.l2_bdaddr, badr );
+    badr[39] = 0;
+    fprintf ( stdout, "Incoming connection from node [%s] "
+            "accepted and established.\n", badr );
+    return 0;
+}
+
+//***************** Host sessions
+// Every host needs its own control and interrupt channel. A session
+// starts with the control channel; the session is connected once the
+// same host has opened its interrupt channel as well.
+
+// Is session s fully connected?
+static int session_up ( int s )
+{
+    return	( sessions[s].sint >= 0 ) && ( ! sessions[s].dead );
+}
+
+// Do the hosts getting input queue up reports faster than they are sent?
+int	hid_busy ( void )
+{
+    int	s;
+    if ( oninput )
+    {	// Radio thread lags behind
+        return	pipepending || ( ( pipering.head - __atomic_load_n (
+            &pipering.tail, __ATOMIC_ACQUIRE ) ) >= PIPERING / 2 );
+    }
+    for ( s = 0; s < MAXSESSIONS; ++s )
+    {
+        if ( ! session_up ( s ) ) continue;
+        if ( ( ! broadcast ) && ( s != activesession ) ) continue;
+        if ( sessions[s].sched.count >= MAXOUTQ / 2 ) return 1;
+    }
+    return	0;
+}
+
+/*
+ *	hid_submit - Send a report to the active host, or to all hosts in
+ *	broadcast mode. A host whose link broke is closed later on.
+ */
+void	hid_submit ( const void * data, int len )
+{
+    hid_submit_to ( ROUTE_ACTIVE, data, len );
+}
+
+// Dito, to session host only (a routing rule's host=), or ROUTE_ACTIVE
+void	hid_submit_to ( int host, const void * data, int len )
+{
+    int	s;
+    if ( stampread ) lat_record ( LAT_BUILD, now_ns () - stampread );
+    if ( oninput )
+    {	// Sessions belong to the radio thread
+        pipe_put ( PIPE_REPORT, host, data, len );
+        return;
+    }
+    for ( s = 0; s < MAXSESSIONS; ++s )
+    {
+        if ( ! session_up ( s ) ) continue;
+        if ( ( host >= 0 ) ? ( s != host ) :
+             ( ( ! broadcast ) && ( s != activesession ) ) ) continue;
+        // State for GET_REPORT, even while suspended
+        if ( ((unsigned char *)data)[1] == REPORTID_KEYBD )
+        {
+            memcpy ( sessions[s].lastkeyb, data, len );
+            sessions[s].lastkeyblen = len;
+        }
+        if ( ((unsigned char *)data)[1] == REPORTID_MOUSE )
+        {
+            sessions[s].lastbuttons = ((unsigned char *)data)[2];
+        }
+        if ( ( ((unsigned char *)data)[1] == REPORTID_ABS ) &&
+             ( len == sizeof(struct hidrep_abs_t) ) )
+        {
+            memcpy ( sessions[s].lastabs, data, len );
+        }
+        if ( ( ((unsigned char *)data)[1] == REPORTID_CONSUMER ) &&
+             ( len == sizeof(struct hidrep_consumer_t) ) )
+        {
+            memcpy ( sessions[s].lastcons, data, len );
+        }
+        if ( ( ((unsigned char *)data)[1] == REPORTID_SYSTEM ) &&
+             ( len == sizeof(struct hidrep_system_t) ) )
+        {
+            memcpy ( sessions[s].lastsys, data, len );
+        }
+        if ( sessions[s].suspended ) continue;
+        if ( 0 > sched_submit ( &sessions[s].sched, data, len ) )
+        {
+            sessions[s].dead = 1;
+        }
+    }
+}
+
+// Push out everything queued for the hosts hid_submit() sends to
+void	hid_flush ( void )
+{
+    int	s;
+    if ( oninput )
+    {
+        pipe_put ( PIPE_FLUSH, 0, NULL, 0 );
+        return;
+    }
+    for ( s = 0; s < MAXSESSIONS; ++s )
+    {
+        if ( ! session_up ( s ) ) continue;
+        if ( ( ! broadcast ) && ( s != activesession ) ) continue;
+        if ( 0 > sched_flush ( &sessions[s].sched ) )
+        {
+            sessions[s].dead = 1;
+        }
+    }
+}
+
+// Release all keys and buttons on host s
+static void session_release ( int s )
+{
+    int	k;
+    struct hidrep_keyb_t	evkeyb;
+    struct hidrep_mouse_t	evmouse;
+    memset ( &evkeyb, 0, sizeof(evkeyb) );
+    memset ( &evmouse, 0, sizeof(evmouse) );
+    evkeyb.btcode = evmouse.btcode = 0xA1;
+    evkeyb.rep_id = REPORTID_KEYBD;
+    evmouse.rep_id = REPORTID_MOUSE;
+    if ( ( 0 > sched_submit ( &sessions[s].sched, &evkeyb, sizeof(evkeyb) ) )
+      || ( 0 > sched_submit ( &sessions[s].sched, &evmouse, sizeof(evmouse) ) ) )
+    {
+        sessions[s].dead = 1;
+    }
+    if ( sessions[s].lastabs[2] )
+    {	// Lift a touch or pen where it is
+        sessions[s].lastabs[2] = 0;
+        if ( 0 > sched_submit ( &sessions[s].sched, sessions[s].lastabs,
+            sizeof(struct hidrep_abs_t) ) )
+        {
+            sessions[s].dead = 1;
+        }
+    }
+    // Consumer and system control only if something is held there
+    for ( k = 2; ( k < sizeof(struct hidrep_consumer_t) ) &&
+                 ( 0 == sessions[s].lastcons[k] ); ++k ) {;}
+    if ( k < sizeof(struct hidrep_consumer_t) )
+    {
+        memset ( sessions[s].lastcons + 2, 0, sizeof(struct hidrep_consumer_t) - 2 );
+        if ( 0 > sched_submit ( &sessions[s].sched, sessions[s].lastcons,
+            sizeof(struct hidrep_consumer_t) ) )
+        {
+            sessions[s].dead = 1;
+        }
+    }
+    if ( sessions[s].lastsys[2] )
+    {
+        sessions[s].lastsys[2] = 0;
+        if ( 0 > sched_submit ( &sessions[s].sched, sessions[s].lastsys,
+            sizeof(struct hidrep_system_t) ) )
+        {
+            sessions[s].dead = 1;
+        }
+    }
+}
+
+// Toggle sending input to all hosts at once
+void	session_broadcast ( void )
+{
+    if ( oninput )
+    {
+        pipe_put ( PIPE_BROADCAST, 0, NULL, 0 );
+        return;
+    }
+    broadcast = ! broadcast;
+    fprintf ( stdout, "Broadcast to all hosts %s\n",
+        broadcast ? "on" : "off" );
+}
+
+/*
+ *	session_switch - Make host s the one receiving input. The previous
+ *	host gets an all-keys-up report, its link stays up.
+ */
+void	session_switch ( int s )
+{
+    char	badr[40];
+    if ( oninput )
+    {
+        pipe_put ( PIPE_SWITCH, s, NULL, 0 );
+        return;
+    }
+    if ( ( s < 0 ) || ( s >= MAXSESSIONS ) || ( ! session_up ( s ) ) )
+    {
+        fprintf ( stderr, "No host %d connected\n", s + 1 );
+        return;
+    }
+    if ( s == activesession ) return;
+    if ( ( activesession >= 0 ) && session_up ( activesession ) &&
+         ! broadcast )
+    {
+        session_release ( activesession );
+    }
+    activesession = s;
+    input_leds ( sessions[s].leds );
+    ba2str ( &sessions[s].bdaddr, badr );
+    fprintf ( stdout, "Input now goes to host %d [%s]\n", s + 1, badr );
+}
+
+/*
+ *	session_close - Close control and interrupt channel of session s.
+ *	Without any host left, go back to idle mode.
+ */
+void	session_close ( int s )
+{
+    int	t;
+    struct session_t	*se = &sessions[s];
+    if ( se->sctl < 0 ) return;
+    sched_close ( &se->sched );
+    if ( se->sint >= 0 )
+    {
+        close ( se->sint );
+        fprintf ( stderr, "Connection to host %d closed\n", s + 1 );
+        host_lost ( &se->bdaddr );
+    }
+    close ( se->sctl );
+    se->sint = se->sctl = -1;
+    se->dead = 0;
+    if ( s == activesession )
+    {	// Continue with the next connected host, if any
+        activesession = -1;
+        for ( t = 1; t < MAXSESSIONS; ++t )
+        {
+            if ( session_up ( ( s + t ) % MAXSESSIONS ) )
+            {
+                session_switch ( ( s + t ) % MAXSESSIONS );
+                break;
+            }
+        }
+        if ( activesession < 0 )
+        {
+            input_enable ( 0 );
+        }
+    }
+}
+
+#ifndef HIDCLIENT_NO_MAIN	// called from main() only
+// Close every session whose link broke while sending to it
+static void session_reap ( void )
+{
+    int	s;
+    for ( s = 0; s < MAXSESSIONS; ++s )
+    {
+        if ( sessions[s].dead ) session_close ( s );
+    }
+}
+#endif // HIDCLIENT_NO_MAIN
+
+// Answer a control request of session s with a handshake result code
+static void session_handshake ( int s, int result )
+{
+    unsigned char	hs = ( HIDP_HANDSHAKE << 4 ) | result;
+    send ( sessions[s].sctl, &hs, 1, MSG_NOSIGNAL | MSG_DONTWAIT );
+}
+
+// Host of session s sent its keyboard LED state
+static void session_leds ( int s, unsigned char leds )
+{
+    sessions[s].leds = leds;
+    if ( s == activesession ) input_leds ( leds );
+}
+
+// buf/n (a SET_REPORT or DATA message) is an output report: take the
+// LED state from it. Boot protocol output reports carry no report ID
+static int session_ledreport ( int s, const unsigned char * buf, int n )
+{
+    if ( ( buf[0] & 0x3 ) != HIDP_REP_OUTPUT ) return 0;
+    if ( sessions[s].sched.boot && ( n == 2 ) )
+    {
+        session_leds ( s, buf[1] );
+        return	1;
+    }
+    if ( ( n < 3 ) || ( buf[1] != REPORTID_KEYBD ) ) return 0;
+    session_leds ( s, buf[2] );
+    return	1;
+}
+
+// buf/n (a SET_REPORT message) is the mouse feature report: take the
+// Resolution Multipliers the host wants for the wheels
+static int session_featreport ( int s, const unsigned char * buf, int n )
+{
+    if ( ( ( buf[0] & 0x3 ) != HIDP_REP_FEATURE ) || ( n < 3 ) ||
+         ( buf[1] != REPORTID_MOUSE ) ) return 0;
+    sessions[s].sched.wheelres = buf[2] & ( MULT_WHEEL | MULT_PAN );
+    return	1;
+}
+
+/*
+ *	session_control - The control channel of session s can be read:
+ *	answer the host's request right away (see HIDP_*)
+ */
+void	session_control ( int s )
+{
+    unsigned char	buf[64], rep[MAXREPORT];
+    unsigned char	out[MAXREPORT];
+    int	n, len = 0, size = 0, id, o;
+    n = recv ( sessions[s].sctl, buf, sizeof(buf), MSG_DONTWAIT );
+    if ( ( n < 0 ) && ( ( errno == EAGAIN ) || ( errno == EINTR ) ) ) return;
+    if ( n <= 0 )
+    {
+        sessions[s].dead = 1;
+        return;
+    }
+    switch ( buf[0] >> 4 )
+    {
+      case	HIDP_HID_CONTROL:
+        // No answer expected
+        if ( ( buf[0] & 0xf ) == HIDP_CTRL_SUSPEND )
+        {
+            sessions[s].suspended = 1;
+            fprintf ( stdout, "Host %d suspended\n", s + 1 );
+        }
+        else if ( ( buf[0] & 0xf ) == HIDP_CTRL_EXIT_SUSPEND )
+        {
+            sessions[s].suspended = 0;
+            fprintf ( stdout, "Host %d resumed\n", s + 1 );
+        }
+        else if ( ( buf[0] & 0xf ) == HIDP_CTRL_UNPLUG )
+        {	// Host wants to forget us: do not reconnect either
+            host_hold ( &sessions[s].bdaddr );
+            sessions[s].dead = 1;
+        }
+        return;
+      case	HIDP_GET_REPORT:
+        // Without report IDs (boot protocol), it is the keyboard
+        id = REPORTID_KEYBD;
+        o = 1;
+        if ( ! sessions[s].sched.boot )
+        {
+            if ( n < 2 ) break;
+            id = buf[o++];
+        }
+        if ( ( buf[0] & 0x8 ) && ( n >= o + 2 ) )
+        {	// Host limits the answer's size
+            size = buf[o] | ( buf[o+1] << 8 );
+        }
+        if ( ( ( buf[0] & 0x3 ) == HIDP_REP_INPUT ) && ( id == REPORTID_KEYBD ) )
+        {
+            len = report_encode ( &sessions[s].sched, sessions[s].lastkeyb,
+                sessions[s].lastkeyblen, out );
+        }
+        else if ( ( ( buf[0] & 0x3 ) == HIDP_REP_INPUT ) && ( id == REPORTID_MOUSE ) )
+        {	// Buttons as last sent, no motion
+            memset ( rep, 0, sizeof(struct hidrep_mouse_t) );
+            rep[1] = REPORTID_MOUSE;
+            rep[2] = sessions[s].lastbuttons;
+            len = report_encode ( &sessions[s].sched, rep,
+                sizeof(struct hidrep_mouse_t), out );
+        }
+        else if ( ( ( buf[0] & 0x3 ) == HIDP_REP_INPUT ) && ( id == REPORTID_ABS ) )
+        {
+            memcpy ( out, sessions[s].lastabs, sizeof(struct hidrep_abs_t) );
+            len = sizeof(struct hidrep_abs_t);
+        }
+        else if ( ( ( buf[0] & 0x3 ) == HIDP_REP_INPUT ) && ( id == REPORTID_CONSUMER ) )
+        {
+            memcpy ( out, sessions[s].lastcons, sizeof(struct hidrep_consumer_t) );
+            len = sizeof(struct hidrep_consumer_t);
+        }
+        else if ( ( ( buf[0] & 0x3 ) == HIDP_REP_INPUT ) && ( id == REPORTID_SYSTEM ) )
+        {
+            memcpy ( out, sessions[s].lastsys, sizeof(struct hidrep_system_t) );
+            len = sizeof(struct hidrep_system_t);
+        }
+        else if ( ( ( buf[0] & 0x3 ) == HIDP_REP_FEATURE ) && ( id == REPORTID_MOUSE ) )
+        {
+            out[o-1] = REPORTID_MOUSE;
+            out[o] = sessions[s].sched.wheelres;
+            len = o + 1;
+        }
+        else if ( ( ( buf[0] & 0x3 ) == HIDP_REP_OUTPUT ) && ( id == REPORTID_KEYBD ) )
+        {
+            out[o-1] = REPORTID_KEYBD;
+            out[o] = sessions[s].leds;
+            len = o + 1;
+        }
+        else
+        {
+            session_handshake ( s, HIDP_HS_INVALID_REPORT_ID );
+            return;
+        }
+        out[0] = ( HIDP_DATA << 4 ) | ( buf[0] & 0x3 );
+        if ( ( size > 0 ) && ( len > size + 1 ) ) len = size + 1;
+        send ( sessions[s].sctl, out, len, MSG_NOSIGNAL | MSG_DONTWAIT );
+        return;
+      case	HIDP_SET_REPORT:
+      case	HIDP_DATA:
+        if ( session_ledreport ( s, buf, n ) || session_featreport ( s, buf, n ) )
+        {
+            if ( ( buf[0] >> 4 ) == HIDP_SET_REPORT )
+                session_handshake ( s, HIDP_HS_SUCCESSFUL );
+            return;
+        }
+        if ( ( buf[0] >> 4 ) == HIDP_DATA ) return;
+        session_handshake ( s, HIDP_HS_INVALID_REPORT_ID );
+        return;
+      case	HIDP_GET_PROTOCOL:
+        rep[0] = HIDP_DATA << 4;
+        rep[1] = sessions[s].protocol;
+        send ( sessions[s].sctl, rep, 2, MSG_NOSIGNAL | MSG_DONTWAIT );
+        return;
+      case	HIDP_SET_PROTOCOL:
+        // Queued reports go out in the new format, see report_encode()
+        sessions[s].protocol = buf[0] & 0x1;
+        sessions[s].sched.boot = ! sessions[s].protocol;
+        fprintf ( stdout, "Host %d uses %s protocol\n", s + 1,
+            sessions[s].protocol ? "report" : "boot" );
+        session_handshake ( s, HIDP_HS_SUCCESSFUL );
+        return;
+      case	HIDP_GET_IDLE:
+        rep[0] = HIDP_DATA << 4;
+        rep[1] = sessions[s].idle;
+        send ( sessions[s].sctl, rep, 2, MSG_NOSIGNAL | MSG_DONTWAIT );
+        return;
+      case	HIDP_SET_IDLE:
+        if ( n >= 2 ) sessions[s].idle = buf[1];
+        session_handshake ( s, HIDP_HS_SUCCESSFUL );
+        return;
+      case	HIDP_HANDSHAKE:
+        return;
+    }
+    session_handshake ( s, HIDP_HS_UNSUPPORTED );
+}
+
+/*
+ *	session_data - The interrupt channel of session s can be read: the
+ *	only thing a host sends there is the keyboard LED output report
+ */
+void	session_data ( int s )
+{
+    unsigned char	buf[64];
+    int	n;
+    n = recv ( sessions[s].sint, buf, sizeof(buf), MSG_DONTWAIT );
+    if ( ( n < 0 ) && ( ( errno == EAGAIN ) || ( errno == EINTR ) ) ) return;
+    if ( n <= 0 )
+    {
+        sessions[s].dead = 1;
+        return;
+    }
+    if ( ( buf[0] >> 4 ) == HIDP_DATA ) session_ledreport ( s, buf, n );
+}
+
+/*
+ *	session_accept_ctl - A host opened a control channel (socket fd):
+ *	start a session for it. Returns session number or <0
+ */
+static int session_accept_ctl ( int fd, bdaddr_t * bdaddr )
+{
+    int	s, freeslot = -1;
+    for ( s = 0; s < MAXSESSIONS; ++s )
+    {
+        if ( ( sessions[s].sctl >= 0 ) &&
+             ( 0 == bacmp ( &sessions[s].bdaddr, bdaddr ) ) )
+        {	// Reconnecting host, the old session is stale
+            session_close ( s );
+        }
+        if ( ( sessions[s].sctl < 0 ) && ( freeslot < 0 ) ) freeslot = s;
+    }
+    if ( freeslot < 0 )
+    {
+        fprintf ( stderr, "Already %d hosts connected, rejecting "
+            "control connection\n", MAXSESSIONS );
+        close ( fd );
+        return	-1;
+    }
+    sessions[freeslot].sctl = fd;
+    sessions[freeslot].sint = -1;
+    sessions[freeslot].dead = 0;
+    bacpy ( &sessions[freeslot].bdaddr, bdaddr );
+    sessions[freeslot].suspended = 0;
+    sessions[freeslot].protocol = 1;
+    sessions[freeslot].idle = 0;
+    sessions[freeslot].leds = 0;
+    memset ( sessions[freeslot].lastkeyb, 0, MAXREPORT );
+    sessions[freeslot].lastkeyb[0] = 0xa1;
+    sessions[freeslot].lastkeyb[1] = REPORTID_KEYBD;
+    sessions[freeslot].lastkeyblen = sizeof(struct hidrep_keyb_t);
+    sessions[freeslot].lastbuttons = 0;
+    memset ( sessions[freeslot].lastabs, 0, sizeof(struct hidrep_abs_t) );
+    sessions[freeslot].lastabs[0] = 0xa1;
+    sessions[freeslot].lastabs[1] = REPORTID_ABS;
+    memset ( sessions[freeslot].lastcons, 0, sizeof(struct hidrep_consumer_t) );
+    sessions[freeslot].lastcons[0] = 0xa1;
+    sessions[freeslot].lastcons[1] = REPORTID_CONSUMER;
+    memset ( sessions[freeslot].lastsys, 0, sizeof(struct hidrep_system_t) );
+    sessions[freeslot].lastsys[0] = 0xa1;
+    sessions[freeslot].lastsys[1] = REPORTID_SYSTEM;
+    sessions[freeslot].sched.wheelres = 0;
+    // Control messages: see session_control()
+    evt_add ( fd, EVTAG(EVTAG_CTL,freeslot), EPOLLIN | EPOLLRDHUP );
+    return	freeslot;
+}
+
+/*
+ *	session_accept_int - A host opened its interrupt channel (socket
+ *	fd): its session is up now. Returns session number or <0
+ */
+static int session_accept_int ( int fd, bdaddr_t * bdaddr )
+{
+    int	s;
+    for ( s = 0; s < MAXSESSIONS; ++s )
+    {
+        if ( ( sessions[s].sctl >= 0 ) && ( sessions[s].sint < 0 ) &&
+             ( 0 == bacmp ( &sessions[s].bdaddr, bdaddr ) ) )
+        {
+            break;
+        }
+    }
+    if ( s == MAXSESSIONS )
+    {
+        fprintf ( stderr, "Interrupt connection without "
+            "control connection, rejecting\n" );
+        close ( fd );
+        return	-1;
+    }
+    sessions[s].sint = fd;
+    if ( evt_add ( fd, EVTAG(EVTAG_INT,s), EPOLLIN | EPOLLRDHUP ) ||
+         ( 0 > sched_open ( &sessions[s].sched, fd, s ) ) )
+    {
+        session_close ( s );
+        return	-1;
+    }
+    host_connected ( bdaddr );
+    link_open ( s );
+    if ( activesession < 0 )
+    {
+        // First host: start reading input
+        input_enable ( 1 );
+        session_switch ( s );
+    }
+    else
+    {
+        fprintf ( stdout, "Host %d connected, LCtrl+LAlt+%d switches "
+            "to it\n", s + 1, s + 1 );
+    }
+    return	s;
+}
+
+//***************** Link manager
+// The L2CAP channels are tuned as they are created: an incoming MTU of
+// LINKIMTU, the control channel free to stay in sniff mode (BT_POWER),
+// and nothing flushable (BT_FLUSHABLE). Once a host is connected and
+// the adapter can send non-flushable packets, its ACL link gets an
+// automatic flush timeout of LINKFLUSH ms, and mouse reports carrying
+// nothing but motion are sent flushable: under interference, stale
+// motion is dropped by the controller instead of being retransmitted
+// on and on, while keys and buttons always get through.
+// A raw HCI socket on the reactor samples RSSI, TX power and link
+// quality every LINKPERIOD seconds. A poor link is given a lower report
+// rate (fewer, merged mouse reports) and no sniff mode in its link
+// policy, which it gets back once it is good again. SIGUSR1 prints the
+// figures along with the latency statistics.
+
+/*
+ *	link_sockopts - Tune the L2CAP socket fd of PSM psm; before it is
+ *	connected (connected = 0), its MTU and flush timeout as well. The
+ *	kernel may lack one or the other, that is no reason to fail
+ */
+void	link_sockopts ( int fd, unsigned short psm, int connected )
+{
+    struct l2cap_options	opts;
+    struct bt_power	pwr;
+    socklen_t	len = sizeof(opts);
+    int	flushable = BT_FLUSHABLE_OFF;
+    if ( ( ! connected ) &&
+         ( 0 == getsockopt ( fd, SOL_L2CAP, L2CAP_OPTIONS, &opts, &len ) ) )
+    {
+        opts.imtu = LINKIMTU;
+        if ( psm == PSMHIDINT ) opts.flush_to = LINKFLUSH;
+        if ( 0 > setsockopt ( fd, SOL_L2CAP, L2CAP_OPTIONS, &opts, sizeof(opts) ) )
+        {
+            fprintf ( stderr, "Failed to set L2CAP options (PSM %d): %s\n",
+                psm, strerror ( errno ) );
+        }
+    }
+    // Reports are made flushable one by one, see link_flushable()
+    setsockopt ( fd, SOL_BLUETOOTH, BT_FLUSHABLE, &flushable, sizeof(flushable) );
+    // Input leaves sniff mode at once, control messages can wait
+    memset ( &pwr, 0, sizeof(pwr) );
+    pwr.force_active = ( psm == PSMHIDINT ) ? BT_POWER_FORCE_ACTIVE_ON :
+        BT_POWER_FORCE_ACTIVE_OFF;
+    setsockopt ( fd, SOL_BLUETOOTH, BT_POWER, &pwr, sizeof(pwr) );
+}
+
+/*
+ *	link_flushable - Send the next reports of sc flushable (flush set)
+ *	or not. There is one interrupt channel per host and BT_FLUSHABLE is
+ *	a property of the channel, so it is switched, but only where a run
+ *	of plain motion starts or ends. Should the socket refuse, flushing
+ *	is given up for the connection, and if the channel was left
+ *	flushable, so is the flush timeout: then nothing gets lost
+ */
+static void link_flushable ( struct outsched_t * sc, int flush )
+{
+    int	s = EVTAG_INDEX ( sc->inttag );
+    if ( flush == sc->flushable ) return;
+    if ( 0 == setsockopt ( sc->sockdesc, SOL_BLUETOOTH, BT_FLUSHABLE,
+                           &flush, sizeof(flush) ) )
+    {
+        sc->flushable = flush;
+        return;
+    }
+    fprintf ( stderr, "Failed to make reports to host %d %sflushable: %s\n",
+        s + 1, flush ? "" : "non-", strerror ( errno ) );
+    sc->flushing = -1;
+    if ( sc->flushable ) link_flushto ( s, 0 );
+}
+
+/*
+ *	link_init - Open the link manager's HCI socket and sampling timer.
+ *	Without them (no adapter, no CAP_NET_RAW) the channels are still
+ *	tuned, just not monitored. Return value <0: not monitored
+ */
+int	link_init ( void )
+{
+    struct hci_filter	flt;
+    struct itimerspec	its;
+    if ( 0 > ( hcisock = hci_open_dev ( LINKHCIDEV ) ) )
+    {
+        fprintf ( stderr, "Link monitoring unavailable: %s\n",
+            strerror ( errno ) );
+        return	-1;
+    }
+    // Only the results of commands, ours or anyone's
+    hci_filter_clear ( &flt );
+    hci_filter_set_ptype ( HCI_EVENT_PKT, &flt );
+    hci_filter_set_event ( EVT_CMD_COMPLETE, &flt );
+    memset ( &its, 0, sizeof(its) );
+    its.it_value.tv_sec = its.it_interval.tv_sec = LINKPERIOD;
+    fcntl ( hcisock, F_SETFL, fcntl ( hcisock, F_GETFL ) | O_NONBLOCK );
+    linktimer = timerfd_create ( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+    if ( ( 0 > setsockopt ( hcisock, SOL_HCI, HCI_FILTER, &flt, sizeof(flt) ) ) ||
+         evt_add ( hcisock, EVTAG(EVTAG_HCI,0), EPOLLIN ) ||
+         ( 0 > linktimer ) ||
+         evt_add ( linktimer, EVTAG(EVTAG_LINK,0), EPOLLIN ) ||
+         ( 0 > timerfd_settime ( linktimer, 0, &its, NULL ) ) )
+    {
+        fprintf ( stderr, "Link monitoring unavailable: %s\n",
+            strerror ( errno ) );
+        link_stop ();
+        return	-1;
+    }
+    return	0;
+}
+
+void	link_stop ( void )
+{
+    if ( hcisock >= 0 ) hci_close_dev ( hcisock );
+    if ( linktimer >= 0 ) close ( linktimer );
+    hcisock = linktimer = -1;
+}
+
+// Send HCI command ogf/ocf for connection handle, with nothing else
+static void link_cmd ( uint16_t ogf, uint16_t ocf, int handle )
+{
+    uint16_t	h = htobs ( handle );
+    hci_send_cmd ( hcisock, ogf, ocf, sizeof(h), &h );
+}
+
+// Ask the adapter to flush what session s did not get out in ms
+// (LINKFLUSH), or with ms = 0 never to
+static void link_flushto ( int s, int ms )
+{
+    write_automatic_flush_timeout_cp	cp;
+    // Else everything would be flushable, keys included
+    if ( ( ms > 0 ) && ( hcinoflush <= 0 ) ) return;
+    cp.handle = htobs ( sessions[s].link.handle );
+    cp.timeout = htobs ( ms * 1000 / 625 ); // in slots of 0.625 ms
+    hci_send_cmd ( hcisock, OGF_HOST_CTL, OCF_WRITE_AUTOMATIC_FLUSH_TIMEOUT,
+        sizeof(cp), &cp );
+}
+
+// Set the link policy of session s (HCI_LP_*), if it is known
+static void link_policy ( int s, int policy )
+{
+    write_link_policy_cp	cp;
+    if ( sessions[s].link.policy < 0 ) return;
+    cp.handle = htobs ( sessions[s].link.handle );
+    cp.policy = htobs ( policy );
+    hci_send_cmd ( hcisock, OGF_LINK_POLICY, OCF_WRITE_LINK_POLICY,
+        sizeof(cp), &cp );
+}
+
+// Take a sample of session s: results arrive with link_event()
+static void link_sample ( int s )
+{
+    read_transmit_power_level_cp	cp;
+    link_cmd ( OGF_STATUS_PARAM, OCF_READ_RSSI, sessions[s].link.handle );
+    link_cmd ( OGF_STATUS_PARAM, OCF_READ_LINK_QUALITY, sessions[s].link.handle );
+    cp.handle = htobs ( sessions[s].link.handle );
+    cp.type = 0; // current, not maximum
+    hci_send_cmd ( hcisock, OGF_HOST_CTL, OCF_READ_TRANSMIT_POWER_LEVEL,
+        sizeof(cp), &cp );
+}
+
+/*
+ *	link_open - Session s is up: learn its MTUs and ACL link, set the
+ *	flush timeout and take a first sample
+ */
+void	link_open ( int s )
+{
+    struct link_t	*lk = &sessions[s].link;
+    struct l2cap_options	opts;
+    struct l2cap_conninfo	ci;
+    socklen_t	len = sizeof(opts);
+    memset ( lk, 0, sizeof(*lk) );
+    lk->handle = lk->policy = -1;
+    if ( 0 == getsockopt ( sessions[s].sint, SOL_L2CAP, L2CAP_OPTIONS, &opts, &len ) )
+    {
+        lk->imtu = opts.imtu;
+        lk->omtu = opts.omtu;
+        if ( opts.omtu < MAXREPORT )
+        {
+            fprintf ( stderr, "Host %d takes no more than %d bytes per "
+                "report\n", s + 1, opts.omtu );
+        }
+    }
+    len = sizeof(ci);
+    if ( ( hcisock < 0 ) || ( 0 > getsockopt ( sessions[s].sint, SOL_L2CAP,
+         L2CAP_CONNINFO, &ci, &len ) ) )
+    {
+        return;
+    }
+    lk->handle = ci.hci_handle;
+    if ( hcinoflush == 0 )
+    {	// The adapter is surely up by now. Answered by link_event(),
+        // which sets the flush timeouts then
+        hci_send_cmd ( hcisock, OGF_INFO_PARAM, OCF_READ_LOCAL_FEATURES,
+            0, NULL );
+    }
+    link_flushto ( s, LINKFLUSH );
+    link_cmd ( OGF_LINK_POLICY, OCF_READ_LINK_POLICY, lk->handle );
+    link_sample ( s );
+}
+
+/*
+ *	link_timer - Timer expired (every LINKPERIOD seconds): sample all
+ *	connected hosts' links
+ */
+void	link_timer ( void )
+{
+    uint64_t	expirations;
+    int	s;
+    if ( 0 > read ( linktimer, &expirations, sizeof(expirations) ) ) {;}
+    for ( s = 0; s < MAXSESSIONS; ++s )
+    {
+        if ( session_up ( s ) && ( sessions[s].link.handle >= 0 ) )
+        {
+            link_sample ( s );
+        }
+    }
+}
+
+// The RSSI of session s was read: slow it down if the link became
+// poor, back to normal once it is good again
+static void link_adapt ( int s )
+{
+    struct link_t	*lk = &sessions[s].link;
+    struct outsched_t	*sc = &sessions[s].sched;
+    if ( ( ! lk->poor ) && ( lk->rssi <= LINKPOOR ) )
+    {
+        lk->poor = 1;
+        ++lk->poorcount;
+        if ( sc->interval < 1000000000LL / LINKPOORRATE )
+        {
+            sc->interval = 1000000000LL / LINKPOORRATE;
+        }
+        // Retransmissions need not wait for the next sniff anchor
+        link_policy ( s, lk->policy & ~HCI_LP_SNIFF );
+        fprintf ( stdout, "Link to host %d is poor (RSSI %d dB), slowing "
+            "down\n", s + 1, lk->rssi );
+    }
+    else if ( lk->poor && ( lk->rssi >= LINKGOOD ) )
+    {
+        lk->poor = 0;
+        sc->interval = schedinterval;
+        link_policy ( s, lk->policy );
+        fprintf ( stdout, "Link to host %d is good again (RSSI %d dB)\n",
+            s + 1, lk->rssi );
+    }
+}
+
+/*
+ *	link_event - The HCI socket is readable: take the results of the
+ *	commands above (Command Complete) to the session of their handle
+ */
+void	link_event ( void )
+{
+    unsigned char	buf[HCI_MAX_EVENT_SIZE+1];
+    hci_event_hdr	*hdr = (void *)( buf + 1 );
+    evt_cmd_complete	*cc = (void *)( buf + 1 + HCI_EVENT_HDR_SIZE );
+    void	*rp = buf + 1 + HCI_EVENT_HDR_SIZE + EVT_CMD_COMPLETE_SIZE;
+    int	n, s, handle;
+    while ( 0 < ( n = read ( hcisock, buf, sizeof(buf) ) ) )
+    {
+        n -= 1 + HCI_EVENT_HDR_SIZE + EVT_CMD_COMPLETE_SIZE;
+        if ( ( n < 1 ) || ( buf[0] != HCI_EVENT_PKT ) ||
+             ( hdr->evt != EVT_CMD_COMPLETE ) || ( *(uint8_t *)rp != 0 ) )
+        {	// Not a result, or the command failed
+            continue;
+        }
+        if ( btohs ( cc->opcode ) ==
+             cmd_opcode_pack ( OGF_INFO_PARAM, OCF_READ_LOCAL_FEATURES ) )
+        {
+            if ( n < (int)sizeof(read_local_features_rp) ) continue;
+            hcinoflush = ( ((read_local_features_rp *)rp)->features[6] &
+                LMP_NFLUSH_PKTS ) ? 1 : -1;
+            for ( s = 0; s < MAXSESSIONS; ++s )
+            {
+                if ( session_up ( s ) && ( sessions[s].link.handle >= 0 ) )
+                {
+                    link_flushto ( s, LINKFLUSH );
+                }
+            }
+            continue;
+        }
+        // All the others start with status and connection handle
+        if ( n < (int)sizeof(write_automatic_flush_timeout_rp) ) continue;
+        handle = btohs ( ((write_automatic_flush_timeout_rp *)rp)->handle );
+        for ( s = 0; ( s < MAXSESSIONS ) && ! ( session_up ( s ) &&
+              ( sessions[s].link.handle == handle ) ); ++s ) {;}
+        if ( s == MAXSESSIONS ) continue;
+        switch ( btohs ( cc->opcode ) )
+        {
+          case	cmd_opcode_pack ( OGF_HOST_CTL, OCF_WRITE_AUTOMATIC_FLUSH_TIMEOUT ):
+            // Unless it was the timeout being taken back
+            if ( 0 == sessions[s].sched.flushing ) sessions[s].sched.flushing = 1;
+            break;
+          case	cmd_opcode_pack ( OGF_LINK_POLICY, OCF_READ_LINK_POLICY ):
+            if ( n < (int)sizeof(read_link_policy_rp) ) break;
+            sessions[s].link.policy = btohs ( ((read_link_policy_rp *)rp)->policy );
+            break;
+          case	cmd_opcode_pack ( OGF_STATUS_PARAM, OCF_READ_RSSI ):
+            if ( n < (int)sizeof(read_rssi_rp) ) break;
+            sessions[s].link.rssi = ((read_rssi_rp *)rp)->rssi;
+            ++sessions[s].link.samples;
+            link_adapt ( s );
+            break;
+          case	cmd_opcode_pack ( OGF_STATUS_PARAM, OCF_READ_LINK_QUALITY ):
+            if ( n < (int)sizeof(read_link_quality_rp) ) break;
+            sessions[s].link.quality = ((read_link_quality_rp *)rp)->link_quality;
+            break;
+          case	cmd_opcode_pack ( OGF_HOST_CTL, OCF_READ_TRANSMIT_POWER_LEVEL ):
+            if ( n < (int)sizeof(read_transmit_power_level_rp) ) break;
+            sessions[s].link.txpower = ((read_transmit_power_level_rp *)rp)->level;
+            break;
+        }
+    }
+}
+
+//***************** Report injection
+// With -u<path>, hidclient listens on a SOCK_SEQPACKET unix socket for
+// finished reports from other programs, which are sent to the host(s)
+// getting input just like local input. Each message carries a batch
+// of records, each one length byte followed by the report as sent on
+// the interrupt channel (0xA1, report ID, data). Messages are never
+// answered; a malformed record drops the rest of its message.
+// Injected keyboard reports replace - not merge with - local key state.
+
+/*
+ *	hid_records - Send the n bytes of length-prefixed reports in buf
+ *	Returns number of reports, or <0 if a malformed record stopped it
+ */
+int	hid_records ( const unsigned char * buf, int n )
+{
+    int	j, len, k = 0;
+    for ( j = 0; j < n; j += 1 + len )
+    {
+        len = buf[j];
+        if ( ( j + 1 + len > n ) || ( len < 2 ) || ( buf[j+1] != 0xa1 ) ||
+             ! ( ( ( buf[j+2] == REPORTID_MOUSE ) &&
+                   ( len == sizeof(struct hidrep_mouse_t) ) ) ||
+                 ( ( buf[j+2] == REPORTID_ABS ) &&
+                   ( len == sizeof(struct hidrep_abs_t) ) ) ||
+                 ( ( buf[j+2] == REPORTID_CONSUMER ) &&
+                   ( len == sizeof(struct hidrep_consumer_t) ) ) ||
+                 ( ( buf[j+2] == REPORTID_SYSTEM ) &&
+                   ( len == sizeof(struct hidrep_system_t) ) ) ||
+                 ( ( buf[j+2] == REPORTID_KEYBD ) &&
+                   ( ( len == sizeof(struct hidrep_keyb_t) ) ||
+                     ( nkro && ( len == sizeof(struct hidrep_nkro_t) ) ) ) ) ) )
+        {
+            return	-1;
+        }
+        hid_submit ( buf + j + 1, len );
+        ++k;
+    }
+    return	k;
+}
+
+/*
+ *	inject_init - Create the injection socket at injectpath
+ *	Return value: 0 = OK, <0 = failure
+ */
+int	inject_init ( void )
+{
+    struct sockaddr_un	sun;
+    int	i;
+    for ( i = 0; i < MAXINJECT; ++i ) injectors[i] = -1;
+    if ( strlen ( injectpath ) >= sizeof(sun.sun_path) ) return -1;
+    memset ( &sun, 0, sizeof(sun) );
+    sun.sun_family = AF_UNIX;
+    strcpy ( sun.sun_path, injectpath );
+    unlink ( injectpath ); // left over from an earlier run
+    injectfd = socket ( AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if ( ( 0 > injectfd ) ||
+         ( 0 > bind ( injectfd, (struct sockaddr *)&sun, sizeof(sun) ) ) ||
+         ( 0 > listen ( injectfd, MAXINJECT ) ) ||
+         evt_add ( injectfd, EVTAG(EVTAG_INJLISTEN,0), EPOLLIN ) )
+    {
+        fprintf ( stderr, "Failed to create injection socket [%s]: %s\n",
+            injectpath, strerror ( errno ) );
+        return	-1;
+    }
+    return	0;
+}
+
+void	inject_accept ( void )
+{
+    int	i, fd;
+    if ( 0 > ( fd = accept ( injectfd, NULL, NULL ) ) ) return;
+    for ( i = 0; ( i < MAXINJECT ) && ( injectors[i] >= 0 ); ++i ) {;}
+    if ( ( i == MAXINJECT ) ||
+         ( 0 > fcntl ( fd, F_SETFL, O_NONBLOCK ) ) ||
+         evt_add ( fd, EVTAG(EVTAG_INJECT,i), EPOLLIN ) )
+    {
+        fprintf ( stderr, "Injection client refused\n" );
+        close ( fd );
+        return;
+    }
+    injectors[i] = fd;
+}
+
+/*
+ *	inject_read - Injection client c sent something: hand its reports
+ *	to the scheduler, at most evbatch messages per wakeup
+ */
+void	inject_read ( int c )
+{
+    unsigned char	buf[4096];
+    int	i, n;
+    for ( i = 0; ( injectors[c] >= 0 ) && ( i < evbatch ); ++i )
+    {
+        n = recv ( injectors[c], buf, sizeof(buf), 0 );
+        if ( ( n < 0 ) && ( ( errno == EAGAIN ) || ( errno == EINTR ) ) )
+        {
+            return;
+        }
+        if ( n <= 0 )
+        {	// Client is gone
+            evt_del ( injectors[c] );
+            close ( injectors[c] );
+            injectors[c] = -1;
+            return;
+        }
+        lat_read ();
+        if ( ( 0 > hid_records ( buf, n ) ) && ( debugevents & 0x2 ) )
+        {
+            fprintf ( stderr, "Malformed injected report\n" );
+        }
+    }
+}
+
+void	inject_close ( void )
+{
+    int	i;
+    if ( injectfd < 0 ) return;
+    for ( i = 0; i < MAXINJECT; ++i )
+    {
+        if ( injectors[i] >= 0 ) close ( injectors[i] );
+    }
+    close ( injectfd );
+    unlink ( injectpath );
+}
+
+//***************** Framed fifo input
+// With -F<name>, the fifo does not carry bare input_events but frames
+// (struct fifohdr_t + payload) of timestamped events or finished
+// reports, which may arrive split over several read()s. While the
+// hosts' report queues are half full, the fifo is not read any
+// further, so a writer is slowed down to what the link can take
+// instead of reports being collapsed.
+
+/*
+ *	parse_frames - The fifo can be read: append to the reassembly
+ *	buffer and process all complete frames. Return value: see
+ *	process_event
+ */
+int	parse_frames ( void )
+{
+    int	n;
+    n = read ( eventdevs[0], fifobuf + fifofill, sizeof(fifobuf) - fifofill );
+    if ( ( n < 0 ) && ( errno != EAGAIN ) && ( errno != EINTR ) )
+    {
+        fprintf ( stderr, "Failed to read fifo: %s\n", strerror ( errno ) );
+    }
+    if ( n > 0 ) fifofill += n;
+    return	fifo_drain ();
+}
+
+/*
+ *	fifo_drain - Process complete frames in the reassembly buffer,
+ *	until it is empty or the link is busy (inputheld is set then)
+ */
+int	fifo_drain ( void )
+{
+    struct fifohdr_t	hdr;
+    struct fifoevent_t	fe;
+    struct input_event	ie;
+    int	off = 0, j = 0, k;
+    unsigned char	*p;
+    lat_read ();
+    while ( fifofill - off >= (int)sizeof(hdr) )
+    {
+        if ( hid_busy () )
+        {
+            inputheld = 1;
+            evt_input ( 0 );
+            break;
+        }
+        memcpy ( &hdr, fifobuf + off, sizeof(hdr) );
+        if ( hdr.magic != FIFOMAGIC )
+        {	// Out of sync - skip to the next possible frame start
+            ++off;
+            continue;
+        }
+        if ( fifofill - off < (int)sizeof(hdr) + hdr.len ) break;
+        p = fifobuf + off + sizeof(hdr);
+        off += sizeof(hdr) + hdr.len;
+        if ( hdr.type == FIFO_REPORTS )
+        {
+            if ( ( 0 > hid_records ( p, hdr.len ) ) && ( debugevents & 0x2 ) )
+                fprintf ( stderr, "Malformed report frame\n" );
+            continue;
+        }
+        if ( hdr.type != FIFO_EVENTS ) continue;
+        for ( k = 0; k + (int)sizeof(fe) <= hdr.len; k += sizeof(fe) )
+        {
+            memcpy ( &fe, p + k, sizeof(fe) );
+            ie.time.tv_sec  = fe.usec / 1000000;
+            ie.time.tv_usec = fe.usec % 1000000;
+            ie.type  = fe.type;
+            ie.code  = fe.code;
+            ie.value = fe.value;
+            lat_event ( &ie.time, 0 );
+            if ( 0 > ( j = process_event ( 0, &ie ) ) ) break;
+        }
+        if ( j < 0 ) break;
+    }
+    fifofill -= off;
+    memmove ( fifobuf, fifobuf + off, fifofill );
+    return	( j < 0 ) ? j : 0;
+}
+
+//***************** Input thread
+// With -t, reading and translating input (event devices, fifo, hotplug)
+// runs in a thread of its own, with its own reactor (inputepoll),
+// optionally pinned to a CPU and with SCHED_FIFO priority. Whatever it
+// would do to the sessions - send a report, switch hosts, drop a host
+// on PAUSE - goes through a lock-free single-producer/single-consumer
+// ring to the radio (main) thread, which owns all sockets. So a
+// congested link never delays reading input, nor does a burst of input
+// delay the link. Should the radio thread fall behind that far that the
+// ring fills up, reports are folded into the state they lead to and
+// handed over once there is room (pipe_fold): the input thread never
+// waits for the radio thread. The radio thread only talks back through
+// the inputcmd pipe (see input_enable) and, when the input thread waits
+// for room in the ring, the piperoom eventfd (see pipe_wait). Without
+// -t, both run in main().
+
+/*
+ *	input_enable - Start (on = 1, after the first host connected) or
+ *	stop (no host left) reading input. Input that queued up while
+ *	idle is dropped, and the key/button state starts from scratch.
+ */
+void	input_enable ( int on )
+{
+    char	c = on ? '1' : '0';
+    int	k;
+    if ( threaded && ! oninput )
+    {	// Input belongs to the input thread
+        if ( 1 != write ( inputcmd[1], &c, 1 ) )
+        {
+            fprintf ( stderr, "Failed to reach input thread\n" );
+        }
+        return;
+    }
+    if ( on )
+    {
+        flush_events ();
+        hidcore_reset ( &hidcore );
+        for ( k = 0; k < nroutes; ++k ) hidcore_reset ( routes[k].core );
+    }
+    inputon = on;
+    evt_input ( on );
+}
+
+/*
+ *	input_leds - Mirror the LED state of the host getting input to the
+ *	local keyboards
+ */
+void	input_leds ( int leds )
+{
+    char	c[2] = { 'L', leds };
+    int	i;
+    if ( threaded && ! oninput )
+    {	// Event devices belong to the input thread
+        if ( 2 != write ( inputcmd[1], c, 2 ) )
+        {
+            fprintf ( stderr, "Failed to reach input thread\n" );
+        }
+        return;
+    }
+    if ( ledstate == leds ) return;
+    ledstate = leds;
+    for ( i = 0; i < MAXEVDEVS; ++i )
+    {
+        if ( ( eventdevs[i] >= 0 ) && evdevleds[i] ) evdev_leds ( i );
+    }
+}
+
+/*
+ *	input_resume - Go on reading the fifo if it is held back (see
+ *	fifo_drain) and the link has caught up. Return value: see
+ *	process_event
+ */
+int	input_resume ( void )
+{
+    int	j;
+    if ( ( ! inputheld ) || ( ! inputon ) || hid_busy () ) return 0;
+    inputheld = 0;
+    j = fifo_drain ();
+    if ( ! inputheld ) evt_input ( 1 );
+    return	j;
+}
+
+static __thread int	pipeput = 0;	// entries not yet signalled
+
+// Entries in the ring, as seen by the input thread
+static unsigned int pipe_used ( void )
+{
+    return	pipering.head - __atomic_load_n ( &pipering.tail, __ATOMIC_ACQUIRE );
+}
+
+// Put an entry into the ring, which has room for it
+static void pipe_push ( int kind, int arg, const void * data, int len,
+    long long origin )
+{
+    struct pipemsg_t	*m = &pipering.msg[pipering.head % PIPERING];
+    m->origin = origin;
+    m->kind = kind;
+    m->arg = arg;
+    m->len = len;
+    if ( len > 0 ) memcpy ( m->data, data, len );
+    __atomic_store_n ( &pipering.head, pipering.head + 1, __ATOMIC_RELEASE );
+    ++pipeput;
+}
+
+/*
+ *	pipe_fold - Report data for host found no room: fold it into the
+ *	host's pending state, the latest report of each report ID and the
+ *	summed mouse motion, just like sched_collapse does with a queue
+ */
+static void pipe_fold ( int host, const unsigned char * data, int len )
+{
+    struct pipepend_t	*pp;
+    int	k, axes[MOUSE_AXES];
+    if ( ( host < ROUTE_ACTIVE ) || ( host >= MAXSESSIONS ) ||
+         ( data[1] > REPORTID_SYSTEM ) || ( len > MAXREPORT ) )
+    {
+        __atomic_fetch_add ( &pipelost, 1, __ATOMIC_RELAXED );
+        return;
+    }
+    pp = &pipepend[host + 1];
+    if ( 0 == pp->folded++ )
+    {
+        pp->origin = stampevent;
+        ++pipepending;
+    }
+    if ( data[1] == REPORTID_MOUSE )
+    {
+        hidcore_mouse_get ( data, axes );
+        for ( k = 0; k < MOUSE_AXES; ++k )
+        {
+            pp->motion[k] += axes[k];
+        }
+    }
+    memcpy ( pp->data[data[1]], data, len );
+    pp->len[data[1]] = len;
+    __atomic_fetch_add ( &pipefolded, 1, __ATOMIC_RELAXED );
+}
+
+/*
+ *	pipe_unfold - Hand the pending state of pipe_fold to the radio
+ *	thread, as far as the ring has room below limit entries. The mouse
+ *	comes last, so all that may be left over is motion
+ *	Return value: 1 = some is still pending
+ */
+static int pipe_unfold ( unsigned int limit )
+{
+    struct pipepend_t	*pp;
+    int	h, k, id, more;
+    for ( h = 0; pipepending && ( h <= MAXSESSIONS ); ++h )
+    {
+        pp = &pipepend[h];
+        if ( 0 == pp->folded ) continue;
+        for ( k = 1; k <= REPORTID_SYSTEM; ++k )
+        {
+            id = k % REPORTID_SYSTEM + 1; // REPORTID_MOUSE after the others
+            for ( more = ( pp->len[id] > 0 ); more; )
+            {
+                if ( pipe_used () >= limit ) return 1;
+                // Motion beyond one report's range needs some more of them
+                more = ( id == REPORTID_MOUSE ) &&
+                    hidcore_mouse_put ( pp->data[id], pp->motion );
+                pipe_push ( PIPE_REPORT, h - 1, pp->data[id], pp->len[id],
+                    pp->origin );
+            }
+            pp->len[id] = 0;
+        }
+        pp->folded = 0;
+        --pipepending;
+    }
+    return	0;
+}
+
+/*
+ *	pipe_put - Hand something to the radio thread (see PIPE_*), never
+ *	waiting for it: a report finding the ring full (but PIPERESERVE
+ *	entries) is folded into the pending state (see pipe_fold), so is
+ *	every report after it until that could be handed over. The other
+ *	messages may use the reserve, after the pending state; motion still
+ *	left over then follows them. Should even the reserve be taken, the
+ *	message is lost. Return value: 0 = OK, <0 = lost
+ */
+int	pipe_put ( int kind, int arg, const void * data, int len )
+{
+    if ( kind == PIPE_REPORT )
+    {
+        if ( ( pipepending && pipe_unfold ( PIPERING - PIPERESERVE ) ) ||
+             ( pipe_used () >= PIPERING - PIPERESERVE ) )
+        {
+            pipe_fold ( arg, data, len );
+            return	0;
+        }
+    }
+    else
+    {
+        if ( pipepending ) pipe_unfold ( PIPERING - 1 );
+        if ( pipe_used () >= PIPERING )
+        {
+            __atomic_fetch_add ( &pipelost, 1, __ATOMIC_RELAXED );
+            return	-1;
+        }
+    }
+    pipe_push ( kind, arg, data, len, stampevent );
+    return	0;
+}
+
+/*
+ *	pipe_wait - Input thread, before it goes to sleep: if it waits for
+ *	room in the ring (fifo held back, pending state), have pipe_drain
+ *	signal piperoom once the ring is below half full
+ *	Return value: 1 = it is already, do not sleep
+ */
+static int pipe_wait ( void )
+{
+    if ( ! ( ( inputheld && inputon ) || pipepending ) ) return 0;
+    __atomic_store_n ( &pipewant, 1, __ATOMIC_RELAXED );
+    // Pairs with the fence in pipe_drain: either it sees pipewant, or
+    // we see the entries it has taken
+    __atomic_thread_fence ( __ATOMIC_SEQ_CST );
+    return	pipe_used () < PIPERING / 2;
+}
+
+// Wake the radio thread, once per batch of input
+static void pipe_kick ( void )
+{
+    uint64_t	one = 1;
+    if ( 0 == pipeput ) return;
+    pipeput = 0;
+    if ( 0 > write ( pipewake, &one, sizeof(one) ) ) {;}
+}
+
+/*
+ *	pipe_drain - Radio thread: carry out everything the input thread
+ *	put into the ring so far
+ */
+void	pipe_drain ( void )
+{
+    struct pipemsg_t	*m;
+    uint64_t	n, one = 1;
+    unsigned int	head;
+    if ( 0 > read ( pipewake, &n, sizeof(n) ) ) {;}
+    head = __atomic_load_n ( &pipering.head, __ATOMIC_ACQUIRE );
+    stampread = 0; // LAT_BUILD was counted by the input thread
+    for ( ; pipering.tail != head; )
+    {
+        m = &pipering.msg[pipering.tail % PIPERING];
+        stampevent = m->origin;
+        switch ( m->kind )
+        {
+          case	PIPE_REPORT:
+            hid_submit_to ( m->arg, m->data, m->len );
+            break;
+          case	PIPE_FLUSH:
+            hid_flush ();
+            break;
+          case	PIPE_SWITCH:
+            session_switch ( m->arg );
+            break;
+          case	PIPE_BROADCAST:
+            session_broadcast ();
+            break;
+          case	PIPE_RESULT:
+            input_result ( m->arg );
+            break;
+        }
+        __atomic_store_n ( &pipering.tail, pipering.tail + 1, __ATOMIC_RELEASE );
+    }
+    stampevent = 0;
+    __atomic_thread_fence ( __ATOMIC_SEQ_CST ); // see pipe_wait
+    if ( ( __atomic_load_n ( &pipering.head, __ATOMIC_ACQUIRE ) - pipering.tail
+           < PIPERING / 2 ) && __atomic_exchange_n ( &pipewant, 0, __ATOMIC_RELAXED ) )
+    {
+        if ( 0 > write ( piperoom, &one, sizeof(one) ) ) {;}
+    }
+}
+
+static void * input_main ( void * arg )
+{
+    struct epoll_event	evs[MAXEPOLLEVS];
+    struct sched_param	sp;
+    cpu_set_t	cpus;
+    int	n, k, j, timeout = -1;
+    uint64_t	room;
+    char	c;
+    oninput = 1;
+    trace_attach ();
+    if ( inputcpu >= 0 )
+    {
+        CPU_ZERO ( &cpus );
+        CPU_SET ( inputcpu, &cpus );
+        if ( pthread_setaffinity_np ( pthread_self (), sizeof(cpus), &cpus ) )
+        {
+            fprintf ( stderr, "Failed to pin input thread to CPU %d\n",
+                inputcpu );
+        }
+    }
+    memset ( &sp, 0, sizeof(sp) );
+    sp.sched_priority = sched_get_priority_min ( SCHED_FIFO ) + 1;
+    if ( pthread_setschedparam ( pthread_self (), SCHED_FIFO, &sp ) )
+    {
+        fprintf ( stderr, "Input thread runs without SCHED_FIFO "
+            "(needs CAP_SYS_NICE)\n" );
+    }
+    while ( 1 )
+    {
+        n = epoll_wait ( inputepoll, evs, MAXEPOLLEVS, timeout );
+        for ( k = 0; k < n; ++k )
+        {
+            switch ( EVTAG_TYPE(evs[k].data.u32) )
+            {
+              case	EVTAG_EVDEV:
+                j = fifoframed ? parse_frames ()
+                    : parse_events ( EVTAG_INDEX(evs[k].data.u32) );
+                if ( 0 > j ) pipe_put ( PIPE_RESULT, j, NULL, 0 );
+                break;
+              case	EVTAG_HOTPLUG:
+                hotplug_event ();
+                break;
+              case	EVTAG_WATCHDOG:
+                input_watchdog ();
+                break;
+              case	EVTAG_PIPEROOM:
+                if ( 0 > read ( piperoom, &room, sizeof(room) ) ) {;}
+                break;
+              case	EVTAG_INPUTCMD:
+                while ( 1 == read ( inputcmd[0], &c, 1 ) )
+                {
+                    if ( c == 'q' )
+                    {
+                        pipe_kick ();
+                        return	NULL;
+                    }
+                    if ( c == 'L' )
+                    {	// Written together, so the LED byte is there
+                        if ( 1 == read ( inputcmd[0], &c, 1 ) ) input_leds ( (unsigned char)c );
+                        continue;
+                    }
+                    input_enable ( c == '1' );
+                }
+                break;
+            }
+        }
+        if ( pipepending ) pipe_unfold ( PIPERING - PIPERESERVE );
+        if ( 0 > ( j = input_resume () ) ) pipe_put ( PIPE_RESULT, j, NULL, 0 );
+        pipe_kick ();
+        timeout = pipe_wait () ? 0 : -1;
+    }
+}
+
+/*
+ *	input_setup - Set up the reactor for input: the main one, or with
+ *	-t a separate one for the input thread
+ *	Return value: 0 = OK, <0 = failure
+ */
+int	input_setup ( void )
+{
+    if ( ! threaded )
+    {
+        inputepoll = epollfd;
+        return	0;
+    }
+    inputepoll = epoll_create1 ( EPOLL_CLOEXEC );
+    pipewake = eventfd ( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    piperoom = eventfd ( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if ( ( 0 > inputepoll ) || ( 0 > pipewake ) || ( 0 > piperoom ) ||
+         ( 0 > pipe2 ( inputcmd, O_NONBLOCK | O_CLOEXEC ) ) ||
+         evt_addto ( inputepoll, inputcmd[0], EVTAG(EVTAG_INPUTCMD,0), EPOLLIN ) ||
+         evt_addto ( inputepoll, piperoom, EVTAG(EVTAG_PIPEROOM,0), EPOLLIN ) ||
+         evt_add ( pipewake, EVTAG(EVTAG_PIPE,0), EPOLLIN ) )
+    {
+        fprintf ( stderr, "Failed to set up input thread: %s\n",
+            strerror ( errno ) );
+        return	-1;
+    }
+    return	0;
+}
+
+/*
+ *	input_start - Start the input thread (-t only). Call with all
+ *	signals blocked that main() waits for.
+ *	Return value: 0 = OK, <0 = failure
+ */
+int	input_start ( void )
+{
+    if ( ! threaded ) return 0;
+    if ( 0 != pthread_create ( &inputthread, NULL, input_main, NULL ) )
+    {
+        fprintf ( stderr, "Failed to start input thread\n" );
+        return	-1;
+    }
+    return	0;
+}
+
+void	input_stop ( void )
+{
+    char	c = 'q';
+    if ( ! threaded ) return;
+    if ( 1 == write ( inputcmd[1], &c, 1 ) )
+    {
+        pthread_join ( inputthread, NULL );
+    }
+    pipe_drain ();
+}
+
+//***************** Recording and replaying input
+// --record <file> writes every input_event sent to a host, with the
+// CLOCK_MONOTONIC time it happened (its kernel timestamp if that is
+// recent, see lat_event, else when it was read), into a memory-mapped
+// log (see struct evloghdr_t). The header's count is updated with each
+// event, so the log stays valid if hidclient is killed. --replay <file>
+// sends such a log instead of reading input devices, keeping the
+// recorded gaps between events (divided by --speed, a gap going back in
+// time counts as none) with an absolute CLOCK_MONOTONIC timerfd. Replay
+// starts when a host connects, pauses while none is, and hidclient
+// terminates once all events are sent.
+
+// Map the log for (at least) cap events
+static int rec_map ( unsigned int cap )
+{
+    size_t	size = sizeof(struct evloghdr_t) + (size_t)cap * sizeof(struct fifoevent_t);
+    void	*m;
+    if ( 0 > ftruncate ( recfd, size ) ) return -1;
+    m = mmap ( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, recfd, 0 );
+    if ( MAP_FAILED == m ) return -1;
+    if ( NULL != recmap )
+    {
+        munmap ( recmap, sizeof(struct evloghdr_t) +
+            (size_t)reccap * sizeof(struct fifoevent_t) );
+    }
+    recmap = m;
+    reccap = cap;
+    return	0;
+}
+
+/*
+ *	rec_open - Start recording input into file name
+ *	Return value: 0 = OK, <0 = failure
+ */
+int	rec_open ( const char * name )
+{
+    recfd = open ( name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+    if ( ( 0 > recfd ) || rec_map ( EVLOGCHUNK ) )
+    {
+        fprintf ( stderr, "Failed to create input log [%s]: %s\n",
+            name, strerror ( errno ) );
+        return	-1;
+    }
+    recmap->magic = EVLOGMAGIC;
+    recmap->count = 0;
+    return	0;
+}
+
+void	rec_event ( const struct input_event * ie )
+{
+    struct fifoevent_t	*fe;
+    if ( ( recmap->count == reccap ) && rec_map ( reccap + EVLOGCHUNK ) )
+    {
+        fprintf ( stderr, "Input log full: %s\n", strerror ( errno ) );
+        rec_close ();
+        return;
+    }
+    fe = (struct fifoevent_t *)( recmap + 1 ) + recmap->count;
+    fe->usec  = ( stampevent ? stampevent : stampread ) / 1000;
+    fe->type  = ie->type;
+    fe->code  = ie->code;
+    fe->value = ie->value;
+    ++recmap->count;
+}
+
+void	rec_close ( void )
+{
+    unsigned int	n;
+    if ( NULL == recmap ) return;
+    n = recmap->count;
+    munmap ( recmap, sizeof(struct evloghdr_t) +
+        (size_t)reccap * sizeof(struct fifoevent_t) );
+    recmap = NULL;
+    // Cut off the unused rest of the last chunk
+    if ( ftruncate ( recfd, sizeof(struct evloghdr_t) +
+        (size_t)n * sizeof(struct fifoevent_t) ) ) {;}
+    close ( recfd );
+    fprintf ( stdout, "Recorded %u input events\n", n );
+}
+
+/*
+ *	replay_open - Map the input log name for replaying
+ *	Return value: 0 = OK, <0 = failure
+ */
+int	replay_open ( const char * name )
+{
+    struct stat	ss;
+    int	fd;
+    void	*m = MAP_FAILED;
+    if ( 0 <= ( fd = open ( name, O_RDONLY | O_CLOEXEC ) ) )
+    {
+        if ( ( 0 == fstat ( fd, &ss ) ) &&
+             ( ss.st_size >= (off_t)sizeof(struct evloghdr_t) ) )
+        {
+            m = mmap ( NULL, ss.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        }
+        close ( fd );
+    }
+    if ( MAP_FAILED == m )
+    {
+        fprintf ( stderr, "Failed to open input log [%s]\n", name );
+        return	-1;
+    }
+    replaymap = m;
+    replaysize = ss.st_size;
+    if ( ( replaymap->magic != EVLOGMAGIC ) ||
+         ( replaysize < sizeof(struct evloghdr_t) +
+           (size_t)replaymap->count * sizeof(struct fifoevent_t) ) )
+    {
+        fprintf ( stderr, "[%s] is no valid input log\n", name );
+        munmap ( replaymap, replaysize );
+        replaymap = NULL;
+        return	-1;
+    }
+    madvise ( m, replaysize, MADV_SEQUENTIAL );
+    replaytimer = timerfd_create ( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+    if ( ( 0 > replaytimer ) ||
+         evt_add ( replaytimer, EVTAG(EVTAG_REPLAY,0), EPOLLIN ) )
+    {
+        fprintf ( stderr, "Failed to set up replay timer: %s\n",
+            strerror ( errno ) );
+        if ( replaytimer >= 0 ) close ( replaytimer );
+        replaytimer = -1;
+        munmap ( replaymap, replaysize );
+        replaymap = NULL;
+        return	-1;
+    }
+    fprintf ( stdout, "Replaying %u input events\n", replaymap->count );
+    return	0;
+}
+
+// When event replaypos is due, in ns relative to the first one
+static long long replay_offset ( void )
+{
+    return	(long long)( replayat * 1000.0 / replayspeed );
+}
+
+// Move on to the next event; its gap to this one is clamped to 0 if
+// the log goes back in time (hand edited, or recorded by an old version)
+static void replay_next ( void )
+{
+    struct fifoevent_t	*fe = (struct fifoevent_t *)( replaymap + 1 );
+    ++replaypos;
+    if ( ( replaypos < replaymap->count ) &&
+         ( fe[replaypos].usec > fe[replaypos-1].usec ) )
+    {
+        replayat += fe[replaypos].usec - fe[replaypos-1].usec;
+    }
+}
+
+static void replay_arm ( void )
+{
+    struct itimerspec	its;
+    long long	due = replaybase + replay_offset ();
+    memset ( &its, 0, sizeof(its) );
+    its.it_value.tv_sec  = due / 1000000000LL;
+    its.it_value.tv_nsec = due % 1000000000LL;
+    if ( due <= 0 ) its.it_value.tv_nsec = 1; // 0 would disarm
+    timerfd_settime ( replaytimer, TFD_TIMER_ABSTIME, &its, NULL );
+}
+
+/*
+ *	replay_kick - (Re)start a paused replay once a host is connected,
+ *	continuing where it stopped
+ */
+void	replay_kick ( void )
+{
+    if ( ( NULL == replaymap ) || ( 0 != replaybase ) ||
+         ( activesession < 0 ) || ( replaypos >= replaymap->count ) ) return;
+    replaybase = now_ns () - replay_offset ();
+    replay_arm ();
+}
+
+/*
+ *	replay_run - The replay timer expired: send all events due by now
+ *	Return value: see process_event; -99 (terminate) after the last one
+ */
+int	replay_run ( void )
+{
+    struct fifoevent_t	*fe = (struct fifoevent_t *)( replaymap + 1 );
+    struct input_event	ie;
+    uint64_t	expired;
+    long long	now = now_ns ();
+    int	j;
+    if ( 0 > read ( replaytimer, &expired, sizeof(expired) ) ) return 0;
+    if ( activesession < 0 )
+    {	// Host gone, paused until replay_kick()
+        replaybase = 0;
+        return	0;
+    }
+    lat_read (); // replayed timestamps are history
+    while ( ( replaypos < replaymap->count ) &&
+            ( replaybase + replay_offset () <= now ) )
+    {
+        // No timestamp: a recorded one is CLOCK_MONOTONIC too and, shortly
+        // after recording, would pass for a recent one (see hid_sink)
+        memset ( &ie.time, 0, sizeof(ie.time) );
+        ie.type  = fe[replaypos].type;
+        ie.code  = fe[replaypos].code;
+        ie.value = fe[replaypos].value;
+        replay_next ();
+        if ( 0 > ( j = process_event ( 0, &ie ) ) ) return j;
+    }
+    if ( replaypos < replaymap->count )
+    {
+        replay_arm ();
+        return	0;
+    }
+    fprintf ( stdout, "Replay finished\n" );
+    hid_flush ();
+    return	-99;
+}
+
+void	replay_close ( void )
+{
+    if ( NULL == replaymap ) return;
+    munmap ( replaymap, replaysize );
+    if ( replaytimer >= 0 ) close ( replaytimer );
+}
+
+//***************** Reconnecting to known hosts
+// With -R<file>, hidclient remembers the last MAXHOSTS hosts it was
+// connected to. On startup and whenever a link is lost, it pages them
+// itself (control channel first, then interrupt channel, just like a
+// host would) instead of waiting for them to connect. Failed attempts
+// are retried with exponential backoff.
+
+/*
+ *	hosts_load - Read the remembered hosts from hostfile, one address
+ *	per line, most recent first. Returns number of hosts
+ */
+int	hosts_load ( void )
+{
+    FILE	*pf;
+    char	line[64];
+    int	h;
+    for ( h = 0; h < MAXHOSTS; ++h )
+    {
+        hosts[h].ctlfd = hosts[h].intfd = hosts[h].timerfd = -1;
+    }
+    nhosts = 0;
+    if ( NULL == ( pf = fopen ( hostfile, "r" ) ) )
+    {
+        return	0; // Nobody connected so far
+    }
+    while ( ( nhosts < MAXHOSTS ) && ( NULL != fgets ( line, sizeof(line), pf ) ) )
+    {
+        if ( 0 == str2ba ( line, &hosts[nhosts].bdaddr ) )
+        {
+            hosts[nhosts].backoff = RECONNECT_MIN;
+            hosts[nhosts].hold = 0;
+            ++nhosts;
+        }
+    }
+    fclose ( pf );
+    return	nhosts;
+}
+
+static void hosts_save ( void )
+{
+    FILE	*pf;
+    char	badr[40];
+    int	h;
+    if ( NULL == ( pf = fopen ( hostfile, "w" ) ) )
+    {
+        fprintf ( stderr, "Failed to write host file [%s]: %s\n",
+            hostfile, strerror ( errno ) );
+        return;
+    }
+    for ( h = 0; h < nhosts; ++h )
+    {
+        ba2str ( &hosts[h].bdaddr, badr );
+        fprintf ( pf, "%s\n", badr );
+    }
+    fclose ( pf );
+}
+
+static int host_find ( bdaddr_t * bdaddr )
+{
+    int	h;
+    for ( h = 0; h < nhosts; ++h )
+    {
+        if ( 0 == bacmp ( &hosts[h].bdaddr, bdaddr ) ) return h;
+    }
+    return	-1;
+}
+
+// Stop connecting to host h: close sockets, disarm timer
+static void host_cancel ( int h )
+{
+    if ( hosts[h].ctlfd >= 0 ) close ( hosts[h].ctlfd );
+    if ( hosts[h].intfd >= 0 ) close ( hosts[h].intfd );
+    if ( hosts[h].timerfd >= 0 ) close ( hosts[h].timerfd );
+    hosts[h].ctlfd = hosts[h].intfd = hosts[h].timerfd = -1;
+}
+
+// Start a non-blocking connect to psm of host h, reported by the reactor
+static int host_connect ( int h, unsigned short psm, int type )
+{
+    struct sockaddr_l2	l2a;
+    int	fd;
+    fd = socket ( AF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+        BTPROTO_L2CAP );
+    if ( 0 > fd ) return -1;
+    memset ( &l2a, 0, sizeof(l2a) );
+    l2a.l2_family = AF_BLUETOOTH;
+    bacpy ( &l2a.l2_bdaddr, &hosts[h].bdaddr );
+    l2a.l2_psm = htobs ( psm );
+    link_sockopts ( fd, psm, 0 );
+    if ( ( 0 > connect ( fd, (struct sockaddr *)&l2a, sizeof(l2a) ) &&
+           ( errno != EINPROGRESS ) ) ||
+         evt_add ( fd, EVTAG(type,h), EPOLLOUT ) )
+    {
+        close ( fd );
+        return	-1;
+    }
+    return	fd;
+}
+
+// Connecting to host h failed: try again after the backoff time
+static void host_retry ( int h )
+{
+    struct itimerspec	its;
+    host_cancel ( h );
+    if ( prepareshutdown || hosts[h].hold ) return;
+    hosts[h].timerfd = timerfd_create ( CLOCK_MONOTONIC,
+        TFD_NONBLOCK | TFD_CLOEXEC );
+    if ( ( 0 > hosts[h].timerfd ) ||
+         evt_add ( hosts[h].timerfd, EVTAG(EVTAG_DIALTMR,h), EPOLLIN ) )
+    {
+        host_cancel ( h );
+        return;
+    }
+    memset ( &its, 0, sizeof(its) );
+    its.it_value.tv_sec  = hosts[h].backoff / 1000;
+    its.it_value.tv_nsec = ( hosts[h].backoff % 1000 ) * 1000000L;
+    timerfd_settime ( hosts[h].timerfd, 0, &its, NULL );
+    if ( debugevents & 0x2 )
+        fprintf ( stderr, "Reconnect to host in %d ms\n", hosts[h].backoff );
+    hosts[h].backoff *= 2;
+    if ( hosts[h].backoff > RECONNECT_MAX ) hosts[h].backoff = RECONNECT_MAX;
+}
+
+/*
+ *	host_dial - Start (or continue) connecting to remembered host h,
+ *	called on startup and from the reactor
  */
-int	parse_events ( fd_set * efds, int sockdesc )
-{
-    int	i, j;
-    signed char	c;
-    unsigned char	u;
-    char	buf[sizeof(struct input_event)];
-    char	hidrep[32]; // mouse ~6, keyboard ~11 chars
-    struct input_event    * inevent = (void *)buf;
-    struct hidrep_mouse_t * evmouse = (void *)hidrep;
-    struct hidrep_keyb_t  * evkeyb  = (void *)hidrep;
-    if ( efds == NULL ) { return -1; }
-    for ( i = 0; i < MAXEVDEVS; ++i )
-    {
-        if ( 0 > eventdevs[i] ) continue;
-        if ( ! ( FD_ISSET ( eventdevs[i], efds ) ) ) continue;
-        j = read ( eventdevs[i], buf, sizeof(struct input_event) );
-        if ( j == 0 )
-        {
-            if ( debugevents & 0x1 ) fprintf(stderr,".");
-            continue;
-        }
-        if ( -1 == j )
+void	host_dial ( int h )
+{
+    int	err = 0;
+    socklen_t	len = sizeof(err);
+    if ( ( hosts[h].ctlfd < 0 ) && ( hosts[h].intfd < 0 ) )
+    {	// New attempt: control channel first
+        host_cancel ( h );
+        if ( 0 > ( hosts[h].ctlfd = host_connect ( h, PSMHIDCTL,
+            EVTAG_DIALCTL ) ) )
         {
-            if ( debugevents & 0x1 )
-            {
-                if ( errno > 0 )
-                {
-                    fprintf(stderr,"%d|%d(%s) (expected %d bytes). ",eventdevs[i],errno,strerror(errno), (int)sizeof(struct input_event));
-                }
-                else
-                {
-                    fprintf(stderr,"j=-1,errno<=0...");
-                }
-            }
-            continue;
+            host_retry ( h );
         }
-        if ( sizeof(struct input_event) > j )
+        return;
+    }
+    if ( hosts[h].intfd < 0 )
+    {	// Control channel attempt finished
+        if ( ( 0 > getsockopt ( hosts[h].ctlfd, SOL_SOCKET, SO_ERROR,
+            &err, &len ) ) || ( err != 0 ) ||
+             ( 0 > ( hosts[h].intfd = host_connect ( h, PSMHIDINT,
+               EVTAG_DIALINT ) ) ) )
         {
-            // exactly 24 on 64bit, (16 on 32bit): sizeof(struct input_event)
-            //  chars expected != got: data invalid, drop it!
-            continue;
+            host_retry ( h );
+            return;
         }
-        if ( debugevents & 0x4 )
-            fprintf(stderr,"   read(%d)from(%d)   ", j, i );
-        if ( debugevents & 0x1 )
-            fprintf ( stdout, "EVENT{%04X %04X %08X}\n", inevent->type,
-              inevent->code, inevent->value );
-        switch ( inevent->type )
+        evt_del ( hosts[h].ctlfd );
+        return;
+    }
+    // Interrupt channel attempt finished
+    if ( ( 0 > getsockopt ( hosts[h].intfd, SOL_SOCKET, SO_ERROR,
+        &err, &len ) ) || ( err != 0 ) )
+    {
+        host_retry ( h );
+        return;
+    }
+    // Both channels up: hand them on as if the host had connected
+    evt_del ( hosts[h].intfd );
+    err = hosts[h].ctlfd;
+    len = hosts[h].intfd;
+    hosts[h].ctlfd = hosts[h].intfd = -1;
+    fprintf ( stdout, "Reconnected to host\n" );
+    if ( 0 <= session_accept_ctl ( err, &hosts[h].bdaddr ) )
+    {
+        session_accept_int ( len, &hosts[h].bdaddr );
+    } else {
+        close ( len );
+    }
+}
+
+/*
+ *	host_connected - A session with bdaddr is up: remember the host
+ *	(first in the list), stop connecting to it on our own
+ */
+void	host_connected ( bdaddr_t * bdaddr )
+{
+    int	h;
+    struct host_t	ht;
+    if ( NULL == hostfile ) return;
+    if ( 0 > ( h = host_find ( bdaddr ) ) )
+    {	// New host, forget the least recently used one if necessary
+        if ( nhosts == MAXHOSTS ) host_cancel ( --nhosts );
+        h = nhosts++;
+        bacpy ( &hosts[h].bdaddr, bdaddr );
+        hosts[h].ctlfd = hosts[h].intfd = hosts[h].timerfd = -1;
+    }
+    host_cancel ( h );
+    hosts[h].backoff = RECONNECT_MIN;
+    hosts[h].hold = 0;
+    if ( h > 0 )
+    {
+        ht = hosts[h];
+        memmove ( &hosts[1], &hosts[0], h * sizeof(struct host_t) );
+        hosts[0] = ht;
+        // Slot numbers moved, so do the reactor tags
+        for ( h = 1; h < nhosts; ++h )
         {
-          case	EV_SYN:
-            break;
-          case	EV_KEY:
-            u = 1; // Modifier keys
-            switch ( inevent->code )
-            {
-              // *** Mouse button events
-              case	BTN_LEFT:
-              case	BTN_RIGHT:
-              case	BTN_MIDDLE:
-                c = 1 << (inevent->code & 0x03);
-                mousebuttons = mousebuttons & (0x07-c);
-                if ( inevent->value == 1 )
-                // Key has been pressed DOWN
-                {
-                    mousebuttons=mousebuttons | c;
-                }
-                evmouse->btcode = 0xA1;
-                evmouse->rep_id = REPORTID_MOUSE;
-                evmouse->button = mousebuttons & 0x07;
-                evmouse->axis_x =
-                evmouse->axis_y =
-                evmouse->axis_wheel = 0;
-                j = send ( sockdesc, evmouse,
-                    sizeof(struct hidrep_mouse_t),
-                    MSG_NOSIGNAL );
-                if ( 1 > j )
-                {
-                    return	-1;
-                }
-                break;
-              // *** Special key: PAUSE
-              case	KEY_PAUSE:	
-                // When pressed: abort connection
-                if ( inevent->value == 0 )
-                {
-                    evkeyb->btcode=0xA1;
-                    evkeyb->rep_id=REPORTID_KEYBD;
-                    memset ( evkeyb->key, 0, 8 );
-                    evkeyb->modify = 0;
-                    j = send ( sockdesc, evkeyb,
-                      sizeof(struct hidrep_keyb_t),
-                      MSG_NOSIGNAL );
-                    close ( sockdesc );
-                    // If also LCtrl+Alt pressed:
-                    // Terminate program
-                    if (( modifierkeys & 0x5 ) == 0x5 )
-                    {
-                    return	-99;
-                    }
-                    return -1;
-                }
-                break;
-              // *** "Modifier" key events
-              case	KEY_RIGHTMETA:
-                u <<= 1;
-              case	KEY_RIGHTALT:
-                u <<= 1;
-              case	KEY_RIGHTSHIFT:
-                u <<= 1;
-              case	KEY_RIGHTCTRL:
-                u <<= 1;
-              case	KEY_LEFTMETA:
-                u <<= 1;
-              case	KEY_LEFTALT:
-                u <<= 1;
-              case	KEY_LEFTSHIFT:
-                u <<= 1;
-              case	KEY_LEFTCTRL:
-                evkeyb->btcode = 0xA1;
-                evkeyb->rep_id = REPORTID_KEYBD;
-                memcpy ( evkeyb->key, pressedkey, 8 );
-                modifierkeys &= ( 0xff - u );
-                if ( inevent->value >= 1 )
-                {
-                    modifierkeys |= u;
-                }
-                evkeyb->modify = modifierkeys;
-                j = send ( sockdesc, evkeyb,
-                    sizeof(struct hidrep_keyb_t),
-                    MSG_NOSIGNAL );
-                if ( 1 > j )
-                {
-                    return	-1;
-                }
-                break;
-              // *** Regular key events
-              case	KEY_KPDOT:	++u; // Keypad Dot ~ 99
-              case	KEY_KP0:	++u; // code 98...
-              case	KEY_KP9:	++u; // countdown...
-              case	KEY_KP8:	++u;
-              case	KEY_KP7:	++u;
-              case	KEY_KP6:	++u;
-              case	KEY_KP5:	++u;
-              case	KEY_KP4:	++u;
-              case	KEY_KP3:	++u;
-              case	KEY_KP2:	++u;
-              case	KEY_KP1:	++u;
-              case	KEY_KPENTER:	++u;
-              case	KEY_KPPLUS:	++u;
-              case	KEY_KPMINUS:	++u;
-              case	KEY_KPASTERISK:	++u;
-              case	KEY_KPSLASH:	++u;
-              case	KEY_NUMLOCK:	++u;
-              case	KEY_UP:		++u;
-              case	KEY_DOWN:	++u;
-              case	KEY_LEFT:	++u;
-              case	KEY_RIGHT:	++u;
-              case	KEY_PAGEDOWN:	++u;
-              case	KEY_END:	++u;
-              case	KEY_DELETE:	++u;
-              case	KEY_PAGEUP:	++u;
-              case	KEY_HOME:	++u;
-              case	KEY_INSERT:	++u;
-                        ++u; //[Pause] key
-                        // - checked separately
-              case	KEY_SCROLLLOCK:	++u;
-              case	KEY_SYSRQ:	++u; //[printscr]
-              case	KEY_F12:	++u; //F12=> code 69
-              case	KEY_F11:	++u;
-              case	KEY_F10:	++u;
-              case	KEY_F9:		++u;
-              case	KEY_F8:		++u;
-              case	KEY_F7:		++u;
-              case	KEY_F6:		++u;
-              case	KEY_F5:		++u;
-              case	KEY_F4:		++u;
-              case	KEY_F3:		++u;
-              case	KEY_F2:		++u;
-              case	KEY_F1:		++u;
-              case	KEY_CAPSLOCK:	++u;
-              case	KEY_SLASH:	++u;
-              case	KEY_DOT:	++u;
-              case	KEY_COMMA:	++u;
-              case	KEY_GRAVE:	++u;
-              case	KEY_APOSTROPHE:	++u;
-              case	KEY_SEMICOLON:	++u;
-              case	KEY_102ND:	++u;
-              case	KEY_BACKSLASH:	++u;
-              case	KEY_RIGHTBRACE:	++u;
-              case	KEY_LEFTBRACE:	++u;
-              case	KEY_EQUAL:	++u;
-              case	KEY_MINUS:	++u;
-              case	KEY_SPACE:	++u;
-              case	KEY_TAB:	++u;
-              case	KEY_BACKSPACE:	++u;
-              case	KEY_ESC:	++u;
-              case	KEY_ENTER:	++u; //Return=> code 40
-              case	KEY_0:		++u;
-              case	KEY_9:		++u;
-              case	KEY_8:		++u;
-              case	KEY_7:		++u;
-              case	KEY_6:		++u;
-              case	KEY_5:		++u;
-              case	KEY_4:		++u;
-              case	KEY_3:		++u;
-              case	KEY_2:		++u;
-              case	KEY_1:		++u;
-              case	KEY_Z:		++u;
-              case	KEY_Y:		++u;
-              case	KEY_X:		++u;
-              case	KEY_W:		++u;
-              case	KEY_V:		++u;
-              case	KEY_U:		++u;
-              case	KEY_T:		++u;
-              case	KEY_S:		++u;
-              case	KEY_R:		++u;
-              case	KEY_Q:		++u;
-              case	KEY_P:		++u;
-              case	KEY_O:		++u;
-              case	KEY_N:		++u;
-              case	KEY_M:		++u;
-              case	KEY_L:		++u;
-              case	KEY_K:		++u;
-              case	KEY_J:		++u;
-              case	KEY_I:		++u;
-              case	KEY_H:		++u;
-              case	KEY_G:		++u;
-              case	KEY_F:		++u;
-              case	KEY_E:		++u;
-              case	KEY_D:		++u;
-              case	KEY_C:		++u;
-              case	KEY_B:		++u;
-              case	KEY_A:		u +=3;	// A =>  4
-                evkeyb->btcode = 0xA1;
-                evkeyb->rep_id = REPORTID_KEYBD;
-                if ( inevent->value == 1 )
-                {
-                    // "Key down": Add to list of
-                    // currently pressed keys
-                    for ( j = 0; j < 8; ++j )
-                    {
-                        if (pressedkey[j] == 0)
-                        {
-                        pressedkey[j]=u;
-                        j = 8;
-                        }
-                        else if(pressedkey[j] == u)
-                        {
-                        j = 8;
-                        }
-                    }
-                }
-                else if ( inevent->value == 0 )
-                {	// KEY UP: Remove from array
-                    for ( j = 0; j < 8; ++j )
-                    {
-                        if ( pressedkey[j] == u )
-                        {
-                        while ( j < 7 )
-                        {
-                            pressedkey[j] =
-                            pressedkey[j+1];
-                            ++j;
-                        }
-                        pressedkey[7] = 0;
-                        }
-                    }
-                } 
-                else	// "Key repeat" event
-                {
-                    ; // This should be handled
-                    // by the remote side, not us.
-                }
-                memcpy ( evkeyb->key, pressedkey, 8 );
-                evkeyb->modify = modifierkeys;
-                j = send ( sockdesc, evkeyb,
-                    sizeof(struct hidrep_keyb_t),
-                    MSG_NOSIGNAL );
-                if ( 1 > j )
-                {
-                    // If sending data fails,
-                    // abort connection
-                    return	-1;
-                }
-                break;
-              default:
-                // Unknown key usage - ignore that
-                ;
-            }
-            break;
-          // *** Mouse movement events
-          case	EV_REL:
-            switch ( inevent->code )
+            if ( hosts[h].ctlfd >= 0 || hosts[h].intfd >= 0 ||
+                 hosts[h].timerfd >= 0 )
             {
-              case	REL_X:
-              case	REL_Y:
-              case	REL_Z:
-              case	REL_WHEEL:
-                evmouse->btcode = 0xA1;
-                evmouse->rep_id = REPORTID_MOUSE;
-                evmouse->button = mousebuttons & 0x07;
-                evmouse->axis_x =
-                    ( inevent->code == REL_X ?
-                      inevent->value : 0 );
-                evmouse->axis_y =
-                    ( inevent->code == REL_Y ?
-                      inevent->value : 0 );
-                evmouse->axis_wheel =
-                    ( inevent->code >= REL_Z ?
-                      inevent->value : 0 );
-                j = send ( sockdesc, evmouse,
-                    sizeof(struct hidrep_mouse_t),
-                    MSG_NOSIGNAL );
-                if ( 1 > j )
-                {
-                    return	-1;
-                }
-                break;
+                host_cancel ( h );
+                host_dial ( h );
             }
-            break;
-          // *** Various events we do not know. Ignore those.
-          case	EV_ABS:
-          case	EV_MSC:
-          case	EV_LED:
-          case	EV_SND:
-          case	EV_REP:
-          case	EV_FF:
-          case	EV_PWR:
-          case	EV_FF_STATUS:
-            break;
         }
     }
-    return	0;
+    hosts_save ();
 }
 
-static int evt_select(int sec, int usec, fd_set * efds)
+// The session with bdaddr is gone: reconnect, unless on hold
+void	host_lost ( bdaddr_t * bdaddr )
 {
-    struct timeval tv;  // Used for "select"
-    int  maxevdevfileno = add_filedescriptors(efds);
-
-    tv.tv_sec  = sec;
-    tv.tv_usec = usec;
-    return select(maxevdevfileno+1, efds, NULL, NULL, &tv);
+    int	h;
+    if ( ( NULL == hostfile ) || prepareshutdown ) return;
+    if ( 0 > ( h = host_find ( bdaddr ) ) ) return;
+    if ( hosts[h].hold ) return;
+    hosts[h].backoff = RECONNECT_MIN;
+    host_dial ( h );
 }
 
-static int sc_accept(int sock, int wait_sec)
+// bdaddr was dropped on request: do not page it until it connects again
+void	host_hold ( bdaddr_t * bdaddr )
 {
-    struct timeval tv;  // Used for "select"
-    fd_set fds; 
-    int client;
-    int j;
-    struct sockaddr_l2	l2a;
-    socklen_t alen=sizeof(l2a);
-    char badr[40];
+    int	h;
+    if ( ( NULL == hostfile ) || ( 0 > ( h = host_find ( bdaddr ) ) ) ) return;
+    hosts[h].hold = 1;
+    host_cancel ( h );
+}
 
-    tv.tv_sec  = wait_sec;
-    tv.tv_usec = 0;
-    FD_ZERO ( &fds );
-    FD_SET  ( sock, &fds );
-    j = select ( sock + 1, &fds, NULL, NULL, &tv );
-    if ( j < 0 )
-    {
-        if ( errno == EINTR )
-        {	// Ctrl+C ? - handle that elsewhere
-            return 0;
-        }
-        return -2;
-    }
-    if ( j == 0 )
-    {
-        return 0;
+/*
+ *	input_result - Act on what parsing input returned (see
+ *	process_event): PAUSE drops the host(s) getting input,
+ *	LCtrl+LAlt+PAUSE ends the program
+ */
+void	input_result ( int j )
+{
+    int	i;
+    if ( -1 > j )
+    {	// LCtrl-LAlt-PAUSE - terminate program
+        prepareshutdown = 1;
     }
-    client = accept(sock, (struct sockaddr *)&l2a, &alen);
-    if ( client < 0 )
-    {
-        if ( errno == EAGAIN )
-            return 0;
-        else
-            return -1;
+    else if ( 0 > j )
+    {	// PAUSE pressed - close connection(s) getting input
+        for ( i = 0; i < MAXSESSIONS; ++i )
+        {
+            if ( ( broadcast || ( i == activesession ) ) &&
+                 ( sessions[i].sctl >= 0 ) )
+            {	// Do not reconnect on our own either
+                host_hold ( &sessions[i].bdaddr );
+                session_close ( i );
+            }
+        }
     }
-    ba2str ( &l2a.l2_bdaddr, badr );
-    badr[39] = 0;
-    fprintf ( stdout, "Incoming connection from node [%s] "
-            "accepted and established.\n", badr );
-    return client;
 }
 
+#ifndef HIDCLIENT_NO_MAIN	// else hidclient.h is all there is
 int	main ( int argc, char ** argv )
 {
-    int			i,  j;
+    int			i,  j, k, n;
     int			sockint, sockctl; // For the listening sockets
-    struct sockaddr_l2	l2a;
-    socklen_t		alen=sizeof(l2a);
-    int			sint,  sctl;	  // For the one-session-only
-                          // socket descriptor handles
-    char			badr[40];
-    fd_set			fds;		  // fds for listening sockets
-    fd_set			efds;	          // dev-event file descriptors
-    int			maxevdevfileno;
+    bdaddr_t		bdaddr;		  // remote end of a new connection
+    struct epoll_event	evs[MAXEPOLLEVS]; // ready fds from the reactor
+    sigset_t		sigmask, waitmask; // signals only arrive in epoll
+    int			retval = 0;
     char			skipsdp = 0;	  // On request, disable SDPreg
-    struct timeval		tv;		  // Used for "select"
-    int			evdevmask = 0;// If restricted to using only one evdev
-    int			mutex11 = 0;      // try to "mute" in x11?
     char			*fifoname = NULL; // Filename for fifo, if applicable
+    char			*recname = NULL; // --record: input log to write
+    char			*replayname = NULL; // --replay: input log to send
 
     // Parse command line
     for ( i = 1; i < argc; ++i )
@@ -1088,7 +4853,7 @@ int	main ( int argc, char ** argv )
             skipsdp = 1;
         }
         else if ( 0 == strncmp ( argv[i], "-e", 2 ) ) {
-            evdevmask |= 1 << atoi(argv[i]+2);
+            evdevmask |= 1ULL << ( atoi(argv[i]+2) & 63 );
         }
         else if ( 0 == strcmp ( argv[i], "-l" ) )
         {
@@ -1098,9 +4863,89 @@ int	main ( int argc, char ** argv )
         {
             debugevents = 0xffff;
         }
+        else if ( 0 == strncmp ( argv[i], "-b", 2 ) )
+        {
+            evbatch = atoi(argv[i]+2);
+            if ( ( evbatch < 1 ) || ( evbatch > MAXEVBATCH ) )
+            {
+                fprintf ( stderr, "Invalid batch size: \'%s\' (1..%d)\n",
+                    argv[i]+2, MAXEVBATCH );
+                return	1;
+            }
+        }
         else if ( 0 == strcmp ( argv[i], "-x" ) )
         {
-            mutex11 = 1;
+            evdevgrab = 1;
+        }
+        else if ( 0 == strncmp ( argv[i], "-r", 2 ) )
+        {
+            j = atoi ( argv[i] + 2 );
+            schedinterval = ( j > 0 ) ? 1000000000LL / j : 0;
+        }
+        else if ( 0 == strncmp ( argv[i], "-L", 2 ) )
+        {
+            schedlatency = atoi ( argv[i] + 2 ) * 1000000LL;
+        }
+        else if ( 0 == strncmp ( argv[i], "-a", 2 ) )
+        {
+            mouseage = atoi ( argv[i] + 2 ) * 1000000LL;
+        }
+        else if ( 0 == strcmp ( argv[i], "-n" ) )
+        {
+            nkro = 1;
+        }
+        else if ( 0 == strcmp ( argv[i], "-B" ) )
+        {
+            broadcast = 1;
+        }
+        else if ( 0 == strncmp ( argv[i], "-R", 2 ) )
+        {
+            hostfile = argv[i] + 2;
+        }
+        else if ( ( 0 == strcmp ( argv[i], "--record" ) ) && ( i + 1 < argc ) )
+        {
+            recname = argv[++i];
+        }
+        else if ( ( 0 == strcmp ( argv[i], "--replay" ) ) && ( i + 1 < argc ) )
+        {
+            replayname = argv[++i];
+        }
+        else if ( ( 0 == strcmp ( argv[i], "--speed" ) ) && ( i + 1 < argc ) )
+        {
+            replayspeed = strtod ( argv[++i], NULL );
+            if ( ! ( replayspeed > 0 ) )
+            {
+                fprintf ( stderr, "Invalid replay speed\n" );
+                return	1;
+            }
+        }
+        else if ( 0 == strncmp ( argv[i], "-F", 2 ) )
+        {
+            fifoname = argv[i] + 2;
+            fifoframed = 1;
+        }
+        else if ( 0 == strncmp ( argv[i], "-t", 2 ) )
+        {
+            threaded = 1;
+            if ( argv[i][2] != 0 ) inputcpu = atoi ( argv[i] + 2 );
+        }
+        else if ( 0 == strncmp ( argv[i], "-u", 2 ) )
+        {
+            injectpath = argv[i] + 2;
+        }
+        else if ( 0 == strncmp ( argv[i], "-k", 2 ) )
+        {
+            if ( 0 > loadkeymap ( argv[i] + 2 ) )
+            {
+                return	1;
+            }
+        }
+        else if ( 0 == strncmp ( argv[i], "-g", 2 ) )
+        {
+            if ( 0 > loadroutes ( argv[i] + 2 ) )
+            {
+                return	1;
+            }
         }
         else if ( 0 == strncmp ( argv[i], "-f", 2 ) )
         {
@@ -1112,182 +4957,370 @@ int	main ( int argc, char ** argv )
             return	1;
         }
     }
-    if ( ! skipsdp )
+    epollfd = epoll_create1 ( EPOLL_CLOEXEC );
+    if ( 0 > epollfd )
     {
-        if ( dosdpregistration() )
-        {
-            fprintf(stderr,"Failed to register with SDP server\n");
-            return	1;
-        }
+        fprintf ( stderr, "Failed to create epoll instance: %s\n",
+            strerror ( errno ) );
+        return	13;
+    }
+    // Adapter setup and registration complete in the background,
+    // while the input devices are opened, see dbus_result()
+    if ( dbus_start ( ! skipsdp ) )
+    {
+        fprintf(stderr,"Failed to register with SDP server\n");
+        return	1;
+    }
+    routes_init ();
+    if ( ( NULL != replayname ) && threaded )
+    {	// Replay is no input to be read
+        threaded = 0;
     }
-    if ( NULL == fifoname )
+    if ( input_setup () ) return 13;
+    // Input is registered disabled: nothing is read until a host connects
+    if ( NULL != replayname )
     {
-        if ( 1 > initevents (evdevmask, mutex11) )
+        for ( i = 0; i < MAXEVDEVS; ++i ) eventdevs[i] = -1;
+        if ( replay_open ( replayname ) ) return 2;
+    }
+    else if ( NULL == fifoname )
+    {
+        if ( 0 > ( i = initevents () ) )
         {
             fprintf ( stderr, "Failed to open event interface files\n" );
             return	2;
         }
+        if ( i == 0 )
+        {
+            fprintf ( stdout, "No input device yet, waiting for one\n" );
+        }
     } else {
-        if ( 1 > initfifo ( fifoname ) )
+        if ( ( 1 > initfifo ( fifoname ) ) ||
+             evt_addto ( inputepoll, eventdevs[0], EVTAG(EVTAG_EVDEV,0), 0 ) )
         {
             fprintf ( stderr, "Failed to create/open fifo [%s]\n", fifoname );
             return	2;
         }
     }
-    maxevdevfileno = add_filedescriptors ( &efds );
-    if ( maxevdevfileno <= 0 )
-    {
-        fprintf ( stderr, "Failed to organize event input.\n" );
-        return	13;
-    }
-    
-    system("hciconfig hci0 up");
-    //system("hciconfig hci0 class 0x0025c0");
-    //system("hciconfig hci0 name RaspberryPiVKBD");
-    system("hciconfig hci0 piscan");
-
-    sockint = socket ( AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP );
-    sockctl = socket ( AF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP );
-    if ( ( 0 > sockint ) || ( 0 > sockctl ) )
+    if ( ( NULL != recname ) && rec_open ( recname ) )
     {
-        fprintf ( stderr, "Failed to generate bluetooth sockets\n" );
         return	2;
     }
-    int reuse = 1;
-    if (setsockopt(sockint, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse)) < 0)
-        perror("setsockopt(SO_REUSEADDR) failed");
-    if (setsockopt(sockint, SOL_SOCKET, SO_REUSEPORT, (const char*)&reuse, sizeof(reuse)) < 0) 
-        perror("setsockopt(SO_REUSEPORT) failed");
-    if (setsockopt(sockctl, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse)) < 0)
-        perror("setsockopt(SO_REUSEADDR) failed");
-    if (setsockopt(sockctl, SOL_SOCKET, SO_REUSEPORT, (const char*)&reuse, sizeof(reuse)) < 0) 
-        perror("setsockopt(SO_REUSEPORT) failed");
-    if ( btbind ( sockint, PSMHIDINT ) || btbind ( sockctl, PSMHIDCTL ))
+    // The interrupt channel always comes in on our own socket; the
+    // control channel only with -s, else BlueZ hands it over
+    sockint = btlisten ( PSMHIDINT, EVTAG_LISTENINT );
+    sockctl = skipsdp ? btlisten ( PSMHIDCTL, EVTAG_LISTENCTL ) : -1;
+    if ( ( 0 > sockint ) || ( skipsdp && ( 0 > sockctl ) ) )
     {
-        fprintf ( stderr, "Failed to bind sockets (%d/%d) "
-                "to PSM (%d/%d)\n",
-                sockctl, sockint, PSMHIDCTL, PSMHIDINT );
-        return	3;
+        i = ( 0 > sockint ) ? sockint : sockctl;
+        if ( 0 <= sockint ) close ( sockint );
+        return	-i;
     }
-    if ( listen ( sockint, 1 ) || listen ( sockctl, 1 ) )
+    if ( ( NULL != injectpath ) && inject_init () )
     {
-        fprintf ( stderr, "Failed to listen on int/ctl BT socket\n" );
         close ( sockint );
-        close ( sockctl );
-        return	4;
+        if ( 0 <= sockctl ) close ( sockctl );
+        return	5;
     }
+    // Not fatal: the channels are tuned anyway, just not monitored
+    link_init ();
     // Add handlers to catch signals:
     // All do the same, terminate the program safely
     signal ( SIGHUP,  &onsignal );
     signal ( SIGTERM, &onsignal );
     signal ( SIGINT,  &onsignal );
+    signal ( SIGUSR1, &onsignal );	// dump latency statistics
+    // They are blocked except while waiting in epoll_pwait(), so a
+    // shutdown request can never slip in between check and wait
+    sigemptyset ( &sigmask );
+    sigaddset ( &sigmask, SIGHUP );
+    sigaddset ( &sigmask, SIGTERM );
+    sigaddset ( &sigmask, SIGINT );
+    sigaddset ( &sigmask, SIGUSR1 );
+    sigprocmask ( SIG_BLOCK, &sigmask, &waitmask );
+    statsbase = now_ns ();
+    if ( trace_start () || input_start () )
+    {
+        close ( sockint );
+        if ( 0 <= sockctl ) close ( sockctl );
+        return	6;
+    }
     fprintf ( stdout, "The HID-Client is now ready to accept connections "
             "from another machine\n" );
     //i = system ( "stty -echo" );	// Disable key echo to the console
+    for ( i = 0; i < MAXSESSIONS; ++i )
+    {
+        sessions[i].sctl = sessions[i].sint = -1;
+        sessions[i].sched.timerfd = -1;
+    }
+    if ( NULL != hostfile )
+    {	// Do not wait for the hosts, call them
+        for ( i = hosts_load (); i > 0; --i )
+        {
+            host_dial ( i - 1 );
+        }
+    }
     while ( 0 == prepareshutdown )
     {	// Wait for any shutdown-event to occur
-        sint = sctl = 0;
-        while (0 < (j = evt_select(0, 500, &efds))) // minimal delay
-        {	// Collect and discard input data as long as available
-            if ( -1 >  ( j = parse_events ( &efds, 0 ) ) )
-            {	// LCtrl-LAlt-PAUSE - terminate program
-                prepareshutdown = 1;
-                break;
-            }
-        }
-        if ( prepareshutdown )
-            break;
-
-        sctl = sc_accept(sockctl, 1);
-        if (sctl <= 0)
-        {
-            if (sctl == -2) {
-                fprintf ( stderr, "select() error on BT socket: %s! "
-                        "Aborting.\n", strerror(errno));
-                return 11;
-            }else if (sctl == -1){
-                fprintf ( stderr, "Failed to get a control connection:"
-                        " %s\n", strerror ( errno ) );
-            }else if (sctl == 0) {
-                // Nothing happened, check for shutdown req and retry
-                if ( debugevents & 0x2 )
-                    fprintf ( stdout, "," );
-            }
-            continue;
-        }
-
-        sint = sc_accept(sockint, 3);
-        if (sint <= 0)
-        {
-            close(sctl);
-            if (sint == -2) {
-                fprintf ( stderr, "select() error on BT socket: %s! "
-                        "Aborting.\n", strerror ( errno ) );
-                return	12;
-            }else if(sint == -1) {
-                fprintf ( stderr, "Interrupt connection failed to "
-                        "establish (control connection already"
-                        " there), timeout!\n" );
-            }else{
-                fprintf ( stderr, "Failed to get an interrupt "
-                        "connection: %s\n", strerror(errno));
-            }
-            continue;
-        }
-        while ( 0 < (j = evt_select(0, 0, &efds)))
+        // Input and connection setup are serviced by the same reactor;
+        // idle, only a connection attempt or a signal wakes us up
+        n = epoll_pwait ( epollfd, evs, MAXEPOLLEVS, -1, &waitmask );
+        if ( n < 0 )
         {
-            // This loop removes all input garbage that might be
-            // already in the queue
-            if ( -1 > ( j = parse_events ( &efds, 0 ) ) )
-            {	// LCtrl-LAlt-PAUSE - terminate program
-                prepareshutdown = 1;
-                break;
+            if ( errno == EINTR )
+            {	// Ctrl+C ? - handled by checking prepareshutdown
+                continue;
             }
+            fprintf ( stderr, "epoll_pwait() error: %s! Aborting.\n",
+                    strerror ( errno ) );
+            retval = 11;
+            break;
         }
-        memset (pressedkey, 0, 8 );
-        modifierkeys = 0;
-        mousebuttons = 0;
-        while (!prepareshutdown)
+        for ( k = 0; ( k < n ) && ( 0 == prepareshutdown ); ++k )
         {
-            while (0 < (j = evt_select(1, 0, &efds)))
+            switch ( EVTAG_TYPE(evs[k].data.u32) )
             {
-                if ( 0 > ( j = parse_events (&efds, sint ) ) )
+              case	EVTAG_EVDEV:
+                // Only enabled while a host is connected
+                if ( fifoframed )
                 {
-                    // PAUSE pressed - close connection
-                    // LCtrl-LAlt-PAUSE - terminate
-                    prepareshutdown = 1;
+                    input_result ( parse_frames () );
+                } else {
+                    input_result ( parse_events ( EVTAG_INDEX(evs[k].data.u32) ) );
+                }
+                break;
+              case	EVTAG_LISTENCTL:
+                if ( 0 > ( j = sc_accept ( sockctl, &bdaddr ) ) )
+                {
+                    fprintf ( stderr, "Failed to get a control "
+                        "connection: %s\n", strerror ( errno ) );
+                    break;
+                }
+                session_accept_ctl ( j, &bdaddr );
+                break;
+              case	EVTAG_LISTENINT:
+                if ( 0 > ( j = sc_accept ( sockint, &bdaddr ) ) )
+                {
+                    fprintf ( stderr, "Failed to get an interrupt "
+                        "connection: %s\n", strerror ( errno ) );
                     break;
                 }
+                session_accept_int ( j, &bdaddr );
+                break;
+              case	EVTAG_SCHED:
+                i = EVTAG_INDEX(evs[k].data.u32);
+                if ( session_up ( i ) &&
+                     ( 0 > sched_run ( &sessions[i].sched ) ) )
+                {	// Send failed - close connection
+                    sessions[i].dead = 1;
+                }
+                break;
+              case	EVTAG_HOTPLUG:
+                hotplug_event ();
+                break;
+              case	EVTAG_WATCHDOG:
+                input_watchdog ();
+                break;
+              case	EVTAG_PIPE:
+                pipe_drain ();
+                break;
+              case	EVTAG_HCI:
+                link_event ();
+                break;
+              case	EVTAG_LINK:
+                link_timer ();
+                break;
+              case	EVTAG_DBUS:
+                if ( dbus_result () )
+                {
+                    fprintf(stderr,"Failed to register with SDP server\n");
+                    retval = 1;
+                    prepareshutdown = 1;
+                }
+                break;
+              case	EVTAG_REPLAY:
+                input_result ( replay_run () );
+                break;
+              case	EVTAG_INJLISTEN:
+                inject_accept ();
+                break;
+              case	EVTAG_INJECT:
+                inject_read ( EVTAG_INDEX(evs[k].data.u32) );
+                break;
+              case	EVTAG_DIALCTL:
+              case	EVTAG_DIALINT:
+              case	EVTAG_DIALTMR:
+                // Next step of connecting to a remembered host
+                host_dial ( EVTAG_INDEX(evs[k].data.u32) );
+                break;
+              case	EVTAG_INT:
+                i = EVTAG_INDEX(evs[k].data.u32);
+                if ( ! session_up ( i ) ) break;
+                if ( evs[k].events & EPOLLIN )
+                {	// Output report from the host
+                    session_data ( i );
+                }
+                if ( ( evs[k].events & EPOLLOUT ) && ! sessions[i].dead &&
+                     ! ( evs[k].events & ( EPOLLHUP|EPOLLERR|EPOLLRDHUP ) ) )
+                {	// Link takes reports again
+                    if ( 0 > sched_writable ( &sessions[i].sched ) )
+                    {
+                        sessions[i].dead = 1;
+                    }
+                }
+                if ( evs[k].events & ( EPOLLHUP|EPOLLERR|EPOLLRDHUP ) )
+                {	// Hangup or error on either channel ends the session
+                    sessions[i].dead = 1;
+                }
+                break;
+              case	EVTAG_CTL:
+                i = EVTAG_INDEX(evs[k].data.u32);
+                if ( sessions[i].sctl < 0 ) break;
+                if ( ( evs[k].events & EPOLLIN ) && ! sessions[i].dead )
+                {	// Request from the host
+                    session_control ( i );
+                }
+                if ( evs[k].events & ( EPOLLHUP|EPOLLERR|EPOLLRDHUP ) )
+                {
+                    sessions[i].dead = 1;
+                }
+                break;
             }
         }
-        close ( sint );
-        close ( sctl );
-        sint = sctl =  0;
-        fprintf ( stderr, "Connection closed\n" );
-        usleep ( 500000 ); // Sleep 0.5 secs between connections
-                   // to not be flooded
+        // Sessions are only closed here, so no event still pending in
+        // evs[] can refer to a session slot reused in the meantime
+        session_reap ();
+        if ( ! threaded ) input_result ( input_resume () );
+        replay_kick ();
+        if ( statsdump )
+        {
+            statsdump = 0;
+            lat_dump ();
+        }
+    }
+    input_stop ();
+    for ( i = 0; i < MAXSESSIONS; ++i )
+    {
+        session_close ( i );
     }
     // After force disconnected, it has to powerdown immediatly, 
     // Otherwise, Windows will try 3 times to connect.
     // If all of them are fail, Windows will think it's a wrong device, and don't try to reconnect forever.
-    system("hciconfig hci0 down");
+    adapter_set ( "Powered", 0 );
+    inject_close ();
+    link_stop ();
     close ( sockint );
-    close ( sockctl );
-    if ( ! skipsdp )
+    if ( 0 <= sockctl ) close ( sockctl );
+    if ( sdpstate > 0 )
     {
         sdpunregister(); // Remove HID info from SDP server
     }
-    if ( NULL == fifoname )
+    dbus_stop ();
+    if ( NULL != replayname )
+    {
+        replay_close ();
+    }
+    else if ( NULL == fifoname )
     {
         closeevents ();
     } else {
         closefifo ();
     }
+    rec_close ();
+    close ( epollfd );
     cleanup_stdin ();	   // And remove the input queue from stdin
+    trace_stop ();
     fprintf ( stderr, "Stopped hidclient.\n" );
-    return	0;
+    return	retval;
+}
+#else
+
+//***************** Without main() (see hidclient.h)
+
+/*
+ *	hidclient_setup - Initialise what main() would for the report
+ *	path: routing, sessions and the reactor
+ *	Return value: 0 = OK, <0 = failure
+ */
+int	hidclient_setup ( void )
+{
+    int	i;
+    routes_init ();
+    for ( i = 0; i < MAXSESSIONS; ++i )
+    {
+        sessions[i].sctl = sessions[i].sint = -1;
+        sessions[i].sched.timerfd = -1;
+    }
+    for ( i = 0; i < MAXEVDEVS; ++i ) eventdevs[i] = -1;
+    if ( 0 > ( epollfd = epoll_create1 ( EPOLL_CLOEXEC ) ) ) return -1;
+    return	input_setup ();
+}
+
+/*
+ *	hidclient_host - Connect a host whose control and interrupt
+ *	channels are the (non-blocking) sockets ctl and intr
+ *	Returns session number or <0
+ */
+int	hidclient_host ( int ctl, int intr )
+{
+    bdaddr_t	bdaddr;
+    memset ( &bdaddr, 0, sizeof(bdaddr) );
+    if ( 0 > session_accept_ctl ( ctl, &bdaddr ) ) return -1;
+    return	session_accept_int ( intr, &bdaddr );
+}
+
+/*
+ *	hidclient_pump - Do for the sessions what the reactor would, without
+ *	waiting: answer control requests, send the reports that are due,
+ *	or all (flush set), and retry blocked interrupt channels
+ *	Return value: reports still queued for the hosts
+ */
+int	hidclient_pump ( int flush )
+{
+    struct epoll_event	evs[MAXEPOLLEVS];
+    int	n, k, s, queued = 0;
+    for ( s = 0; s < MAXSESSIONS; ++s )
+    {
+        if ( session_up ( s ) && sessions[s].sched.blocked )
+        {
+            sched_writable ( &sessions[s].sched );
+        }
+    }
+    n = epoll_wait ( epollfd, evs, MAXEPOLLEVS, 0 );
+    for ( k = 0; k < n; ++k )
+    {
+        s = EVTAG_INDEX(evs[k].data.u32);
+        if ( EVTAG_TYPE(evs[k].data.u32) == EVTAG_SCHED )
+        {
+            sched_run ( &sessions[s].sched );
+        }
+        if ( ( EVTAG_TYPE(evs[k].data.u32) == EVTAG_CTL ) &&
+             ( evs[k].events & EPOLLIN ) && session_up ( s ) )
+        {	// E.g. SET_PROTOCOL
+            session_control ( s );
+        }
+    }
+    if ( flush ) hid_flush ();
+    for ( s = 0; s < MAXSESSIONS; ++s )
+    {
+        if ( session_up ( s ) ) queued += sessions[s].sched.count;
+    }
+    return	queued;
+}
+
+// Start the latency statistics over
+void	lat_reset ( void )
+{
+    memset ( lathist, 0, sizeof(lathist) );
 }
 
+// p-th (0..1) percentile of the event->sent latency in ns, 1: maximum
+unsigned long long	lat_total ( double p )
+{
+    return	lat_percentile ( &lathist[LAT_TOTAL], p );
+}
+#endif // HIDCLIENT_NO_MAIN
+
 
 void	showhelp ( void )
 {
@@ -1299,8 +5332,23 @@ void	showhelp ( void )
 "-h|-?		Show this information\n" \
 "-e<num>\t	Don't use all devices; only event device(s) <num>\n" \
 "-f<name>	Use fifo <name> instead of event input devices\n" \
+"-F<name>	Dito, but the fifo carries frames of events/reports\n" \
+"-b<num>\t	Read at most <num> events per device at once (1..64)\n" \
+"-k<name>	Load keycode => HID usage overrides from layout file <name>\n" \
+"-r<hz>\t	Send at most <hz> reports per second (default: no limit)\n" \
+"-L<ms>\t	Hold reports back at most <ms> milliseconds (default: 4)\n" \
+"-a<ms>\t	Drop mouse motion older than <ms> milliseconds when sent\n" \
+"-n		Describe and send the keyboard as a bitmap of keys (NKRO)\n" \
+"-B		Send input to all connected hosts at once\n" \
+"-R<name>	Remember hosts in file <name> and reconnect to them\n" \
+"-u<name>	Accept raw HID reports on unix socket <name>\n" \
+"-t[<cpu>]	Read input in a thread of its own (pinned to <cpu>)\n" \
+"--record <name>	Log input sent to hosts into file <name>\n" \
+"--replay <name>	Send input logged in <name> instead of reading devices\n" \
+"--speed <x>	Replay <x> times as fast (default: 1.0)\n" \
 "-l		List available input devices\n" \
-"-x		Disable device in X11 while hidclient is running\n" \
+"-x		Grab devices exclusively while hidclient is running\n" \
+"-g<name>	Route devices to hosts by the rules in file <name>\n" \
 "-s|--skipsdp	Skip SDP registration\n" \
 "		Do not register with the Service Discovery Infrastructure\n" \
 "		(for debug purposes)\n\n" \
@@ -1313,13 +5361,22 @@ void	showhelp ( void )
 "This will even return to your xsession after hidclient terminates.\n\n" \
 "hidclient connections can be dropped at any time by pressing the PAUSE\n" \
 "key; the program will wait for other connections afterward.\n" \
-"To stop hidclient, press LeftCtrl+LeftAlt+Pause.\n"
+"Up to 4 hosts can be connected at once; LeftCtrl+LeftAlt+<1..4> selects\n" \
+"the one receiving input, LeftCtrl+LeftAlt+0 toggles sending to all.\n" \
+"To stop hidclient, press LeftCtrl+LeftAlt+Pause while connected, or\n" \
+"send it SIGINT/SIGTERM (input is not read while no host is connected).\n" \
+"SIGUSR1 prints input-to-radio latency percentiles and the report rate.\n"
         );
     return;
 }
 
 void	onsignal ( int i )
 {
+    if ( i == SIGUSR1 )
+    {	// Printed by the main loop, see lat_dump()
+        statsdump = 1;
+        return;
+    }
     fprintf ( stderr, "\nReceived signal %d\n", i);
     // Shutdown should be done if:
     switch ( i )
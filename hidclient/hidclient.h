@@ -0,0 +1,39 @@
+/*
+ * hidclient - What hidclient.c offers when it is built without its
+ *	       main() (-DHIDCLIENT_NO_MAIN), as bench does
+ *
+ *		The report path of hidclient runs as it is, only the host
+ *		is connected through a pair of sockets instead of L2CAP,
+ *		and nothing but that host's report timers and control
+ *		requests is left of the reactor: hidclient_pump() serves
+ *		them. Input goes to
+ *		process_event() as if read from event device slot 0.
+ *		Bluetooth, D-Bus and event devices are never touched.
+ *
+ * License:
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License as
+ *		published by the Free Software Foundation;
+ *		strictly version 2 only.
+ */
+#ifndef HIDCLIENT_H
+#define HIDCLIENT_H
+
+#include <linux/input.h>
+
+//***************** Options and state
+extern char	nkro;	// -n: bitmap keyboard reports
+extern long long	schedinterval; // -r: ns between reports, 0 = no limit
+extern unsigned long long	reportssent; // send() calls that went through
+extern __thread long long	stampread; // CLOCK_MONOTONIC ns input was read
+extern __thread long long	stampevent; // dito, of the current event
+
+//***************** Functions
+int	hidclient_setup ( void );
+int	hidclient_host ( int ctl, int intr );
+int	hidclient_pump ( int flush );
+int	process_event ( int i, struct input_event * inevent );
+void	lat_reset ( void );
+unsigned long long	lat_total ( double p );
+
+#endif // HIDCLIENT_H
@@ -0,0 +1,832 @@
+/*
+ * hidcore - The HID state machine of hidclient: input_events in, HID
+ *	     reports out (see hidcore.h)
+ *
+ * License:
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License as
+ *		published by the Free Software Foundation;
+ *		strictly version 2 only.
+ */
+//***************** Include files
+#include <string.h>
+#include "hidcore.h"
+
+//***************** Key translation tables
+// evdev keycode => HID usage (keyboard/keypad page), 0 = not translated
+unsigned char	hidcore_keymap[KEY_MAX+1] =
+{
+    [KEY_A]               = 0x04,
+    [KEY_B]               = 0x05,
+    [KEY_C]               = 0x06,
+    [KEY_D]               = 0x07,
+    [KEY_E]               = 0x08,
+    [KEY_F]               = 0x09,
+    [KEY_G]               = 0x0a,
+    [KEY_H]               = 0x0b,
+    [KEY_I]               = 0x0c,
+    [KEY_J]               = 0x0d,
+    [KEY_K]               = 0x0e,
+    [KEY_L]               = 0x0f,
+    [KEY_M]               = 0x10,
+    [KEY_N]               = 0x11,
+    [KEY_O]               = 0x12,
+    [KEY_P]               = 0x13,
+    [KEY_Q]               = 0x14,
+    [KEY_R]               = 0x15,
+    [KEY_S]               = 0x16,
+    [KEY_T]               = 0x17,
+    [KEY_U]               = 0x18,
+    [KEY_V]               = 0x19,
+    [KEY_W]               = 0x1a,
+    [KEY_X]               = 0x1b,
+    [KEY_Y]               = 0x1c,
+    [KEY_Z]               = 0x1d,
+    [KEY_1]               = 0x1e,
+    [KEY_2]               = 0x1f,
+    [KEY_3]               = 0x20,
+    [KEY_4]               = 0x21,
+    [KEY_5]               = 0x22,
+    [KEY_6]               = 0x23,
+    [KEY_7]               = 0x24,
+    [KEY_8]               = 0x25,
+    [KEY_9]               = 0x26,
+    [KEY_0]               = 0x27,
+    [KEY_ENTER]           = 0x28,
+    [KEY_ESC]             = 0x29,
+    [KEY_BACKSPACE]       = 0x2a,
+    [KEY_TAB]             = 0x2b,
+    [KEY_SPACE]           = 0x2c,
+    [KEY_MINUS]           = 0x2d,
+    [KEY_EQUAL]           = 0x2e,
+    [KEY_LEFTBRACE]       = 0x2f,
+    [KEY_RIGHTBRACE]      = 0x30,
+    [KEY_BACKSLASH]       = 0x31,
+    [KEY_102ND]           = 0x32,
+    [KEY_SEMICOLON]       = 0x33,
+    [KEY_APOSTROPHE]      = 0x34,
+    [KEY_GRAVE]           = 0x35,
+    [KEY_COMMA]           = 0x36,
+    [KEY_DOT]             = 0x37,
+    [KEY_SLASH]           = 0x38,
+    [KEY_CAPSLOCK]        = 0x39,
+    [KEY_F1]              = 0x3a,
+    [KEY_F2]              = 0x3b,
+    [KEY_F3]              = 0x3c,
+    [KEY_F4]              = 0x3d,
+    [KEY_F5]              = 0x3e,
+    [KEY_F6]              = 0x3f,
+    [KEY_F7]              = 0x40,
+    [KEY_F8]              = 0x41,
+    [KEY_F9]              = 0x42,
+    [KEY_F10]             = 0x43,
+    [KEY_F11]             = 0x44,
+    [KEY_F12]             = 0x45,
+    [KEY_SYSRQ]           = 0x46,
+    [KEY_SCROLLLOCK]      = 0x47,
+    [KEY_PAUSE]           = 0x48,
+    [KEY_INSERT]          = 0x49,
+    [KEY_HOME]            = 0x4a,
+    [KEY_PAGEUP]          = 0x4b,
+    [KEY_DELETE]          = 0x4c,
+    [KEY_END]             = 0x4d,
+    [KEY_PAGEDOWN]        = 0x4e,
+    [KEY_RIGHT]           = 0x4f,
+    [KEY_LEFT]            = 0x50,
+    [KEY_DOWN]            = 0x51,
+    [KEY_UP]              = 0x52,
+    [KEY_NUMLOCK]         = 0x53,
+    [KEY_KPSLASH]         = 0x54,
+    [KEY_KPASTERISK]      = 0x55,
+    [KEY_KPMINUS]         = 0x56,
+    [KEY_KPPLUS]          = 0x57,
+    [KEY_KPENTER]         = 0x58,
+    [KEY_KP1]             = 0x59,
+    [KEY_KP2]             = 0x5a,
+    [KEY_KP3]             = 0x5b,
+    [KEY_KP4]             = 0x5c,
+    [KEY_KP5]             = 0x5d,
+    [KEY_KP6]             = 0x5e,
+    [KEY_KP7]             = 0x5f,
+    [KEY_KP8]             = 0x60,
+    [KEY_KP9]             = 0x61,
+    [KEY_KP0]             = 0x62,
+    [KEY_KPDOT]           = 0x63,
+    [KEY_COMPOSE]         = 0x65,
+    [KEY_KPEQUAL]         = 0x67,
+    [KEY_F13]             = 0x68,
+    [KEY_F14]             = 0x69,
+    [KEY_F15]             = 0x6a,
+    [KEY_F16]             = 0x6b,
+    [KEY_F17]             = 0x6c,
+    [KEY_F18]             = 0x6d,
+    [KEY_F19]             = 0x6e,
+    [KEY_F20]             = 0x6f,
+    [KEY_F21]             = 0x70,
+    [KEY_F22]             = 0x71,
+    [KEY_F23]             = 0x72,
+    [KEY_F24]             = 0x73,
+    [KEY_OPEN]            = 0x74,
+    [KEY_HELP]            = 0x75,
+    [KEY_PROPS]           = 0x76,
+    [KEY_FRONT]           = 0x77,
+    [KEY_AGAIN]           = 0x79,
+    [KEY_UNDO]            = 0x7a,
+    [KEY_CUT]             = 0x7b,
+    [KEY_COPY]            = 0x7c,
+    [KEY_PASTE]           = 0x7d,
+    [KEY_KPCOMMA]         = 0x85,
+    [KEY_RO]              = 0x87,
+    [KEY_KATAKANAHIRAGANA] = 0x88,
+    [KEY_YEN]             = 0x89,
+    [KEY_HENKAN]          = 0x8a,
+    [KEY_MUHENKAN]        = 0x8b,
+    [KEY_KPJPCOMMA]       = 0x8c,
+    [KEY_HANGEUL]         = 0x90,
+    [KEY_HANJA]           = 0x91,
+    [KEY_KATAKANA]        = 0x92,
+    [KEY_HIRAGANA]        = 0x93,
+    [KEY_ZENKAKUHANKAKU]  = 0x94,
+    // 0xe8.. are not in the HID usage tables, Linux hosts map them to
+    // media keys (same codes as keyboard/keymap.py uses). Those with a
+    // consumer usage are sent as such, see hidcore_consumermap
+    [KEY_EDIT]            = 0xf7,
+};
+// evdev keycode => bit in the modifier byte of hidrep_keyb_t, 0 = none
+unsigned char	hidcore_modmap[KEY_MAX+1] =
+{
+    [KEY_LEFTCTRL]	= 0x01,
+    [KEY_LEFTSHIFT]	= 0x02,
+    [KEY_LEFTALT]	= 0x04,
+    [KEY_LEFTMETA]	= 0x08,
+    [KEY_RIGHTCTRL]	= 0x10,
+    [KEY_RIGHTSHIFT]	= 0x20,
+    [KEY_RIGHTALT]	= 0x40,
+    [KEY_RIGHTMETA]	= 0x80,
+};
+// evdev keycode => consumer page usage (hidrep_consumer_t), 0 = none
+unsigned short	hidcore_consumermap[KEY_MAX+1] =
+{
+    [KEY_BRIGHTNESSUP]	= 0x06f,
+    [KEY_BRIGHTNESSDOWN] = 0x070,
+    [KEY_PLAYCD]	= 0x0b0,
+    [KEY_PAUSECD]	= 0x0b1,
+    [KEY_RECORD]	= 0x0b2,
+    [KEY_FASTFORWARD]	= 0x0b3,
+    [KEY_REWIND]	= 0x0b4,
+    [KEY_NEXTSONG]	= 0x0b5,
+    [KEY_PREVIOUSSONG]	= 0x0b6,
+    [KEY_STOPCD]	= 0x0b7,
+    [KEY_EJECTCD]	= 0x0b8,
+    [KEY_PLAYPAUSE]	= 0x0cd,
+    [KEY_MUTE]		= 0x0e2,
+    [KEY_VOLUMEUP]	= 0x0e9,
+    [KEY_VOLUMEDOWN]	= 0x0ea,
+    [KEY_CONFIG]	= 0x183,
+    [KEY_MAIL]		= 0x18a,
+    [KEY_CALC]		= 0x192,
+    [KEY_WWW]		= 0x196,
+    [KEY_COFFEE]	= 0x19e,
+    [KEY_FIND]		= 0x21f,
+    [KEY_SEARCH]	= 0x221,
+    [KEY_HOMEPAGE]	= 0x223,
+    [KEY_BACK]		= 0x224,
+    [KEY_FORWARD]	= 0x225,
+    [KEY_STOP]		= 0x226,
+    [KEY_REFRESH]	= 0x227,
+    [KEY_BOOKMARKS]	= 0x22a,
+    [KEY_SCROLLUP]	= 0x233,
+    [KEY_SCROLLDOWN]	= 0x234,
+};
+// evdev keycode => bit in hidrep_system_t, 0 = none
+unsigned char	hidcore_sysmap[KEY_MAX+1] =
+{
+    [KEY_POWER]		= SYSTEM_POWER,
+    [KEY_SLEEP]		= SYSTEM_SLEEP,
+    [KEY_WAKEUP]	= SYSTEM_WAKE,
+};
+
+//***************** Pressed keys
+// The set of pressed usages is a bitmap (keybits), NKRO reports are
+// just a copy of it. The first KEYB_SLOTS keys also own an entry of
+// pressedkey, the key list of slot reports, and keyslot finds it again:
+// a released key's entry is refilled by the last one, so both key down
+// and key up are a few bit operations. Only releasing a listed key
+// while more than KEYB_SLOTS are down needs to look for one unlisted.
+
+// Usage u went down. Returns 1 if the set changed
+static int key_down ( struct hidcore_t * hc, int u )
+{
+    if ( hc->keybits[u >> 3] & ( 1 << ( u & 7 ) ) ) return 0;
+    hc->keybits[u >> 3] |= 1 << ( u & 7 );
+    ++hc->nkeys;
+    if ( hc->nslots < KEYB_SLOTS )
+    {
+        hc->pressedkey[hc->nslots++] = u;
+        hc->keyslot[u] = hc->nslots;
+    }
+    return	1;
+}
+
+// Usage u went up. Returns 1 if the set changed
+static int key_up ( struct hidcore_t * hc, int u )
+{
+    int	j, k;
+    if ( ! ( hc->keybits[u >> 3] & ( 1 << ( u & 7 ) ) ) ) return 0;
+    hc->keybits[u >> 3] &= ~( 1 << ( u & 7 ) );
+    --hc->nkeys;
+    if ( 0 == ( j = hc->keyslot[u] ) ) return 1;
+    hc->keyslot[u] = 0;
+    if ( j != hc->nslots )
+    {	// Last entry takes the free one
+        hc->pressedkey[j-1] = hc->pressedkey[hc->nslots-1];
+        hc->keyslot[hc->pressedkey[j-1]] = j;
+    }
+    hc->pressedkey[--hc->nslots] = 0;
+    if ( hc->nkeys > hc->nslots )
+    {	// A key held beyond KEYB_SLOTS gets listed now
+        for ( k = 0; k < 256; ++k )
+        {
+            if ( ( hc->keybits[k >> 3] & ( 1 << ( k & 7 ) ) ) && ! hc->keyslot[k] )
+            {
+                hc->pressedkey[hc->nslots++] = k;
+                hc->keyslot[k] = hc->nslots;
+                break;
+            }
+        }
+    }
+    return	1;
+}
+
+/*
+ *	keys_report - Write the keyboard report for the current keys and
+ *	modifiers to buf: the bitmap with nkro, else the key list, or the
+ *	phantom state (ErrorRollOver) if more keys are down than it holds.
+ *	Returns its length
+ */
+static int keys_report ( struct hidcore_t * hc, void * buf )
+{
+    struct hidrep_keyb_t	*kb = buf;
+    struct hidrep_nkro_t	*nk = buf;
+    kb->btcode = 0xA1;
+    kb->rep_id = REPORTID_KEYBD;
+    kb->modify = hc->modifiers;
+    if ( hc->nkro )
+    {
+        memcpy ( nk->bits, hc->keybits, NKRO_BYTES );
+        return	sizeof(*nk);
+    }
+    if ( hc->nkeys > KEYB_SLOTS )
+    {
+        memset ( kb->key, USAGE_ROLLOVER, KEYB_SLOTS );
+    } else {
+        memcpy ( kb->key, hc->pressedkey, KEYB_SLOTS );
+    }
+    return	sizeof(*kb);
+}
+
+//***************** Consumer and system control
+// Their own reports, each sent when its state changes only: media keys
+// neither take key slots nor resend the keyboard report.
+
+// Consumer usage u went down (down) or up. Returns 1 if the set changed
+static int consumer_key ( struct hidcore_t * hc, unsigned short u, int down )
+{
+    int	k, slot = -1;
+    for ( k = 0; k < CONSUMER_SLOTS; ++k )
+    {
+        if ( hc->consumer[k] == u )
+        {
+            if ( down ) return 0;
+            hc->consumer[k] = 0;
+            return	1;
+        }
+        if ( ( hc->consumer[k] == 0 ) && ( slot < 0 ) ) slot = k;
+    }
+    if ( ( ! down ) || ( slot < 0 ) ) return 0; // more keys held than sent
+    hc->consumer[slot] = u;
+    return	1;
+}
+
+// Write the consumer control report for the held usages to buf
+static int consumer_report ( struct hidcore_t * hc, void * buf )
+{
+    unsigned char	*p = buf;
+    int	k;
+    p[0] = 0xA1;
+    p[1] = REPORTID_CONSUMER;
+    for ( k = 0; k < CONSUMER_SLOTS; ++k )
+    {
+        p[2+2*k] = hc->consumer[k] & 0xff;
+        p[3+2*k] = hc->consumer[k] >> 8;
+    }
+    return	sizeof(struct hidrep_consumer_t);
+}
+
+// Write the system control report for the held keys to buf
+static int system_report ( struct hidcore_t * hc, void * buf )
+{
+    struct hidrep_system_t	*sy = buf;
+    sy->btcode = 0xA1;
+    sy->rep_id = REPORTID_SYSTEM;
+    sy->bits = hc->system;
+    return	sizeof(*sy);
+}
+
+//***************** Mouse frames
+
+// Take as much of *rest as fits into one report axis, keep the remainder
+int	hidcore_clamp ( int * rest )
+{
+    int	d = *rest;
+    if ( d > MOUSE_MAX )  d = MOUSE_MAX;
+    if ( d < -MOUSE_MAX ) d = -MOUSE_MAX;
+    *rest -= d;
+    return	d;
+}
+
+// The axes (x, y, wheel, pan) of a hidrep_mouse_t, byte order independent
+void	hidcore_mouse_get ( const void * report, int * axes )
+{
+    const unsigned char	*p = (const unsigned char *)report + 3;
+    int	k;
+    for ( k = 0; k < MOUSE_AXES; ++k, p += 2 )
+    {
+        axes[k] = (short)( p[0] | ( p[1] << 8 ) );
+    }
+}
+
+// Put as much of rest[MOUSE_AXES] into the report's axes as fits, keep
+// the remainder. Returns 1 if some is left for another report
+int	hidcore_mouse_put ( void * report, int * rest )
+{
+    unsigned char	*p = (unsigned char *)report + 3;
+    int	k, d, left = 0;
+    for ( k = 0; k < MOUSE_AXES; ++k, p += 2 )
+    {
+        d = hidcore_clamp ( &rest[k] );
+        p[0] = d & 0xff;
+        p[1] = ( d >> 8 ) & 0xff;
+        left |= ( rest[k] != 0 );
+    }
+    return	left;
+}
+
+/*	mouse_frame - Send the motion collected in one event frame.
+ *	Deltas exceeding the 16 bit range of hidrep_mouse_t are split
+ *	across several consecutive reports instead of being truncated.
+ *	Wheels count in WHEEL_UNIT per notch: a device's high resolution
+ *	events are taken as they are, others are scaled up.
+ */
+static void mouse_frame ( struct hidcore_t * hc, struct evframe_t * frame )
+{
+    struct hidrep_mouse_t	evmouse;
+    int	rest[MOUSE_AXES];
+    evmouse.btcode = 0xA1;
+    evmouse.rep_id = REPORTID_MOUSE;
+    evmouse.button = hc->buttons & 0x07;
+    rest[0] = frame->rel_x;
+    rest[1] = frame->rel_y;
+    rest[2] = ( frame->hires & 1 ) ? frame->hires_wheel :
+        frame->rel_wheel * WHEEL_UNIT;
+    rest[3] = ( frame->hires & 2 ) ? frame->hires_pan :
+        frame->rel_pan * WHEEL_UNIT;
+    while ( hidcore_mouse_put ( &evmouse, rest ) )
+    {
+        hc->sink ( hc->ctx, &evmouse, sizeof(struct hidrep_mouse_t),
+            frame->stamp );
+    }
+    hc->sink ( hc->ctx, &evmouse, sizeof(struct hidrep_mouse_t),
+        frame->stamp );
+    frame->rel_x = frame->rel_y = frame->rel_wheel = frame->rel_pan = 0;
+    frame->hires_wheel = frame->hires_pan = frame->hires = 0;
+    frame->dirty = 0;
+}
+
+//***************** Absolute pointers
+
+/*	hidcore_abs_setup - Input source slot is an absolute pointer with
+ *	ABS_X in xmin..xmax and ABS_Y in ymin..ymax; its BTN_TOUCH, BTN_STYLUS
+ *	and BTN_STYLUS2 become the buttons of hidrep_abs_t. An empty range
+ *	(xmax <= xmin) makes it none, ignoring those events again.
+ */
+void	hidcore_abs_setup ( struct hidcore_t * hc, int slot, int xmin, int xmax,
+		int ymin, int ymax )
+{
+    int	*r = hc->absrange[slot];
+    if ( ( xmax <= xmin ) || ( ymax <= ymin ) ) xmin = xmax = ymin = ymax = 0;
+    r[0] = xmin;
+    r[1] = xmax;
+    r[2] = ymin;
+    r[3] = ymax;
+}
+
+// Slot is an absolute pointer (has a range)
+static int is_abs ( struct hidcore_t * hc, int slot )
+{
+    return	hc->absrange[slot][1] > hc->absrange[slot][0];
+}
+
+// Position v in min..max scaled to 0..ABS_RANGE
+static unsigned short abs_scale ( int v, int min, int max )
+{
+    if ( v < min ) v = min;
+    if ( v > max ) v = max;
+    return	(long long)( v - min ) * ABS_RANGE / ( max - min );
+}
+
+// Send the absolute pointer's state at the end of an event frame
+static void abs_frame ( struct hidcore_t * hc, int slot, struct evframe_t * frame )
+{
+    struct hidrep_abs_t	evabs;
+    int	*r = hc->absrange[slot];
+    unsigned short	x = abs_scale ( frame->abs[0], r[0], r[1] );
+    unsigned short	y = abs_scale ( frame->abs[1], r[2], r[3] );
+    unsigned char	*p = (unsigned char *)&evabs.abs_x;
+    evabs.btcode = 0xA1;
+    evabs.rep_id = REPORTID_ABS;
+    evabs.button = frame->absbuttons;
+    p[0] = x & 0xff;
+    p[1] = x >> 8;
+    p[2] = y & 0xff;
+    p[3] = y >> 8;
+    hc->sink ( hc->ctx, &evabs, sizeof(evabs), frame->stamp );
+    frame->absdirty = 0;
+}
+
+//***************** Key ownership
+// Each held keycode remembers the slot that pressed it and since when,
+// so a device's keys can be released alone when it goes away or lost
+// events leave them stuck (hidcore_slot_sync).
+
+// Which reports a key_event() changed
+#define	CH_KEYB		1
+#define	CH_CONSUMER	2
+#define	CH_SYSTEM	4
+#define	CH_BUTTONS	8
+
+// Keycode went down (down) or up on slot. Returns the CH_* changed
+static int key_event ( struct hidcore_t * hc, int slot, int code, int down,
+		long long stamp )
+{
+    unsigned char	u, c;
+    unsigned short	cu;
+    int	changed = 0;
+    if ( ( code >= BTN_LEFT ) && ( code <= BTN_MIDDLE ) )
+    {
+        // Sent along with the motion at the end of the frame
+        c = 1 << ( code & 0x03 );
+        hc->buttons = ( hc->buttons & ( 0x07 - c ) ) | ( down ? c : 0 );
+        changed = CH_BUTTONS;
+    } else if ( 0 != ( u = hc->modmap[code] ) ) {
+        c = hc->modifiers;
+        hc->modifiers = ( hc->modifiers & ~u ) | ( down ? u : 0 );
+        if ( c != hc->modifiers ) changed = CH_KEYB;
+    } else if ( 0 != ( cu = hc->consumermap[code] ) ) {
+        if ( consumer_key ( hc, cu, down ) ) changed = CH_CONSUMER;
+    } else if ( 0 != ( u = hc->sysmap[code] ) ) {
+        c = hc->system;
+        hc->system = ( hc->system & ~u ) | ( down ? u : 0 );
+        if ( c != hc->system ) changed = CH_SYSTEM;
+    } else if ( 0 != ( u = hc->keymap[code] ) ) {
+        if ( down ? key_down ( hc, u ) : key_up ( hc, u ) ) changed = CH_KEYB;
+    } else {
+        // Unknown key usage - ignore that
+        return	0;
+    }
+    hc->keyowner[code] = down ? slot + 1 : 0;
+    hc->keysince[code] = stamp ? stamp : 1;
+    return	changed;
+}
+
+// Send the reports key_event() changed
+static void key_send ( struct hidcore_t * hc, int slot, int changed,
+		long long stamp )
+{
+    unsigned char	hidrep[MAXREPORT];
+    if ( changed & CH_KEYB )
+    {
+        hc->sink ( hc->ctx, hidrep, keys_report ( hc, hidrep ), stamp );
+    }
+    if ( changed & CH_CONSUMER )
+    {
+        hc->sink ( hc->ctx, hidrep, consumer_report ( hc, hidrep ), stamp );
+    }
+    if ( changed & CH_SYSTEM )
+    {
+        hc->sink ( hc->ctx, hidrep, system_report ( hc, hidrep ), stamp );
+    }
+    if ( changed & CH_BUTTONS )
+    {
+        hc->frames[slot].dirty = 1;
+    }
+}
+
+/*	hidcore_slot_sync - Bring the keys held by input source slot in line
+ *	with keys, the device's own key bitmap (EVIOCGKEY, KEY_MAX+1 bits):
+ *	what is down there but held by no slot is pressed, what the slot holds
+ *	but is up there is released, and the changed reports go out at once.
+ *	Returns the number of keys that changed
+ */
+int	hidcore_slot_sync ( struct hidcore_t * hc, int slot,
+		const unsigned char * keys, long long stamp )
+{
+    struct evframe_t	*frame = &hc->frames[slot];
+    int	code, down, owner, k, n = 0, changed = 0;
+    unsigned char	c = 0;
+    for ( code = 0; code <= KEY_MAX; ++code )
+    {
+        // PAUSE acts when released, and never stays down
+        if ( code == KEY_PAUSE ) continue;
+        down = ( keys[code >> 3] >> ( code & 7 ) ) & 1;
+        owner = hc->keyowner[code];
+        if ( down && ( owner == slot + 1 ) && stamp )
+        {
+            // Really held: it is not getting older
+            hc->keysince[code] = stamp;
+        }
+        if ( down ? ( owner != 0 ) : ( owner != slot + 1 ) ) continue;
+        changed |= key_event ( hc, slot, code, down, stamp );
+        n += ( hc->keyowner[code] != owner );
+    }
+    if ( is_abs ( hc, slot ) )
+    {
+        for ( k = 0; k < 3; ++k )
+        {
+            if ( ( keys[( BTN_TOUCH + k ) >> 3] >> ( ( BTN_TOUCH + k ) & 7 ) ) & 1 )
+            {
+                c |= 1 << k;
+            }
+        }
+        if ( c != frame->absbuttons )
+        {
+            frame->absbuttons = c;
+            frame->absdirty = 1;
+            ++n;
+        }
+    }
+    if ( ( changed & CH_BUTTONS ) || frame->absdirty )
+    {
+        if ( ! frame->stamp ) frame->stamp = stamp;
+        if ( changed & CH_BUTTONS ) mouse_frame ( hc, frame );
+        if ( frame->absdirty ) abs_frame ( hc, slot, frame );
+        frame->stamp = 0;
+    }
+    key_send ( hc, slot, changed & ~CH_BUTTONS, stamp );
+    return	n;
+}
+
+// Input source slot is gone: release whatever it holds
+int	hidcore_slot_release ( struct hidcore_t * hc, int slot, long long stamp )
+{
+    static const unsigned char	none[(KEY_MAX+1+7)/8];
+    return	hidcore_slot_sync ( hc, slot, none, stamp );
+}
+
+// Since when input source slot holds its oldest key, 0 if it holds none
+long long	hidcore_slot_held ( struct hidcore_t * hc, int slot )
+{
+    long long	since = 0;
+    int	code;
+    for ( code = 0; code <= KEY_MAX; ++code )
+    {
+        if ( ( hc->keyowner[code] == slot + 1 ) &&
+             ( ( since == 0 ) || ( hc->keysince[code] < since ) ) )
+        {
+            since = hc->keysince[code];
+        }
+    }
+    return	since;
+}
+
+//***************** Instances
+
+// Set up hc with the default tables, sending reports to sink(ctx, ...)
+void	hidcore_init ( struct hidcore_t * hc, hidcore_sink_t * sink, void * ctx )
+{
+    memset ( hc, 0, sizeof(*hc) );
+    hc->sink = sink;
+    hc->ctx = ctx;
+    hc->keymap = hidcore_keymap;
+    hc->modmap = hidcore_modmap;
+    hc->consumermap = hidcore_consumermap;
+    hc->sysmap = hidcore_sysmap;
+}
+
+// Everything released and forgotten, without sending anything
+void	hidcore_reset ( struct hidcore_t * hc )
+{
+    memset ( hc->keybits, 0, sizeof(hc->keybits) );
+    memset ( hc->keyslot, 0, sizeof(hc->keyslot) );
+    memset ( hc->pressedkey, 0, sizeof(hc->pressedkey) );
+    memset ( hc->frames, 0, sizeof(hc->frames) );
+    memset ( hc->consumer, 0, sizeof(hc->consumer) );
+    memset ( hc->keyowner, 0, sizeof(hc->keyowner) );
+    hc->nkeys = hc->nslots = 0;
+    hc->modifiers = hc->buttons = hc->system = 0;
+}
+
+// Input source slot is new: forget its unfinished mouse frame
+void	hidcore_slot_reset ( struct hidcore_t * hc, int slot )
+{
+    memset ( &hc->frames[slot], 0, sizeof(hc->frames[slot]) );
+}
+
+/*	hidcore_event - Translate one input_event from input source slot,
+ *	eventually handing out a hid report!
+ *	Returns HIDCORE_NONE, or what the caller has to do (HIDCORE_*)
+ */
+int	hidcore_event ( struct hidcore_t * hc, int slot, const struct input_event * inevent )
+{
+    struct evframe_t	*frame = &hc->frames[slot];
+    signed char	c;
+    unsigned char	hidrep[MAXREPORT];
+    struct hidrep_keyb_t  * evkeyb  = (void *)hidrep;
+    long long	stamp = (long long)inevent->time.tv_sec * 1000000000LL +
+        inevent->time.tv_usec * 1000LL;
+    switch ( inevent->type )
+    {
+      case	EV_SYN:
+        if ( inevent->code == SYN_DROPPED )
+        {
+            // The kernel's buffer overflowed: this frame and those up to
+            // the next SYN_REPORT are incomplete, drop them
+            frame->rel_x = frame->rel_y = frame->rel_wheel = frame->rel_pan = 0;
+            frame->hires_wheel = frame->hires_pan = frame->hires = 0;
+            frame->dirty = frame->absdirty = 0;
+            frame->stamp = 0;
+            frame->dropped = 1;
+            return	HIDCORE_NONE;
+        }
+        // End of an event frame: flush collected mouse data
+        if ( inevent->code != SYN_REPORT ) break;
+        if ( frame->dropped )
+        {
+            frame->dropped = 0;
+            return	HIDCORE_RESYNC;
+        }
+        if ( frame->dirty ) mouse_frame ( hc, frame );
+        if ( frame->absdirty ) abs_frame ( hc, slot, frame );
+        frame->stamp = 0;
+        break;
+      case	EV_KEY:
+        if ( frame->dropped ) break;
+        switch ( inevent->code )
+        {
+          // *** Absolute pointer contact and pen buttons
+          case	BTN_TOUCH:
+          case	BTN_STYLUS:
+          case	BTN_STYLUS2:
+            if ( ! is_abs ( hc, slot ) ) break;
+            c = 1 << ( inevent->code - BTN_TOUCH );
+            frame->absbuttons &= ~c;
+            if ( inevent->value >= 1 ) frame->absbuttons |= c;
+            frame->absdirty = 1;
+            break;
+          // *** Special key: PAUSE
+          case	KEY_PAUSE:	
+            // When released: abort connection
+            if ( inevent->value == 0 )
+            {
+                memset ( evkeyb, 0, sizeof(*evkeyb) );
+                evkeyb->btcode=0xA1;
+                evkeyb->rep_id=REPORTID_KEYBD;
+                // Released before the caller drops the connection
+                hc->sink ( hc->ctx, evkeyb, sizeof(struct hidrep_keyb_t), stamp );
+                // If also LCtrl+Alt pressed:
+                // Terminate program
+                if (( hc->modifiers & 0x5 ) == 0x5 )
+                {
+                return	HIDCORE_QUIT;
+                }
+                return	HIDCORE_PAUSE;
+            }
+            break;
+          default:
+            if ( inevent->code > KEY_MAX ) break;
+            // *** Host selection: LCtrl+LAlt+<1..hosts>, LCtrl+LAlt+0
+            // toggles broadcast to all hosts. Not sent to any host.
+            if ( (( hc->modifiers & 0x5 ) == 0x5 ) &&
+                 ( hc->modmap[inevent->code] == 0 ) &&
+                 ( ( inevent->code == KEY_0 ) || ( ( inevent->code >= KEY_1 )
+                   && ( inevent->code < KEY_1 + hc->hosts ) ) ) )
+            {
+                if ( inevent->value != 1 ) break;
+                if ( inevent->code == KEY_0 ) return HIDCORE_BROADCAST;
+                return	HIDCORE_SELECT ( inevent->code - KEY_1 );
+            }
+            // *** Buttons, modifiers, consumer, system and regular keys.
+            // Key repeat events are for the remote side to generate;
+            // only a changed set of keys is reported
+            if ( inevent->value > 1 ) break;
+            key_send ( hc, slot, key_event ( hc, slot, inevent->code,
+                inevent->value, stamp ), stamp );
+            break;
+        }
+        break;
+      // *** Mouse movement events
+      case	EV_REL:
+        if ( frame->dropped ) break;
+        switch ( inevent->code )
+        {
+          case	REL_X:
+            frame->rel_x += inevent->value;
+            frame->dirty = 1;
+            break;
+          case	REL_Y:
+            frame->rel_y += inevent->value;
+            frame->dirty = 1;
+            break;
+          case	REL_Z:
+          case	REL_WHEEL:
+            frame->rel_wheel += inevent->value;
+            frame->dirty = 1;
+            break;
+          case	REL_HWHEEL:
+            frame->rel_pan += inevent->value;
+            frame->dirty = 1;
+            break;
+          // Sent along with REL_WHEEL/REL_HWHEEL, and preferred to them
+          case	REL_WHEEL_HI_RES:
+            frame->hires_wheel += inevent->value;
+            frame->hires |= 1;
+            frame->dirty = 1;
+            break;
+          case	REL_HWHEEL_HI_RES:
+            frame->hires_pan += inevent->value;
+            frame->hires |= 2;
+            frame->dirty = 1;
+            break;
+        }
+        break;
+      // *** Absolute pointer position
+      case	EV_ABS:
+        if ( frame->dropped ) break;
+        if ( ! is_abs ( hc, slot ) ) break;
+        if ( ( inevent->code == ABS_X ) || ( inevent->code == ABS_Y ) )
+        {
+            frame->abs[inevent->code - ABS_X] = inevent->value;
+            frame->absdirty = 1;
+        }
+        break;
+      // *** Various events we do not know. Ignore those.
+      case	EV_MSC:
+      case	EV_LED:
+      case	EV_SND:
+      case	EV_REP:
+      case	EV_FF:
+      case	EV_PWR:
+      case	EV_FF_STATUS:
+        break;
+    }
+    // A frame's reports are as old as its first event
+    if ( ( frame->dirty || frame->absdirty ) && ! frame->stamp )
+    {
+        frame->stamp = stamp;
+    }
+    return	HIDCORE_NONE;
+}
+
+//***************** Loopback sink
+// For running a core without hidclient around it (tests, bench): set
+// it up with hidcore_init ( hc, hidcore_loopback_sink, lb ) and take
+// its reports from lb, in order. One thread feeds and takes.
+
+void	hidcore_loopback_init ( struct hidcore_loopback_t * lb )
+{
+    lb->head = lb->tail = 0;
+    lb->lost = 0;
+}
+
+// The sink, ctx is the struct hidcore_loopback_t
+void	hidcore_loopback_sink ( void * ctx, const void * report, int len,
+	long long stamp )
+{
+    struct hidcore_loopback_t	*lb = ctx;
+    if ( ( lb->head - lb->tail >= LOOPBACK_RING ) || ( len > (int)MAXREPORT ) )
+    {
+        ++lb->lost;
+        return;
+    }
+    lb->rep[lb->head % LOOPBACK_RING].stamp = stamp;
+    lb->rep[lb->head % LOOPBACK_RING].len = len;
+    memcpy ( lb->rep[lb->head % LOOPBACK_RING].data, report, len );
+    ++lb->head;
+}
+
+/*
+ *	hidcore_loopback_take - Take the oldest report of lb into report
+ *	(MAXREPORT bytes) and its timestamp into stamp (unless NULL)
+ *	Return value: its length, 0 = there is none
+ */
+int	hidcore_loopback_take ( struct hidcore_loopback_t * lb, void * report,
+	long long * stamp )
+{
+    int	len;
+    if ( lb->head == lb->tail ) return 0;
+    len = lb->rep[lb->tail % LOOPBACK_RING].len;
+    memcpy ( report, lb->rep[lb->tail % LOOPBACK_RING].data, len );
+    if ( NULL != stamp ) *stamp = lb->rep[lb->tail % LOOPBACK_RING].stamp;
+    ++lb->tail;
+    return	len;
+}
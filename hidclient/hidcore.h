@@ -0,0 +1,335 @@
+/*
+ * hidcore - The HID state machine of hidclient: input_events in, HID
+ *	     reports out
+ *
+ *		A struct hidcore_t holds everything known about the keys,
+ *		buttons and motion of its input, and hands the reports it
+ *		generates to a sink function. It does no I/O and keeps no
+ *		global state, so any number of instances can run side by
+ *		side, fed from any source (event devices, fifo, replay, a
+ *		benchmark) and sending anywhere (L2CAP sessions, loopback).
+ *
+ * License:
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License as
+ *		published by the Free Software Foundation;
+ *		strictly version 2 only.
+ */
+#ifndef HIDCORE_H
+#define HIDCORE_H
+
+#include <linux/input.h>
+
+//***************** Static definitions
+// Report IDs and sizes, used by the report structs below and by the
+// HID report descriptor below alike
+#define	REPORTID_MOUSE	1
+#define	REPORTID_KEYBD	2
+#define	REPORTID_ABS	3	// absolute pointer: touch screens, tablets
+#define	REPORTID_CONSUMER 4	// media keys, brightness... (consumer page)
+#define	REPORTID_SYSTEM	5	// power, sleep, wake up (system control)
+#define	KEYB_SLOTS	8	// keys in a report protocol keyboard report
+#define	BOOT_SLOTS	6	// dito, boot protocol
+#define	NKRO_BYTES	32	// -n: one bit for each usage 0..255
+#define	USAGE_ROLLOVER	0x01	// ErrorRollOver: too many keys pressed
+#define	CONSUMER_SLOTS	2	// consumer usages held at once
+#define	CONSUMER_MAX	0x3ff	// highest consumer usage sent
+#define	MOUSE_AXES	4	// x, y, wheel, horizontal wheel (AC Pan)
+#define	MOUSE_MAX	32767	// most motion per axis and mouse report
+#define	WHEEL_UNIT	120	// wheel motion per notch (Resolution Multiplier)
+#define	MULT_WHEEL	0x01	// mouse feature report: host set the wheel's
+#define	MULT_PAN	0x04	// dito, horizontal wheel's multiplier
+#define	ABS_RANGE	32767	// absolute pointer positions are 0..ABS_RANGE
+
+#ifndef REL_WHEEL_HI_RES	// Linux before 5.0
+#define	REL_WHEEL_HI_RES	0x0b
+#define	REL_HWHEEL_HI_RES	0x0c
+#endif
+
+
+// Input sources (e.g. event devices) one instance tells apart
+#define	HIDCORE_SLOTS	64
+
+// hidcore_event() results besides HIDCORE_NONE, for the caller to act on
+#define	HIDCORE_NONE	0
+#define	HIDCORE_PAUSE	1	// PAUSE released: drop the current host
+#define	HIDCORE_QUIT	2	// LCtrl+LAlt+PAUSE: terminate
+#define	HIDCORE_BROADCAST 3	// LCtrl+LAlt+0: toggle sending to all hosts
+#define	HIDCORE_RESYNC	4	// events of the slot were lost (SYN_DROPPED):
+				// fetch its keys, see hidcore_slot_sync()
+#define	HIDCORE_SELECT(n) ( 16 + (n) ) // LCtrl+LAlt+<n+1>: select host n
+
+//***************** Data structures
+// Mouse HID report, as sent over the wire. The axes are 16 bit little
+// endian, see hidcore_mouse_get()/hidcore_mouse_put():
+struct hidrep_mouse_t
+{
+    unsigned char	btcode;	// Fixed value for "Data Frame": 0xA1
+    unsigned char	rep_id; // Will be set to REPORTID_MOUSE for "mouse"
+    unsigned char	button;	// bits 0..2 for left,right,middle, others 0
+    short	axis_x; // relative movement in pixels, left/right
+    short	axis_y; // dito, up/down
+    short	axis_wheel; // scroll wheel, WHEEL_UNIT per notch
+    short	axis_pan; // dito, horizontal
+} __attribute((packed));
+// Absolute pointer HID report, as sent over the wire:
+struct hidrep_abs_t
+{
+    unsigned char	btcode;	// 0xA1
+    unsigned char	rep_id; // REPORTID_ABS
+    unsigned char	button;	// bit 0 touching/pen tip, 1..2 pen buttons
+    unsigned short	abs_x;	// 0..ABS_RANGE across the device, little endian
+    unsigned short	abs_y;	// dito
+} __attribute((packed));
+// Keyboard HID report, as sent over the wire:
+struct hidrep_keyb_t
+{
+    unsigned char	btcode; // Fixed value for "Data Frame": 0xA1
+    unsigned char	rep_id; // Will be set to REPORTID_KEYBD for "keyboard"
+    unsigned char	modify; // Modifier keys (shift, alt, the like)
+    unsigned char	key[KEYB_SLOTS]; // Currently pressed keys
+} __attribute((packed));
+// The two above (or hidrep_nkro_t with nkro set) are what the core
+// generates. Hosts negotiating otherwise get them re-encoded on the
+// way out (see report_encode in hidclient.c) as one of these:
+// Keyboard report with -n: a bit for every pressed usage
+struct hidrep_nkro_t
+{
+    unsigned char	btcode; // 0xA1
+    unsigned char	rep_id; // REPORTID_KEYBD
+    unsigned char	modify;
+    unsigned char	bits[NKRO_BYTES]; // usage u pressed: bit u%8 of bits[u/8]
+} __attribute((packed));
+// Boot protocol keyboard report (no report ID)
+struct hidrep_bootkeyb_t
+{
+    unsigned char	btcode; // 0xA1
+    unsigned char	modify;
+    unsigned char	reserved; // 0
+    unsigned char	key[BOOT_SLOTS];
+} __attribute((packed));
+// Consumer control HID report, as sent over the wire:
+struct hidrep_consumer_t
+{
+    unsigned char	btcode;	// 0xA1
+    unsigned char	rep_id; // REPORTID_CONSUMER
+    unsigned short	usage[CONSUMER_SLOTS]; // held usages, little endian, 0 = none
+} __attribute((packed));
+// System control HID report, as sent over the wire:
+struct hidrep_system_t
+{
+    unsigned char	btcode;	// 0xA1
+    unsigned char	rep_id; // REPORTID_SYSTEM
+    unsigned char	bits;	// SYSTEM_* held
+} __attribute((packed));
+#define	SYSTEM_POWER	0x01	// hidrep_system_t.bits: Power Down
+#define	SYSTEM_SLEEP	0x02	// dito, Sleep
+#define	SYSTEM_WAKE	0x04	// dito, Wake Up
+// Boot protocol mouse report (no report ID, no wheel, 8 bit motion)
+struct hidrep_bootmouse_t
+{
+    unsigned char	btcode; // 0xA1
+    unsigned char	button;
+    signed   char	axis_x;
+    signed   char	axis_y;
+} __attribute((packed));
+// Largest of the reports above, for buffers holding any of them
+#define	MAXREPORT	sizeof(struct hidrep_nkro_t)
+// Relative motion collected from one event device between two
+// EV_SYN/SYN_REPORT events, sent as one (or more) mouse reports, and
+// the position of an absolute pointer device:
+struct evframe_t
+{
+    int		rel_x;	// summed REL_X deltas
+    int		rel_y;	// summed REL_Y deltas
+    int		rel_wheel; // summed REL_WHEEL/REL_Z deltas (notches)
+    int		rel_pan; // summed REL_HWHEEL deltas (dito)
+    int		hires_wheel; // summed REL_WHEEL_HI_RES (WHEEL_UNIT/notch)
+    int		hires_pan; // summed REL_HWHEEL_HI_RES (dito)
+    char	hires;	// 1: hires_wheel, 2: hires_pan used in this frame
+    char	dirty;	// set if motion or buttons changed in this frame
+    int		abs[2];	// absolute pointer: last ABS_X, ABS_Y
+    unsigned char	absbuttons; // dito, BTN_TOUCH/BTN_STYLUS/BTN_STYLUS2
+    char	absdirty; // set if the absolute pointer changed
+    char	dropped; // SYN_DROPPED: ignore events up to SYN_REPORT
+    long long	stamp;	// timestamp (ns) of its first event, see below
+};
+
+
+//***************** HID report descriptor
+// Describes the reports above to the host. sdpgen puts it into the SDP
+// record at build time, so this is its only copy.
+// Items, short form with one or two data bytes
+#define	D_PAGE(p)		0x05, (p)
+#define	D_USAGE(u)		0x09, (u)
+#define	D_USAGE16(u)		0x0a, ( (u) & 0xff ), ( (u) >> 8 )
+#define	D_USAGE_MIN(u)		0x19, (u)
+#define	D_USAGE_MAX(u)		0x29, (u)
+#define	D_USAGE_MAX16(u)	0x2a, ( (u) & 0xff ), ( (u) >> 8 )
+#define	D_LOGICAL_MIN(v)	0x15, ( (v) & 0xff )
+#define	D_LOGICAL_MAX(v)	0x25, ( (v) & 0xff )
+#define	D_LOGICAL_MIN16(v)	0x16, ( (v) & 0xff ), ( ( (v) >> 8 ) & 0xff )
+#define	D_LOGICAL_MAX16(v)	0x26, ( (v) & 0xff ), ( ( (v) >> 8 ) & 0xff )
+#define	D_PHYS_MIN(v)		0x35, (v)
+#define	D_PHYS_MAX(v)		0x45, (v)
+#define	D_SIZE(n)		0x75, (n)
+#define	D_COUNT(n)		0x95, (n)
+#define	D_COUNT16(n)		0x96, ( (n) & 0xff ), ( (n) >> 8 )
+#define	D_REPORT_ID(i)		0x85, (i)
+#define	D_COLLECTION(c)		0xa1, (c)
+#define	D_END			0xc0
+#define	D_INPUT(f)		0x81, (f)
+#define	D_OUTPUT(f)		0x91, (f)
+#define	D_FEATURE(f)		0xb1, (f)
+#define	D_PUSH			0xa4
+#define	D_POP			0xb4
+#define	D_CONST			0x01	// Input/Output flags
+#define	D_ARRAY			0x00
+#define	D_VAR			0x02
+#define	D_REL			0x04
+// Mouse: hidrep_mouse_t. Each wheel sits in a logical collection with
+// its Resolution Multiplier (feature report, MULT_*): 1 or WHEEL_UNIT
+#define	DESC_MOUSE \
+    D_PAGE(0x01), D_USAGE(0x02), D_COLLECTION(0x01), \
+    D_REPORT_ID(REPORTID_MOUSE), D_USAGE(0x01), D_COLLECTION(0x00), \
+    D_PAGE(0x09), D_USAGE_MIN(1), D_USAGE_MAX(3), \
+    D_LOGICAL_MIN(0), D_LOGICAL_MAX(1), D_SIZE(1), D_COUNT(3), D_INPUT(D_VAR), \
+    D_SIZE(5), D_COUNT(1), D_INPUT(D_CONST), \
+    D_PAGE(0x01), D_USAGE(0x30), D_USAGE(0x31), \
+    D_LOGICAL_MIN16(-MOUSE_MAX), D_LOGICAL_MAX16(MOUSE_MAX), D_SIZE(16), \
+    D_COUNT(2), D_INPUT(D_VAR|D_REL), \
+    D_COLLECTION(0x02), \
+    D_USAGE(0x48), D_LOGICAL_MIN(0), D_LOGICAL_MAX(1), \
+    D_PHYS_MIN(1), D_PHYS_MAX(WHEEL_UNIT), D_SIZE(2), D_COUNT(1), \
+    D_PUSH, D_FEATURE(D_VAR), \
+    D_USAGE(0x38), D_LOGICAL_MIN16(-MOUSE_MAX), D_LOGICAL_MAX16(MOUSE_MAX), \
+    D_PHYS_MIN(0), D_PHYS_MAX(0), D_SIZE(16), D_INPUT(D_VAR|D_REL), \
+    D_END, \
+    D_COLLECTION(0x02), \
+    D_POP, D_USAGE(0x48), D_FEATURE(D_VAR), \
+    D_PHYS_MIN(0), D_PHYS_MAX(0), D_SIZE(4), D_FEATURE(D_CONST), \
+    D_PAGE(0x0c), D_USAGE16(0x0238), \
+    D_LOGICAL_MIN16(-MOUSE_MAX), D_LOGICAL_MAX16(MOUSE_MAX), D_SIZE(16), \
+    D_INPUT(D_VAR|D_REL), \
+    D_END, \
+    D_END, D_END
+// Absolute pointer: hidrep_abs_t
+#define	DESC_ABS \
+    D_PAGE(0x01), D_USAGE(0x02), D_COLLECTION(0x01), \
+    D_REPORT_ID(REPORTID_ABS), D_USAGE(0x01), D_COLLECTION(0x00), \
+    D_PAGE(0x09), D_USAGE_MIN(1), D_USAGE_MAX(3), \
+    D_LOGICAL_MIN(0), D_LOGICAL_MAX(1), D_SIZE(1), D_COUNT(3), D_INPUT(D_VAR), \
+    D_SIZE(5), D_COUNT(1), D_INPUT(D_CONST), \
+    D_PAGE(0x01), D_USAGE(0x30), D_USAGE(0x31), \
+    D_LOGICAL_MIN(0), D_LOGICAL_MAX16(ABS_RANGE), D_SIZE(16), D_COUNT(2), \
+    D_INPUT(D_VAR), D_END, D_END
+// Consumer control: hidrep_consumer_t
+#define	DESC_CONSUMER \
+    D_PAGE(0x0c), D_USAGE(0x01), D_COLLECTION(0x01), \
+    D_REPORT_ID(REPORTID_CONSUMER), D_USAGE_MIN(0x00), \
+    D_USAGE_MAX16(CONSUMER_MAX), D_LOGICAL_MIN(0), \
+    D_LOGICAL_MAX16(CONSUMER_MAX), D_SIZE(16), D_COUNT(CONSUMER_SLOTS), \
+    D_INPUT(D_ARRAY), D_END
+// System control: hidrep_system_t
+#define	DESC_SYSTEM \
+    D_PAGE(0x01), D_USAGE(0x80), D_COLLECTION(0x01), \
+    D_REPORT_ID(REPORTID_SYSTEM), D_USAGE_MIN(0x81), D_USAGE_MAX(0x83), \
+    D_LOGICAL_MIN(0), D_LOGICAL_MAX(1), D_SIZE(1), D_COUNT(3), D_INPUT(D_VAR), \
+    D_SIZE(5), D_COUNT(1), D_INPUT(D_CONST), D_END
+// Keyboard, up to the key array: report ID, modifier byte, LED output
+#define	DESC_KEYB_HEAD \
+    D_PAGE(0x01), D_USAGE(0x06), D_COLLECTION(0x01), \
+    D_REPORT_ID(REPORTID_KEYBD), D_COLLECTION(0x00), \
+    D_PAGE(0x07), D_USAGE_MIN(0xe0), D_USAGE_MAX(0xe7), \
+    D_LOGICAL_MIN(0), D_LOGICAL_MAX(1), D_SIZE(1), D_COUNT(8), D_INPUT(D_VAR), \
+    D_COUNT(5), D_SIZE(1), D_PAGE(0x08), D_USAGE_MIN(1), D_USAGE_MAX(5), \
+    D_OUTPUT(D_VAR), D_COUNT(1), D_SIZE(3), D_OUTPUT(D_CONST)
+// Keys: KEYB_SLOTS usages (hidrep_keyb_t) ...
+#define	DESC_KEYB_SLOTS \
+    D_COUNT(KEYB_SLOTS), D_SIZE(8), D_LOGICAL_MIN(0), D_LOGICAL_MAX16(0xff), \
+    D_PAGE(0x07), D_USAGE_MIN(0x00), D_USAGE_MAX(0xff), D_INPUT(D_ARRAY), \
+    D_END, D_END
+// ... or a bitmap of them (hidrep_nkro_t)
+#define	DESC_KEYB_NKRO \
+    D_COUNT16(NKRO_BYTES*8), D_SIZE(1), D_LOGICAL_MIN(0), D_LOGICAL_MAX(1), \
+    D_PAGE(0x07), D_USAGE_MIN(0x00), D_USAGE_MAX(0xff), D_INPUT(D_VAR), \
+    D_END, D_END
+
+
+// Receives every report generated, in order, with the timestamp of the
+// input_event causing it (ns, 0 = unknown). Mouse reports carry that
+// of the first event of their frame. The core takes input_event.time
+// as it is; callers make it CLOCK_MONOTONIC (see lat_event())
+typedef void hidcore_sink_t ( void * ctx, const void * report, int len,
+	long long stamp );
+
+// One instance of the state machine, set up by hidcore_init()
+struct hidcore_t
+{
+    hidcore_sink_t	*sink;
+    void	*ctx;	// passed to sink
+    const unsigned char	*keymap; // evdev keycode => usage, see hidcore_keymap
+    const unsigned char	*modmap; // dito => modifier bit
+    const unsigned short	*consumermap; // dito => consumer usage
+    const unsigned char	*sysmap; // dito => SYSTEM_* bit
+    char	nkro;	// generate hidrep_nkro_t instead of hidrep_keyb_t
+    int		hosts;	// LCtrl+LAlt+<1..hosts> select a host
+    unsigned char	modifiers; // shift/ctrl/alt... status
+    unsigned char	buttons; // mouse button status
+    unsigned char	keybits[NKRO_BYTES]; // pressed usages, see hidcore.c
+    unsigned char	keyslot[256]; // usage => its entry in pressedkey + 1
+    unsigned char	pressedkey[KEYB_SLOTS]; // first pressed usages
+    int		nkeys;	// usages set in keybits
+    int		nslots;	// used entries of pressedkey
+    unsigned short	consumer[CONSUMER_SLOTS]; // held consumer usages
+    unsigned char	system;	// held SYSTEM_* keys
+    unsigned char	keyowner[KEY_MAX+1]; // evdev keycode => slot + 1 holding it
+    long long	keysince[KEY_MAX+1]; // dito => stamp it went down
+    struct evframe_t	frames[HIDCORE_SLOTS]; // pending mouse frame per slot
+    int		absrange[HIDCORE_SLOTS][4]; // see hidcore_abs_setup()
+};
+
+// Loopback sink: keeps the reports of a core for the caller to take
+// instead of sending them, see hidcore_loopback_sink()
+#define	LOOPBACK_RING	256	// reports (power of two)
+struct hidcore_loopback_t
+{
+    unsigned int	head;	// next report to store
+    unsigned int	tail;	// next report to take
+    unsigned long long	lost;	// reports dropped because the ring was full
+    struct
+    {
+        long long	stamp;	// as passed to the sink
+        unsigned char	len;
+        unsigned char	data[MAXREPORT];
+    }	rep[LOOPBACK_RING];
+};
+
+//***************** Key translation tables
+// The default tables of all instances; -k (loadkeymap) overrides entries
+extern unsigned char	hidcore_keymap[KEY_MAX+1];
+extern unsigned char	hidcore_modmap[KEY_MAX+1];
+extern unsigned short	hidcore_consumermap[KEY_MAX+1];
+extern unsigned char	hidcore_sysmap[KEY_MAX+1];
+
+//***************** Functions
+void	hidcore_init ( struct hidcore_t * hc, hidcore_sink_t * sink, void * ctx );
+void	hidcore_reset ( struct hidcore_t * hc );
+void	hidcore_slot_reset ( struct hidcore_t * hc, int slot );
+int	hidcore_event ( struct hidcore_t * hc, int slot, const struct input_event * ie );
+void	hidcore_abs_setup ( struct hidcore_t * hc, int slot, int xmin, int xmax,
+		int ymin, int ymax );
+int	hidcore_slot_sync ( struct hidcore_t * hc, int slot,
+		const unsigned char * keys, long long stamp );
+int	hidcore_slot_release ( struct hidcore_t * hc, int slot, long long stamp );
+long long	hidcore_slot_held ( struct hidcore_t * hc, int slot );
+int	hidcore_clamp ( int * rest );
+void	hidcore_mouse_get ( const void * report, int * axes );
+int	hidcore_mouse_put ( void * report, int * rest );
+void	hidcore_loopback_init ( struct hidcore_loopback_t * lb );
+void	hidcore_loopback_sink ( void * ctx, const void * report, int len,
+		long long stamp );
+int	hidcore_loopback_take ( struct hidcore_loopback_t * lb, void * report,
+		long long * stamp );
+
+#endif // HIDCORE_H
@@ -0,0 +1,229 @@
+/*
+ * sdpgen - Generate the SDP record of hidclient at build time
+ *
+ *		Writes sdprecord.h to stdout: the service record hidclient
+ *		registers with BlueZ, with the HID report descriptor of
+ *		hidcore.h hex encoded into attribute 0x0206. One record per
+ *		keyboard format (slots or -n bitmap) and HID Reconnect
+ *		Initiate value (-R or not), so hidclient only has to pick one.
+ *		Comments and indentation are left out of the generated
+ *		records, there is no one to read them but the XML parser.
+ *
+ * License:
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License as
+ *		published by the Free Software Foundation;
+ *		strictly version 2 only.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "hidcore.h"
+
+const unsigned char	desc_slots[] = { DESC_MOUSE, DESC_KEYB_HEAD, DESC_KEYB_SLOTS, DESC_ABS,
+    DESC_CONSUMER, DESC_SYSTEM };
+const unsigned char	desc_nkro[]  = { DESC_MOUSE, DESC_KEYB_HEAD, DESC_KEYB_NKRO, DESC_ABS,
+    DESC_CONSUMER, DESC_SYSTEM };
+#define	DESCMAX	( sizeof(desc_nkro) > sizeof(desc_slots) ? sizeof(desc_nkro) : sizeof(desc_slots) )
+
+// The record: 0x0205 (first %s) and the descriptor (0x0206) are filled in
+const char *sdp_record = 
+"<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n"
+"\n"
+"<record>\n"
+"    <attribute id=\"0x0001\">    <!-- SDP_ATTR_SVCLASS_ID_LIST -->\n"
+"        <sequence>\n"
+"            <uuid value=\"0x1124\" />\n"
+"        </sequence>\n"
+"    </attribute>\n"
+"    <attribute id=\"0x0004\"> <!-- SDP_ATTR_PROTO_DESC_LIST    -->\n"
+"        <sequence>\n"
+"            <sequence>\n"
+"                <uuid value=\"0x0100\" />\n"
+"                <uint16 value=\"0x0011\" />\n"
+"            </sequence>\n"
+"            <sequence>\n"
+"                <uuid value=\"0x0011\" />\n"
+"            </sequence>\n"
+"        </sequence>\n"
+"    </attribute>\n"
+"    <attribute id=\"0x0005\">  <!-- SDP_ATTR_BROWSE_GRP_LIST -->\n"
+"        <sequence>\n"
+"            <uuid value=\"0x1002\" />\n"
+"        </sequence>\n"
+"    </attribute>\n"
+"    <attribute id=\"0x0006\">  <!-- SDP_ATTR_LANG_BASE_ATTR_ID_LIST        -->\n"
+"        <sequence>\n"
+"            <uint16 value=\"0x656e\" />    <!-- Natural Language Code = English -->\n"
+"            <uint16 value=\"0x006a\" />     <!-- Character Encoding = UTF-8 -->\n"
+"            <uint16 value=\"0x0100\" />    <!-- String Base = 0x0100 -->\n"
+"        </sequence>\n"
+"    </attribute>\n"
+"    <attribute id=\"0x0009\">    <!-- SDP_ATTR_PFILE_DESC_LIST -->\n"
+"        <sequence>\n"
+"            <sequence>\n"
+"                <uuid value=\"0x1124\" />    <!-- Human Interface Device -->\n"
+"                <uint16 value=\"0x0100\" />     <!-- L2CAP -->\n"
+"            </sequence>\n"
+"        </sequence>\n"
+"    </attribute>\n"
+"    <attribute id=\"0x000d\">  <!-- Additional Protocol Descriptor Lists -->\n"
+"        <sequence>\n"
+"            <sequence>\n"
+"                <sequence>\n"
+"                    <uuid value=\"0x0100\" />\n"
+"                    <uint16 value=\"0x0013\" />\n"
+"                </sequence>\n"
+"                <sequence>\n"
+"                    <uuid value=\"0x0011\" />\n"
+"                </sequence>\n"
+"            </sequence>\n"
+"        </sequence>\n"
+"    </attribute>\n"
+"    <attribute id=\"0x0100\">    <!-- service name  -->\n"
+"        <text value=\"Raspberry Pi Virtual Keyboard\" />\n"
+"    </attribute>\n"
+"    <attribute id=\"0x0101\">    <!-- service description -->\n"
+"        <text value=\"USB > BT Keyboard\" />\n"
+"    </attribute>\n"
+"    <attribute id=\"0x0102\">    <!-- service provider -->\n"
+"        <text value=\"Raspberry Pi\" />\n"
+"    </attribute>\n"
+"    <attribute id=\"0x0200\"> <!-- SDP_ATTR_HID_DEVICE_RELEASE_NUMBER -->\n"
+"        <uint16 value=\"0x0100\" />\n"
+"    </attribute>\n"
+"    <attribute id=\"0x0201\"> <!-- HID Parser Version = 1.11         -->\n"
+"        <uint16 value=\"0x0111\" />\n"
+"    </attribute>\n"
+"    <attribute id=\"0x0202\">    <!-- HID Subclass = Combo Keyboard/Pointing -->\n"
+"        <uint8 value=\"0xc0\" />\n"
+"    </attribute>\n"
+"    <attribute id=\"0x0203\"> <!-- HID Country Code = ??         -->\n"
+"        <uint8 value=\"0x00\" />\n"
+"    </attribute>\n"
+"    <attribute id=\"0x0204\">    <!-- HID Virtual Cable = False            -->\n"
+"        <boolean value=\"false\" />\n"
+"    </attribute>\n"
+"    <attribute id=\"0x0205\"> <!-- HID Reconnect Initiate = -R given? -->\n"
+"        <boolean value=\"%s\" />\n"
+"    </attribute>\n"
+"    <attribute id=\"0x0206\">    <!-- HID Descriptor List -->\n"
+"        <sequence>\n"
+"            <sequence>\n"
+"                <uint8 value=\"0x22\" />  <!-- Class Descriptor Type = Report -->\n"
+"                <text encoding=\"hex\" value=\"%s\"/>\n"
+"            </sequence>\n"
+"        </sequence>\n"
+"    </attribute>\n"
+"    <attribute id=\"0x0207\">    <!--HID LANGID Base List        -->\n"
+"        <sequence>    <!-- HID LANGID Base -->\n"
+"            <sequence>\n"
+"                <uint16 value=\"0x0409\" />    <!-- Natural Language Code = English (United States) -->\n"
+"                <uint16 value=\"0x0100\" />    <!-- String Base = 0x0100 -->\n"
+"            </sequence>\n"
+"        </sequence>\n"
+"    </attribute>\n"
+"    <attribute id=\"0x020b\">    <!-- SDP_ATTR_HID_PROFILE_VERSION        -->\n"
+"        <uint16 value=\"0x0100\" />\n"
+"    </attribute>\n"
+"    <attribute id=\"0x020c\">    <!--SDP_ATTR_HID_SUPERVISION_TIMEOUT    -->\n"
+"        <uint16 value=\"0x0c80\" />\n"
+"    </attribute>\n"
+"    <attribute id=\"0x020d\">    <!-- SDP_ATTR_HID_NORMALLY_CONNECTABLE -->\n"
+"        <boolean value=\"true\" />\n"
+"    </attribute>\n"
+"    <attribute id=\"0x020e\">    <!--SDP_ATTR_HID_BOOT_DEVICE-->\n"
+"        <boolean value=\"true\" />\n"
+"    </attribute>\n"
+"    <attribute id=\"0x020f\">\n"
+"        <uint16 value=\"0x0640\" />\n"
+"    </attribute>\n"
+"    <attribute id=\"0x0210\">\n"
+"        <uint16 value=\"0x0320\" />\n"
+"    </attribute>\n"
+"</record>";
+
+/*
+ *	putrecord - Write the record as a C string literal, one element per
+ *	line, without the XML comments and the whitespace between elements
+ *	Return value: 0 = OK, <0 = the record did not fit
+ */
+int	putrecord ( const char * reconnect, const unsigned char * desc, int len )
+{
+    char	xml[8192];
+    char	hex[2*DESCMAX+1];
+    char	*p;
+    int		k, intag = 0, quoted = 0;
+    if ( len > (int)DESCMAX )
+    {
+        fprintf ( stderr, "sdpgen: descriptor of %d bytes too long\n", len );
+        return	-1;
+    }
+    for ( k = 0; k < len; ++k )
+    {
+        sprintf ( hex + 2 * k, "%02X", desc[k] );
+    }
+    hex[2*len] = 0;
+    if ( snprintf ( xml, sizeof(xml), sdp_record, reconnect, hex ) >= (int)sizeof(xml) )
+    {
+        fprintf ( stderr, "sdpgen: record longer than %d bytes\n", (int)sizeof(xml) );
+        return	-1;
+    }
+    printf ( "    \"" );
+    for ( p = xml; *p; ++p )
+    {
+        if ( ! intag )
+        {	// Between elements: drop comments and whitespace
+            if ( 0 == strncmp ( p, "<!--", 4 ) )
+            {
+                p = strstr ( p, "-->" ) + 2;
+                continue;
+            }
+            if ( ( *p == ' ' ) || ( *p == '\n' ) ) continue;
+            if ( *p == '<' )
+            {
+                if ( p != xml ) printf ( "\"\n    \"" );
+                intag = 1;
+            }
+        }
+        else if ( *p == '"' )
+        {
+            quoted = ! quoted;
+        }
+        else if ( ( *p == '>' ) && ! quoted )
+        {
+            intag = 0;
+        }
+        if ( *p == '"' ) putchar ( '\\' );
+        putchar ( *p );
+    }
+    printf ( "\"" );
+    return	0;
+}
+
+int	main ( void )
+{
+    const char	*reconnect[2] = { "false", "true" };
+    int		n, r, e;
+    printf ( "// Generated by sdpgen from hidcore.h - do not edit\n" );
+    printf ( "const char * const sdp_records[2][2] = {\n" );
+    for ( n = 0; n < 2; ++n )
+    {
+        printf ( "  {\n" );
+        for ( r = 0; r < 2; ++r )
+        {
+            printf ( "  // %s, HID Reconnect Initiate %s\n",
+                n ? "NKRO bitmap (-n)" : "key slots", reconnect[r] );
+            if ( n )
+            {
+                e = putrecord ( reconnect[r], desc_nkro, sizeof(desc_nkro) );
+            } else {
+                e = putrecord ( reconnect[r], desc_slots, sizeof(desc_slots) );
+            }
+            if ( e < 0 ) return 1;
+            printf ( r ? "\n" : ",\n" );
+        }
+        printf ( n ? "  }\n" : "  },\n" );
+    }
+    printf ( "};\n" );
+    return	0;
+}